@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <time.h>
+#include "cirbuf.h"
+#include "lfring.h"
+
+#define BENCH_MAXPAIRS	16
+#define LAT_EVERY	64	/* time one item out of LAT_EVERY */
+#define LAT_SLOTS	1024	/* > CIR_BUFLEN / LAT_EVERY in flight */
+#define LAT_BUCKETS	40	/* log2 nanoseconds */
+
+/*
+ * The queue under test. Items are opaque pointers; the benchmark passes
+ * sequence numbers + 1 and never dereferences them. Any other queue
+ * with the same insert/consume contract can be added to queues[].
+ */
+struct queueops {
+	const char *name;
+	void * (*init)(void);
+	void (*exit)(void *q);
+	void (*insert)(void *q, const struct record *rec);
+	const struct record * (*consume)(void *q);
+	int (*full)(void *q);
+	int (*empty)(void *q);
+	void (*waits)(void *q, unsigned long *p, unsigned long *c);
+	int capacity;
+};
+
+static void * cb_init(void)
+{
+	return cirbuf_init();
+}
+
+static void cb_exit(void *q)
+{
+	cirbuf_exit(q);
+}
+
+static void cb_insert(void *q, const struct record *rec)
+{
+	cirbuf_insert(q, rec);
+}
+
+static const struct record * cb_consume(void *q)
+{
+	return cirbuf_consume(q);
+}
+
+static int cb_full(void *q)
+{
+	struct cirbuf *cbuf = q;
+	int full;
+
+	pthread_mutex_lock(&cbuf->mutex);
+	full = cirbuf_full(cbuf);
+	pthread_mutex_unlock(&cbuf->mutex);
+	return full;
+}
+
+static int cb_empty(void *q)
+{
+	struct cirbuf *cbuf = q;
+	int empty;
+
+	pthread_mutex_lock(&cbuf->mutex);
+	empty = cirbuf_empty(cbuf);
+	pthread_mutex_unlock(&cbuf->mutex);
+	return empty;
+}
+
+static void cb_waits(void *q, unsigned long *p, unsigned long *c)
+{
+	struct cirbuf *cbuf = q;
+
+	*p = cbuf->p_waits;
+	*c = cbuf->c_waits;
+}
+
+static void * lf_init(void)
+{
+	return lfring_init();
+}
+
+static void lf_exit(void *q)
+{
+	lfring_exit(q);
+}
+
+static void lf_insert(void *q, const struct record *rec)
+{
+	lfring_insert(q, rec);
+}
+
+static const struct record * lf_consume(void *q)
+{
+	return lfring_consume(q);
+}
+
+static int lf_full(void *q)
+{
+	return lfring_full(q);
+}
+
+static int lf_empty(void *q)
+{
+	return lfring_empty(q);
+}
+
+static void lf_waits(void *q, unsigned long *p, unsigned long *c)
+{
+	struct lfring *ring = q;
+
+	*p = ring->p_waits;
+	*c = ring->c_waits;
+}
+
+static const struct queueops queues[] = {
+	{"cirbuf", cb_init, cb_exit, cb_insert, cb_consume, cb_full, cb_empty,
+		cb_waits, CIR_BUFLEN - 1},
+	{"lfring", lf_init, lf_exit, lf_insert, lf_consume, lf_full, lf_empty,
+		lf_waits, CIR_BUFLEN},
+	{NULL}
+};
+
+struct benchctx {
+	const struct queueops *ops;
+	void *q;
+	unsigned long nops;
+	int pcpu, ccpu;
+	int stress;
+	unsigned long long lat_ts[LAT_SLOTS];
+	unsigned long lat[LAT_BUCKETS];
+	unsigned long seen_full, seen_empty;
+	unsigned long errors;
+	struct timespec t0, t1;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin_cpu(int cpu)
+{
+	cpu_set_t set;
+	int sysret;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	sysret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (sysret)
+		fprintf(stderr, "Cannot pin to cpu %d: %s\n", cpu,
+				strerror(sysret));
+}
+
+/* cheap per-thread random numbers for the stress jitter */
+static unsigned int xrand(unsigned int *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/* stall for a random while so that the other side hits full/empty */
+static void jitter(unsigned int *state)
+{
+	struct timespec ts;
+	unsigned int r = xrand(state);
+
+	if ((r & 0x3ff) != 0)
+		return;
+	ts.tv_sec = 0;
+	ts.tv_nsec = (r >> 10) % 200000;
+	nanosleep(&ts, NULL);
+}
+
+static void * producer(void *dat)
+{
+	struct benchctx *ctx = dat;
+	unsigned long seq;
+	unsigned int rnd = 0x1234567;
+
+	pin_cpu(ctx->pcpu);
+	clock_gettime(CLOCK_MONOTONIC, &ctx->t0);
+	for (seq = 0; seq < ctx->nops; seq++) {
+		if (ctx->stress) {
+			jitter(&rnd);
+			if (ctx->ops->full(ctx->q))
+				ctx->seen_full++;
+		}
+		if (seq % LAT_EVERY == 0)
+			ctx->lat_ts[(seq / LAT_EVERY) % LAT_SLOTS] =
+				now_ns();
+		ctx->ops->insert(ctx->q,
+				(const struct record *)(uintptr_t)(seq + 1));
+	}
+	return NULL;
+}
+
+static void * consumer(void *dat)
+{
+	struct benchctx *ctx = dat;
+	const struct record *rec;
+	unsigned long seq, delta;
+	unsigned int rnd = 0x7654321;
+	int bkt;
+
+	pin_cpu(ctx->ccpu);
+	for (seq = 0; seq < ctx->nops; seq++) {
+		if (ctx->stress) {
+			jitter(&rnd);
+			if (ctx->ops->empty(ctx->q))
+				ctx->seen_empty++;
+		}
+		rec = ctx->ops->consume(ctx->q);
+		if ((uintptr_t)rec != seq + 1) {
+			if (ctx->errors++ < 10)
+				fprintf(stderr, "%s: expected %lu, got %lu\n",
+						ctx->ops->name, seq + 1,
+						(unsigned long)(uintptr_t)rec);
+			seq = (uintptr_t)rec - 1;
+		}
+		if (seq % LAT_EVERY == 0) {
+			delta = now_ns() -
+				ctx->lat_ts[(seq / LAT_EVERY) % LAT_SLOTS];
+			for (bkt = 0; delta && bkt < LAT_BUCKETS - 1; bkt++)
+				delta >>= 1;
+			ctx->lat[bkt]++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ctx->t1);
+	return NULL;
+}
+
+/* upper bound, in ns, of the bucket holding the pct permille */
+static unsigned long lat_pct(const unsigned long *lat, int permille)
+{
+	unsigned long n, sum, want;
+	int bkt;
+
+	for (n = 0, bkt = 0; bkt < LAT_BUCKETS; bkt++)
+		n += lat[bkt];
+	if (n == 0)
+		return 0;
+	want = (n * permille + 999) / 1000;
+	for (sum = 0, bkt = 0; bkt < LAT_BUCKETS; bkt++) {
+		sum += lat[bkt];
+		if (sum >= want)
+			break;
+	}
+	return 1UL << bkt;
+}
+
+/*
+ * Single threaded edge cases: fill to capacity, check full, drain in
+ * order, check empty, several times so the indices wrap around.
+ */
+static int edge_check(const struct queueops *ops)
+{
+	const struct record *rec;
+	void *q;
+	int i, round, errors = 0;
+
+	q = ops->init();
+	if (!q)
+		return -1;
+	for (round = 0; round < 3; round++) {
+		if (!ops->empty(q) || ops->full(q)) {
+			fprintf(stderr, "%s: not empty at round %d\n",
+					ops->name, round);
+			errors++;
+		}
+		for (i = 0; i < ops->capacity; i++)
+			ops->insert(q,
+					(const struct record *)(uintptr_t)(i + 1));
+		if (!ops->full(q) || ops->empty(q)) {
+			fprintf(stderr, "%s: not full after %d inserts\n",
+					ops->name, ops->capacity);
+			errors++;
+		}
+		for (i = 0; i < ops->capacity; i++) {
+			rec = ops->consume(q);
+			if ((uintptr_t)rec != (uintptr_t)i + 1 && errors++ < 10)
+				fprintf(stderr, "%s: slot %d holds %lu\n",
+						ops->name, i,
+						(unsigned long)(uintptr_t)rec);
+		}
+		/* shift the start so the next round wraps differently */
+		for (i = 0; i < round * 1000 + 1; i++) {
+			ops->insert(q, NULL);
+			ops->consume(q);
+		}
+	}
+	ops->exit(q);
+	return errors ? -1 : 0;
+}
+
+static int run_pair(const struct queueops *ops, unsigned long nops,
+		int pcpu, int ccpu, int stress)
+{
+	struct benchctx *ctx;
+	pthread_t pth, cth;
+	unsigned long pw, cw;
+	double secs;
+	int sysret, retv = 0;
+
+	ctx = malloc(sizeof(struct benchctx));
+	if (!ctx) {
+		fprintf(stderr, "Out of Memory.\n");
+		return -1;
+	}
+	memset(ctx, 0, sizeof(struct benchctx));
+	ctx->ops = ops;
+	ctx->nops = nops;
+	ctx->pcpu = pcpu;
+	ctx->ccpu = ccpu;
+	ctx->stress = stress;
+	ctx->q = ops->init();
+	if (!ctx->q) {
+		free(ctx);
+		return -1;
+	}
+
+	sysret = pthread_create(&cth, NULL, consumer, ctx);
+	if (sysret) {
+		fprintf(stderr, "Cannot create consumer: %s\n",
+				strerror(sysret));
+		retv = -1;
+		goto exit_10;
+	}
+	sysret = pthread_create(&pth, NULL, producer, ctx);
+	if (sysret) {
+		fprintf(stderr, "Cannot create producer, running it " \
+				"unpinned here: %s\n", strerror(sysret));
+		ctx->pcpu = -1;
+		producer(ctx);
+	} else
+		pthread_join(pth, NULL);
+	pthread_join(cth, NULL);
+
+	ops->waits(ctx->q, &pw, &cw);
+	secs = (ctx->t1.tv_sec - ctx->t0.tv_sec) +
+		(ctx->t1.tv_nsec - ctx->t0.tv_nsec) / 1e9;
+	printf("%-8s %3d %3d %12.0f %10lu %10lu %9lu %9lu %9lu", ops->name,
+			pcpu, ccpu, secs > 0 ? nops / secs : 0, pw, cw,
+			lat_pct(ctx->lat, 500), lat_pct(ctx->lat, 990),
+			lat_pct(ctx->lat, 999));
+	if (stress)
+		printf("  full=%lu empty=%lu errors=%lu", ctx->seen_full,
+				ctx->seen_empty, ctx->errors);
+	printf("\n");
+	fflush(stdout);
+	if (ctx->errors)
+		retv = -1;
+
+exit_10:
+	ops->exit(ctx->q);
+	free(ctx);
+	return retv;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct queueops *ops;
+	int pcpu[BENCH_MAXPAIRS], ccpu[BENCH_MAXPAIRS];
+	int c, finish, npairs, ncpu, stress, i, retv = 0;
+	unsigned long nops;
+	const char *only;
+	extern char *optarg;
+	extern int optind, opterr, optopt;
+
+	nops = 5000000;
+	npairs = 0;
+	stress = 0;
+	only = NULL;
+	opterr = 0;
+	finish = 0;
+	do {
+		c = getopt(argc, argv, ":n:c:q:s");
+		switch(c) {
+		case '?':
+			fprintf(stderr, "Unknown option: %c\n", (char)optopt);
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument for %c\n",
+					(char)optopt);
+			break;
+		case 'n':
+			nops = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			if (npairs == BENCH_MAXPAIRS)
+				break;
+			if (sscanf(optarg, "%d,%d", &pcpu[npairs],
+						&ccpu[npairs]) == 2)
+				npairs++;
+			else
+				fprintf(stderr, "Bad cpu pair: %s\n", optarg);
+			break;
+		case 'q':
+			only = optarg;
+			break;
+		case 's':
+			stress = 1;
+			break;
+		case -1:
+			finish = 1;
+			break;
+		default:
+			assert(0);
+		}
+	} while (finish == 0);
+
+	if (npairs == 0) {
+		/* neighbour, middle and far core, as far as they exist */
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		pcpu[npairs] = 0;
+		ccpu[npairs++] = ncpu > 1 ? 1 : 0;
+		if (ncpu > 3) {
+			pcpu[npairs] = 0;
+			ccpu[npairs++] = ncpu / 2;
+		}
+		if (ncpu > 2) {
+			pcpu[npairs] = 0;
+			ccpu[npairs++] = ncpu - 1;
+		}
+	}
+	if (stress && nops > 1000000)
+		nops = 1000000;
+
+	for (ops = queues; ops->name; ops++) {
+		if (only && strcmp(only, ops->name) != 0)
+			continue;
+		if (edge_check(ops) == -1) {
+			printf("%s: edge case check FAILED\n", ops->name);
+			retv = 1;
+		}
+	}
+	printf("%lu items per run%s\n", nops, stress ? ", stress mode" : "");
+	printf("%-8s %3s %3s %12s %10s %10s %9s %9s %9s\n", "queue", "P",
+			"C", "ops/s", "p-waits", "c-waits", "p50-ns", "p99-ns",
+			"p999-ns");
+	for (i = 0; i < npairs; i++) {
+		for (ops = queues; ops->name; ops++) {
+			if (only && strcmp(only, ops->name) != 0)
+				continue;
+			if (run_pair(ops, nops, pcpu[i], ccpu[i],
+						stress) == -1)
+				retv = 1;
+		}
+	}
+	return retv;
+}
@@ -1,3 +1,8 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "cirbuf.h"
+
 struct cirbuf * cirbuf_init(void)
 {
 	struct cirbuf *cbuf;
@@ -9,6 +14,8 @@ struct cirbuf * cirbuf_init(void)
 	}
 	cbuf->head = 0;
 	cbuf->tail = 0;
+	cbuf->p_waits = 0;
+	cbuf->c_waits = 0;
 	pthread_mutex_init(&cbuf->mutex, NULL);
 	pthread_cond_init(&cbuf->cond, NULL);
 	return cbuf;
@@ -26,8 +33,10 @@ void cirbuf_insert(struct cirbuf *cbuf, const struct record *c_rec)
 	int empty;
 
 	pthread_mutex_lock(&cbuf->mutex);
-	while (cirbuf_full(cbuf))
+	while (cirbuf_full(cbuf)) {
+		cbuf->p_waits++;
 		pthread_cond_wait(&cbuf->cond, &cbuf->mutex);
+	}
 	cbuf->pool[cbuf->head] = c_rec;
 	empty = cirbuf_empty(cbuf);
 	cbuf->head = cirbuf_head_next(cbuf);
@@ -42,8 +51,10 @@ const struct record * cirbuf_consume(struct cirbuf *cbuf)
 	int full;
 
 	pthread_mutex_lock(&cbuf->mutex);
-	while (cirbuf_empty(cbuf))
+	while (cirbuf_empty(cbuf)) {
+		cbuf->c_waits++;
 		pthread_cond_wait(&cbuf->cond, &cbuf->mutex);
+	}
 	rec = cbuf->pool[cbuf->tail];
 	full = cirbuf_full(cbuf);
 	cbuf->tail = cirbuf_tail_next(cbuf);
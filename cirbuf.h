@@ -1,3 +1,7 @@
+#ifndef CIRBUF_DSCAO__
+#define CIRBUF_DSCAO__
+#include <pthread.h>
+
 #define CIR_BUFLEN  8192
 #define CIR_BUFMASK (CIR_BUFLEN - 1)
 
@@ -10,6 +14,7 @@ struct cirbuf {
 	volatile int head, tail;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	unsigned long p_waits, c_waits;	/* times insert/consume blocked */
 	const struct record *pool[CIR_BUFLEN];
 };
 
@@ -46,3 +51,5 @@ void cirbuf_exit(struct cirbuf *cbuf);
 void cirbuf_insert(struct cirbuf *cbuf, const struct record *c_rec);
 const struct record * cirbuf_consume(struct cirbuf *cbuf);
 
+
+#endif  /* CIRBUF_DSCAO__ */
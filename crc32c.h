@@ -0,0 +1,14 @@
+#ifndef CRC32C_DSCAO__
+#define CRC32C_DSCAO__
+#include <stddef.h>
+
+/*
+ * CRC32C of buf, continuing from crc; start with crc = 0.
+ * crc32c("123456789") == 0xe3069283. Uses the SSE4.2 crc32 instruction
+ * when the CPU has one, a table otherwise.
+ */
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+/* "sse4.2" or "table" */
+const char * crc32c_engine(void);
+
+#endif  /* CRC32C_DSCAO__ */
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "diskwr.h"
+#include "stats.h"
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static void uring_exit(struct uring *ur)
+{
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqe_len);
+	if (ur->cq_ptr && ur->cq_ptr != ur->sq_ptr)
+		munmap(ur->cq_ptr, ur->cq_len);
+	if (ur->sq_ptr)
+		munmap(ur->sq_ptr, ur->sq_len);
+	close(ur->fd);
+	free(ur);
+}
+
+static struct uring * uring_init(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	char *sq, *cq;
+
+	ur = malloc(sizeof(struct uring));
+	if (!ur)
+		return NULL;
+	memset(ur, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	ur->fd = sys_uring_setup(entries, &p);
+	if (ur->fd == -1) {
+		free(ur);
+		return NULL;
+	}
+
+	ur->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_len > ur->sq_len)
+			ur->sq_len = ur->cq_len;
+		ur->cq_len = ur->sq_len;
+	}
+	ur->sq_ptr = mmap(NULL, ur->sq_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED) {
+		ur->sq_ptr = NULL;
+		goto err_exit_10;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ur->cq_ptr = ur->sq_ptr;
+	else {
+		ur->cq_ptr = mmap(NULL, ur->cq_len, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, ur->fd,
+				IORING_OFF_CQ_RING);
+		if (ur->cq_ptr == MAP_FAILED) {
+			ur->cq_ptr = NULL;
+			goto err_exit_10;
+		}
+	}
+	ur->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqe_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto err_exit_10;
+	}
+
+	sq = ur->sq_ptr;
+	ur->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ur->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	cq = ur->cq_ptr;
+	ur->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return ur;
+
+err_exit_10:
+	uring_exit(ur);
+	return NULL;
+}
+
+static int uring_submit(struct uring *ur, int fd, struct dwbuf *b, int idx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, slot;
+	int sysret;
+
+	tail = *ur->sq_tail;
+	slot = tail & *ur->sq_mask;
+	sqe = &ur->sqes[slot];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)&b->iov;
+	sqe->len = 1;
+	sqe->off = b->off;
+	sqe->user_data = idx;
+	ur->sq_array[slot] = slot;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	do
+		sysret = sys_uring_enter(ur->fd, 1, 0, 0);
+	while (sysret == -1 && errno == EINTR);
+	return sysret == -1 ? -1 : 0;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t sysret;
+
+	while (len > 0) {
+		sysret = pwrite(fd, buf, len, off);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += sysret;
+		len -= sysret;
+		off += sysret;
+	}
+	return 0;
+}
+
+static int diskwr_reap(struct diskwr *dw, int wait)
+{
+	struct uring *ur = dw->ring;
+	struct io_uring_cqe *cqe;
+	struct dwbuf *b;
+	unsigned int head, tail;
+	int sysret;
+
+	if (wait) {
+		do
+			sysret = sys_uring_enter(ur->fd, 0, 1,
+					IORING_ENTER_GETEVENTS);
+		while (sysret == -1 && errno == EINTR);
+		if (sysret == -1) {
+			fprintf(stderr, "io_uring wait failed: %s\n",
+					strerror(errno));
+			dw->failed = 1;
+			return -1;
+		}
+	}
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		b = &dw->bufs[cqe->user_data];
+		if (cqe->res < 0) {
+			fprintf(stderr, "write failed at %lld: %s\n",
+					(long long)b->off, strerror(-cqe->res));
+			dw->failed = 1;
+		} else if ((size_t)cqe->res < b->iov.iov_len &&
+				pwrite_all(dw->fd, b->data + cqe->res,
+					b->iov.iov_len - cqe->res,
+					b->off + cqe->res) == -1) {
+			fprintf(stderr, "write failed at %lld: %s\n",
+					(long long)b->off, strerror(errno));
+			dw->failed = 1;
+		}
+		stats_lat(dw->st, &b->ts);
+		stats_add(&dw->st->bytes, b->iov.iov_len);
+		b->busy = 0;
+		dw->inflight--;
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* hand the current buffer to the kernel and move on to the next one */
+static int diskwr_submit(struct diskwr *dw)
+{
+	struct dwbuf *b = &dw->bufs[dw->cur];
+	int len, pad;
+
+	if (b->len == 0)
+		return 0;
+	len = b->len;
+	if (dw->direct && (len & (DISKWR_ALIGN - 1))) {
+		pad = DISKWR_ALIGN - (len & (DISKWR_ALIGN - 1));
+		memset(b->data + len, 0, pad);
+		len += pad;
+	}
+	b->off = dw->offset;
+	b->iov.iov_base = b->data;
+	b->iov.iov_len = len;
+	dw->offset += b->len;
+	stats_add(&dw->st->calls, 1);
+	stats_now(&b->ts);
+
+	if (dw->ring) {
+		b->busy = 1;
+		dw->inflight++;
+		if (uring_submit(dw->ring, dw->fd, b, dw->cur) == -1) {
+			fprintf(stderr, "io_uring submit failed: %s\n",
+					strerror(errno));
+			dw->failed = 1;
+			return -1;
+		}
+	} else if (pwrite_all(dw->fd, b->data, len, b->off) == -1) {
+		fprintf(stderr, "write failed at %lld: %s\n",
+				(long long)b->off, strerror(errno));
+		dw->failed = 1;
+		return -1;
+	} else {
+		stats_lat(dw->st, &b->ts);
+		stats_add(&dw->st->bytes, len);
+	}
+
+	dw->cur = (dw->cur + 1) % DISKWR_NBUF;
+	b = &dw->bufs[dw->cur];
+	if (b->busy)
+		stats_add(&dw->st->stalls, 1);
+	while (b->busy)
+		if (diskwr_reap(dw, 1) == -1)
+			return -1;
+	b->len = 0;
+	return 0;
+}
+
+/* keep: do not truncate, the caller will diskwr_seek() to resume */
+struct diskwr * diskwr_open(const char *fname, int direct, off_t prealloc,
+		int keep)
+{
+	struct diskwr *dw;
+	int flags, i;
+
+	dw = malloc(sizeof(struct diskwr));
+	if (!dw) {
+		fprintf(stderr, "Out of Memory.\n");
+		return NULL;
+	}
+	memset(dw, 0, sizeof(struct diskwr));
+	dw->st = stats_new("disk");
+	if (!dw->st) {
+		free(dw);
+		return NULL;
+	}
+	flags = O_WRONLY|O_CREAT;
+	if (!keep)
+		flags |= O_TRUNC;
+	dw->fd = -1;
+	if (direct) {
+		dw->fd = open(fname, flags|O_DIRECT, 0644);
+		if (dw->fd == -1)
+			fprintf(stderr, "Cannot open %s with O_DIRECT: %s\n",
+					fname, strerror(errno));
+		else
+			dw->direct = 1;
+	}
+	if (dw->fd == -1)
+		dw->fd = open(fname, flags, 0644);
+	if (dw->fd == -1) {
+		fprintf(stderr, "Cannot open %s for writing: %s\n",
+				fname, strerror(errno));
+		free(dw);
+		return NULL;
+	}
+	if (prealloc > 0 && fallocate(dw->fd, FALLOC_FL_KEEP_SIZE, 0,
+				prealloc) == -1)
+		fprintf(stderr, "Cannot preallocate %lld bytes: %s\n",
+				(long long)prealloc, strerror(errno));
+
+	for (i = 0; i < DISKWR_NBUF; i++) {
+		if (posix_memalign((void **)&dw->bufs[i].data, DISKWR_ALIGN,
+					DISKWR_BUFSZ)) {
+			fprintf(stderr, "Out of Memory.\n");
+			diskwr_close(dw);
+			return NULL;
+		}
+	}
+	dw->ring = uring_init(DISKWR_NBUF);
+	if (!dw->ring)
+		fprintf(stderr, "io_uring not available, using pwrite\n");
+	return dw;
+}
+
+/*
+ * Continue writing at offset, dropping whatever the file has beyond it.
+ * Only valid before the first commit; with O_DIRECT offset must be a
+ * multiple of DISKWR_ALIGN.
+ */
+int diskwr_seek(struct diskwr *dw, off_t offset)
+{
+	if (dw->total != 0 || dw->bufs[dw->cur].len != 0)
+		return -1;
+	if (dw->direct && (offset & (DISKWR_ALIGN - 1)))
+		return -1;
+	if (ftruncate(dw->fd, offset) == -1) {
+		fprintf(stderr, "Cannot truncate to %lld: %s\n",
+				(long long)offset, strerror(errno));
+		return -1;
+	}
+	dw->offset = offset;
+	dw->total = offset;
+	return 0;
+}
+
+int diskwr_close(struct diskwr *dw)
+{
+	int i, retv;
+
+	if (!dw->failed)
+		diskwr_submit(dw);
+	/* failed or not, the kernel may still be reading the buffers */
+	while (dw->inflight > 0)
+		if (diskwr_reap(dw, 1) == -1)
+			break;
+	/* total 0: nothing written, leave a kept file alone */
+	if (dw->direct && dw->total > 0 &&
+			ftruncate(dw->fd, dw->total) == -1) {
+		fprintf(stderr, "Cannot truncate to %lld: %s\n",
+				(long long)dw->total, strerror(errno));
+		dw->failed = 1;
+	}
+	retv = dw->failed ? -1 : 0;
+
+	if (dw->ring)
+		uring_exit(dw->ring);
+	/* could not wait for them: better leak the buffers than reuse them */
+	if (dw->inflight == 0)
+		for (i = 0; i < DISKWR_NBUF; i++)
+			free(dw->bufs[i].data);
+	close(dw->fd);
+	free(dw);
+	return retv;
+}
+
+char * diskwr_buf(struct diskwr *dw, int *room)
+{
+	struct dwbuf *b = &dw->bufs[dw->cur];
+
+	*room = DISKWR_BUFSZ - b->len;
+	return b->data + b->len;
+}
+
+int diskwr_commit(struct diskwr *dw, int len)
+{
+	struct dwbuf *b = &dw->bufs[dw->cur];
+
+	b->len += len;
+	dw->total += len;
+	if (b->len == DISKWR_BUFSZ)
+		diskwr_submit(dw);
+	return dw->failed ? -1 : 0;
+}
+
+int diskwr_write(struct diskwr *dw, const char *data, int len)
+{
+	char *buf;
+	int room;
+
+	while (len > 0 && !dw->failed) {
+		buf = diskwr_buf(dw, &room);
+		if (room > len)
+			room = len;
+		memcpy(buf, data, room);
+		data += room;
+		len -= room;
+		diskwr_commit(dw, room);
+	}
+	return dw->failed ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+#ifndef DISK_WRITER_DSCAO__
+#define DISK_WRITER_DSCAO__
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define DISKWR_BUFSZ	(1024*1024)
+#define DISKWR_NBUF	8
+#define DISKWR_ALIGN	4096
+
+struct dwbuf {
+	char *data;
+	int len;
+	int busy;		/* submitted, not yet completed */
+	off_t off;
+	struct iovec iov;
+	struct timespec ts;	/* submit time */
+};
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqe_len;
+};
+
+/*
+ * Batching file writer. Data is gathered into DISKWR_NBUF aligned
+ * buffers of DISKWR_BUFSZ bytes; a full buffer is submitted as one
+ * write through io_uring, or with pwrite() when io_uring is not
+ * available, while the caller goes on filling the next one.
+ */
+struct diskwr {
+	int fd;
+	int direct;		/* file is open with O_DIRECT */
+	int failed;
+	off_t offset;		/* file offset of the next submitted buffer */
+	off_t total;		/* file size once all is written */
+	int cur;		/* buffer being filled */
+	int inflight;
+	struct uring *ring;	/* NULL: synchronous pwrite fallback */
+	struct stats *st;
+	struct dwbuf bufs[DISKWR_NBUF];
+};
+
+struct diskwr * diskwr_open(const char *fname, int direct, off_t prealloc,
+		int keep);
+int diskwr_seek(struct diskwr *dw, off_t offset);
+int diskwr_close(struct diskwr *dw);
+char * diskwr_buf(struct diskwr *dw, int *room);
+int diskwr_commit(struct diskwr *dw, int len);
+int diskwr_write(struct diskwr *dw, const char *data, int len);
+
+#endif  /* DISK_WRITER_DSCAO__ */
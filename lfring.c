@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "lfring.h"
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline void futex_wait(unsigned int *word, unsigned int val)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(unsigned int *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Wait until *word moves away from val. The sleep flag and the index
+ * form a Dekker pair with the other side: we publish the flag and then
+ * re-check the index, the other side publishes the index and then
+ * checks the flag, with a full fence in between on both sides.
+ */
+static void lfring_wait(unsigned int *word, unsigned int val, int *sleep,
+		unsigned long *waits)
+{
+	int i;
+
+	for (i = 0; i < LFRING_SPIN; i++) {
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val)
+			return;
+		cpu_relax();
+	}
+	*waits += 1;
+	__atomic_store_n(sleep, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(word, __ATOMIC_ACQUIRE) == val)
+		futex_wait(word, val);
+	__atomic_store_n(sleep, 0, __ATOMIC_RELAXED);
+}
+
+static inline void lfring_wake(unsigned int *word, int *sleep)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleep, __ATOMIC_RELAXED))
+		futex_wake(word);
+}
+
+struct lfring * lfring_init(void)
+{
+	struct lfring *ring;
+
+	ring = aligned_alloc(LFRING_CACHELINE, sizeof(struct lfring));
+	if (ring == NULL) {
+		fprintf(stderr, "Out of Memory.\n");
+		return NULL;
+	}
+	memset(ring, 0, sizeof(struct lfring));
+	return ring;
+}
+
+void lfring_exit(struct lfring *ring)
+{
+	free(ring);
+}
+
+void lfring_insert(struct lfring *ring, const struct record *c_rec)
+{
+	unsigned int head = ring->head;
+
+	while (head - ring->tail_cache == CIR_BUFLEN) {
+		ring->tail_cache = __atomic_load_n(&ring->tail,
+				__ATOMIC_ACQUIRE);
+		if (head - ring->tail_cache != CIR_BUFLEN)
+			break;
+		lfring_wait(&ring->tail, ring->tail_cache, &ring->p_sleep,
+				&ring->p_waits);
+	}
+	ring->pool[head & CIR_BUFMASK] = c_rec;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	lfring_wake(&ring->head, &ring->c_sleep);
+}
+
+const struct record * lfring_consume(struct lfring *ring)
+{
+	unsigned int tail = ring->tail;
+	const struct record *rec;
+
+	while (tail == ring->head_cache) {
+		ring->head_cache = __atomic_load_n(&ring->head,
+				__ATOMIC_ACQUIRE);
+		if (tail != ring->head_cache)
+			break;
+		lfring_wait(&ring->head, tail, &ring->c_sleep,
+				&ring->c_waits);
+	}
+	rec = ring->pool[tail & CIR_BUFMASK];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	lfring_wake(&ring->tail, &ring->p_sleep);
+	return rec;
+}
@@ -0,0 +1,51 @@
+#ifndef LFRING_DSCAO__
+#define LFRING_DSCAO__
+#include "cirbuf.h"
+
+#define LFRING_CACHELINE	64
+#define LFRING_SPIN		256
+
+/*
+ * Lock free single producer/single consumer variant of cirbuf.
+ * head is only written by the producer and tail only by the consumer,
+ * each on its own cache line together with a cached copy of the other
+ * side's index, so the shared line is touched only when the cached
+ * value says the ring looks full (producer) or empty (consumer).
+ * A side that finds the ring full/empty spins briefly, then sleeps on a
+ * futex keyed on the index it waits for.
+ */
+struct lfring {
+	unsigned int head __attribute__((aligned(LFRING_CACHELINE)));
+	unsigned int tail_cache;
+	unsigned long p_waits;
+	unsigned int tail __attribute__((aligned(LFRING_CACHELINE)));
+	unsigned int head_cache;
+	unsigned long c_waits;
+	int p_sleep __attribute__((aligned(LFRING_CACHELINE)));
+	int c_sleep __attribute__((aligned(LFRING_CACHELINE)));
+	const struct record *pool[CIR_BUFLEN]
+		__attribute__((aligned(LFRING_CACHELINE)));
+};
+
+static inline int lfring_count(const struct lfring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline int lfring_empty(const struct lfring *ring)
+{
+	return lfring_count(ring) == 0;
+}
+
+static inline int lfring_full(const struct lfring *ring)
+{
+	return lfring_count(ring) == CIR_BUFLEN;
+}
+
+struct lfring * lfring_init(void);
+void lfring_exit(struct lfring *ring);
+void lfring_insert(struct lfring *ring, const struct record *c_rec);
+const struct record * lfring_consume(struct lfring *ring);
+
+#endif  /* LFRING_DSCAO__ */
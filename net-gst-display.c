@@ -8,8 +8,57 @@
 #include <string.h>
 #include <signal.h>
 #include <pthread.h>
+#include <assert.h>
+#include <sys/socket.h>
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
 #include "netproc.h"
+#include "stats.h"
+#include "netev.h"
+#include "netrange.h"
+
+#define APPSRC_BUFSZ	65536
+#define APPSRC_DGRAMSZ	2048
+#define APPSRC_MAXBYTES	(4*1024*1024)
+#define APPSRC_ITEMS	64	/* buffers the receiver may hold at once */
+#define JITTER_MAXBYTES	(64*1024*1024)	/* -b cap, and the cap for -b Nms */
+#define REC_QUEUEBYTES	JITTER_MAXBYTES	/* disk lag before recording drops */
+
+struct gstitem {
+	GstBuffer *buf;
+	GstMapInfo map;
+};
+
+/*
+ * netsink feeding an appsrc: the receiver recv()s directly into memory
+ * of a buffer taken from a GstBufferPool, which is then pushed into the
+ * appsrc without copying. need-data/enough-data gate the receiver.
+ */
+struct gstsink {
+	struct netsink ns;
+	GstAppSrc *appsrc;
+	GstBufferPool *pool;
+	GMutex lock;
+	GCond cond;
+	gboolean enough;
+	gboolean ready;		/* pipeline reset for the next stream */
+	volatile int *g_exit;
+	int nfree;
+	struct gstitem *freeitem[APPSRC_ITEMS];
+	struct gstitem items[APPSRC_ITEMS];
+};
+
+/*
+ * -A: an appsrc in random-access mode, so decodebin pulls from it and
+ * demuxers can seek; every read becomes a range request to netplay -A
+ * through the range cache.
+ */
+struct rangesrc {
+	struct rangecli rc;
+	GstAppSrc *appsrc;	/* set once rc is open */
+	guint64 offset;
+	volatile int *g_exit;
+};
 
 /*void wait_udp_start(int port); */
 
@@ -20,22 +69,52 @@ struct CustomData {
 	GstElement *a_convert, *v_convert;
 	GstElement *resample;
 	GstElement *a_sink, *v_sink;
+	GstElement *a_queue, *v_queue;
+	GstElement *a_head, *v_head;	/* where decoder pads get linked */
+	gboolean lowlat;
+	guint queue_ms;		/* branch queue size, 0: no thread boundary */
+	gint dec_threads;	/* decoder threads, 0: decoder default */
+	gboolean daemon;	/* keep the pipeline across connections */
+	GstElement *jitter;	/* queue2 pre-roll buffer, NULL without -b */
+	guint jitter_bytes;	/* its size, in bytes */
+	guint jitter_ms;	/* or in milliseconds of media */
+	guint low_pct, high_pct;	/* watermarks, % of the size */
+	gboolean buffering;	/* held in PAUSED until filled */
+	gboolean started;	/* buffering after this is an underrun */
+	struct stats *jst;
+	GstElement *tee;	/* -o: splits the stream before decoding */
+	GstElement *rec_queue, *rec_sink;
+	const gchar *rec_path;
+	guint rec_mb;		/* segment size */
+	guint rec_keep;		/* segments kept, 0: all */
+	struct stats *rst;
+	struct gstsink *gsink;
 	gboolean playing;
 	gboolean seek_enabled;
 	gboolean seek_done;
 	gint64 duration;
 	gint64 current;
+	guint start_sec;	/* -A: seek here once playing */
 	volatile int *terminate;
 };
 
 static volatile int global_exit = 0;
 static volatile int print_current = 0;
+static int wake_fd = -1;	/* eventfd, wakes the bus loop for print_current */
 static void sig_handler(int sig)
 {
-	if (sig == SIGUSR1 || sig == SIGUSR2)
+	int saved = errno;
+
+	if (sig == SIGUSR1 || sig == SIGUSR2) {
 		print_current = 1;
+		if (wake_fd != -1)
+			netev_post(wake_fd);
+	}
+	if (sig == SIGUSR1)
+		stats_signal();
 	else if (sig == SIGINT || sig == SIGTERM)
-		global_exit = 1;
+		netev_exit(&global_exit);
+	errno = saved;
 }
 
 static void pad_added_handler(GstElement *src, GstPad *pad, struct CustomData *data);
@@ -61,6 +140,282 @@ static void query_seek_prop(struct CustomData *data)
 	gst_query_unref(query);
 }
 
+static void query_latency(struct CustomData *data)
+{
+	GstQuery *query;
+	gboolean live;
+	GstClockTime min, max;
+
+	query = gst_query_new_latency();
+	if (!gst_element_query(data->pipeline, query)) {
+		g_printerr("Latency query failed.\n");
+		gst_query_unref(query);
+		return;
+	}
+	gst_query_parse_latency(query, &live, &min, &max);
+	g_print("Pipeline latency: %s, min %" GST_TIME_FORMAT ", max %" \
+			GST_TIME_FORMAT "\n", live ? "live" : "not live",
+			GST_TIME_ARGS(min), GST_TIME_ARGS(max));
+	gst_query_unref(query);
+}
+
+static gboolean has_property(GstElement *element, const gchar *name)
+{
+	return g_object_class_find_property(G_OBJECT_GET_CLASS(element),
+			name) != NULL;
+}
+
+/*
+ * Tune elements as decodebin and the auto sinks plug them: decoders get
+ * the requested thread count, and in the low latency profile sinks
+ * render as soon as a frame is decoded.
+ */
+static void element_added(GstBin *bin, GstBin *sub_bin, GstElement *element,
+		struct CustomData *data)
+{
+	static const gchar *thread_props[] = {
+		"max-threads", "threads", "n-threads", NULL
+	};
+	GstElementFactory *factory;
+	const gchar *klass;
+	int i;
+
+	factory = gst_element_get_factory(element);
+	if (!factory)
+		return;
+	klass = gst_element_factory_get_metadata(factory,
+			GST_ELEMENT_METADATA_KLASS);
+	if (!klass)
+		return;
+	if (data->dec_threads > 0 && strstr(klass, "Decoder")) {
+		for (i = 0; thread_props[i]; i++) {
+			if (!has_property(element, thread_props[i]))
+				continue;
+			g_object_set(element, thread_props[i],
+					data->dec_threads, NULL);
+			g_print("%s: %s=%d\n", GST_ELEMENT_NAME(element),
+					thread_props[i], data->dec_threads);
+			break;
+		}
+	}
+	if (data->lowlat && strstr(klass, "Sink")) {
+		if (has_property(element, "sync"))
+			g_object_set(element, "sync", FALSE, NULL);
+		if (has_property(element, "qos"))
+			g_object_set(element, "qos", TRUE, NULL);
+	}
+}
+
+/*
+ * The branch queues are thread boundaries: conversion and rendering of
+ * audio and video each run in their own streaming thread instead of
+ * the decoder's.
+ */
+static void queue_setup(struct CustomData *data)
+{
+	if (data->lowlat) {
+		/* leaky=downstream: drop the oldest buffers, never block */
+		g_object_set(data->v_queue, "leaky", 2,
+				"max-size-buffers", 3, "max-size-bytes", 0,
+				"max-size-time", (guint64)0, NULL);
+		g_object_set(data->a_queue, "leaky", 2,
+				"max-size-buffers", 0, "max-size-bytes", 0,
+				"max-size-time", (guint64)(200 * GST_MSECOND),
+				NULL);
+		return;
+	}
+	g_object_set(data->v_queue, "max-size-buffers", 0,
+			"max-size-bytes", 0,
+			"max-size-time", (guint64)data->queue_ms * GST_MSECOND,
+			NULL);
+	g_object_set(data->a_queue, "max-size-buffers", 0,
+			"max-size-bytes", 0,
+			"max-size-time", (guint64)data->queue_ms * GST_MSECOND,
+			NULL);
+}
+
+/*
+ * -b 4M, 512K, a number of bytes, or 800ms of media. Until the stream
+ * is parsed there are no timestamps, so a time size is converted by
+ * the queue2 from the measured input rate.
+ */
+static int jitter_parse(const char *str, struct CustomData *data)
+{
+	char *end;
+	unsigned long val;
+
+	val = strtoul(str, &end, 0);
+	if (strcmp(end, "ms") == 0) {
+		data->jitter_ms = val;
+		return val ? 0 : -1;
+	}
+	switch (*end) {
+	case 'm':
+	case 'M':
+		val <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		val <<= 10;
+		end++;
+	}
+	if (*end || val == 0 || val > JITTER_MAXBYTES)
+		return -1;
+	data->jitter_bytes = val;
+	return 0;
+}
+
+/*
+ * The jitter buffer sits between the source and decodebin. With
+ * use-buffering the queue2 posts BUFFERING messages when its level
+ * drops below the low watermark, and keeps posting them until it is
+ * back over the high one.
+ */
+static int jitter_setup(struct CustomData *data)
+{
+	guint maxbytes;
+
+	maxbytes = data->jitter_ms ? JITTER_MAXBYTES : data->jitter_bytes;
+	g_object_set(data->jitter, "use-buffering", TRUE,
+			"max-size-buffers", 0, "max-size-bytes", maxbytes,
+			"max-size-time", (guint64)data->jitter_ms * GST_MSECOND,
+			"use-rate-estimate", data->jitter_ms != 0,
+			"low-watermark", data->low_pct / 100.0,
+			"high-watermark", data->high_pct / 100.0, NULL);
+	data->jst = stats_new("jitter");
+	if (data->jst == NULL)
+		return -1;
+	stats_set(&data->jst->fillmax, maxbytes);
+	data->buffering = TRUE;
+	return 0;
+}
+
+/* every buffer decodebin takes out of the jitter buffer */
+static GstPadProbeReturn jitter_probe(GstPad *pad, GstPadProbeInfo *info,
+		struct CustomData *data)
+{
+	guint level;
+
+	stats_add(&data->jst->calls, 1);
+	stats_add(&data->jst->bytes,
+			gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+	g_object_get(data->jitter, "current-level-bytes", &level, NULL);
+	stats_set(&data->jst->fill, level);
+	return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Hold the pipeline in PAUSED while the jitter buffer fills: at start
+ * until it first reaches the high watermark, and again after an
+ * underrun, instead of letting the sinks starve and stutter.
+ */
+static void jitter_buffering(GstMessage *msg, struct CustomData *data)
+{
+	gint pct;
+
+	if (GST_MESSAGE_SRC(msg) != GST_OBJECT(data->jitter))
+		return;
+	gst_message_parse_buffering(msg, &pct);
+	if (pct < 100 && !data->buffering) {
+		data->buffering = TRUE;
+		stats_add(&data->jst->stalls, 1);
+		g_print("Jitter buffer underrun, buffering.\n");
+		gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
+	} else if (pct == 100 && data->buffering) {
+		data->buffering = FALSE;
+		g_print("Jitter buffer %s, playing.\n", data->started ?
+				"refilled" : "filled");
+		data->started = TRUE;
+		gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+	}
+}
+
+/*
+ * -o: the undecoded stream also goes through a tee into a queue, whose
+ * thread does the writes, and a multifilesink that starts a new file
+ * every rec_mb MiB. Segments split the stream anywhere, cat them in
+ * order for the whole recording. The queue holds as much as a full
+ * jitter buffer, so the sink waiting in PAUSED while it fills loses
+ * nothing; a disk falling further behind drops data rather than
+ * stalling the display.
+ */
+static int rec_setup(struct CustomData *data)
+{
+	gchar *location;
+
+	if (strchr(data->rec_path, '%'))
+		location = g_strdup(data->rec_path);
+	else
+		location = g_strdup_printf("%s.%%05d", data->rec_path);
+	g_object_set(data->rec_queue, "leaky", 1, "max-size-buffers", 0,
+			"max-size-bytes", REC_QUEUEBYTES,
+			"max-size-time", (guint64)0, NULL);
+	gst_util_set_object_arg(G_OBJECT(data->rec_sink), "next-file",
+			"max-size");
+	g_object_set(data->rec_sink, "location", location,
+			"max-file-size", (guint64)data->rec_mb << 20,
+			"max-files", data->rec_keep, "sync", FALSE,
+			"async", FALSE, NULL);
+	g_print("Recording to %s, %u MiB segments.\n", location,
+			data->rec_mb);
+	g_free(location);
+	data->rst = stats_new("record");
+	return data->rst == NULL ? -1 : 0;
+}
+
+/* runs in the queue's thread, the one writing */
+static GstPadProbeReturn rec_probe(GstPad *pad, GstPadProbeInfo *info,
+		struct CustomData *data)
+{
+	stats_add(&data->rst->calls, 1);
+	stats_add(&data->rst->bytes,
+			gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+	return GST_PAD_PROBE_OK;
+}
+
+/* the queue is full: the disk is behind and a buffer is dropped */
+static void rec_overrun(GstElement *queue, struct CustomData *data)
+{
+	stats_add(&data->rst->stalls, 1);
+}
+
+static void lowlat_setup(struct CustomData *data)
+{
+	g_object_set(data->source, "is-live", TRUE, "do-timestamp", TRUE,
+			"min-latency", (gint64)0, NULL);
+	g_object_set(data->decoder, "max-size-time",
+			(guint64)(100 * GST_MSECOND), "max-size-buffers", 5,
+			NULL);
+}
+
+static void gstsink_wake(struct gstsink *gs, gboolean ready);
+
+/*
+ * Daemon mode: a new connection is waiting. Take the pipeline back to
+ * READY, which drops the EOS and whatever decodebin plugged for the
+ * previous stream but keeps every element, and start it again.
+ */
+static void session_reset(struct CustomData *data)
+{
+	GstStateChangeReturn ret;
+	gint64 t0;
+
+	t0 = g_get_monotonic_time();
+	gst_element_set_state(data->pipeline, GST_STATE_READY);
+	data->duration = GST_CLOCK_TIME_NONE;
+	data->seek_enabled = FALSE;
+	data->buffering = data->jitter != NULL;
+	data->started = FALSE;
+	ret = gst_element_set_state(data->pipeline, data->buffering ?
+			GST_STATE_PAUSED : GST_STATE_PLAYING);
+	if (ret == GST_STATE_CHANGE_FAILURE)
+		g_printerr("Unable to restart the pipeline.\n");
+	else
+		g_print("Pipeline reset for new stream in %" G_GINT64_FORMAT
+				" ms\n", (g_get_monotonic_time() - t0) / 1000);
+	gstsink_wake(data->gsink, TRUE);
+}
+
 static void gst_mesg_check(GstMessage *msg, struct CustomData *data)
 {
 	GError *err;
@@ -76,11 +431,22 @@ static void gst_mesg_check(GstMessage *msg, struct CustomData *data)
 				debug_info ? debug_info : "none");
 		g_clear_error (&err);
 		g_free (debug_info);
-		*data->terminate = 1;
+		if (data->daemon) {
+			/* drop the rest of this stream, wait for the next */
+			gst_element_set_state(data->pipeline, GST_STATE_READY);
+			gstsink_wake(data->gsink, FALSE);
+			break;
+		}
+		netev_exit(data->terminate);
 		break;
 	case GST_MESSAGE_EOS:
 		g_print ("End-Of-Stream reached.\n");
-		*data->terminate = 1;
+		if (!data->daemon)
+			netev_exit(data->terminate);
+		break;
+	case GST_MESSAGE_APPLICATION:
+		if (data->daemon && gst_message_has_name(msg, "netdisp-session"))
+			session_reset(data);
 		break;
 	case GST_MESSAGE_STATE_CHANGED:
 		if (GST_MESSAGE_SRC(msg) != GST_OBJECT(data->pipeline))
@@ -92,6 +458,28 @@ static void gst_mesg_check(GstMessage *msg, struct CustomData *data)
 		data->playing = (new_state == GST_STATE_PLAYING);
 		if (data->playing)
 			query_seek_prop(data);
+		if (data->playing && data->seek_enabled && data->start_sec &&
+				!data->seek_done) {
+			if (!gst_element_seek_simple(data->pipeline,
+						GST_FORMAT_TIME,
+						GST_SEEK_FLAG_FLUSH |
+						GST_SEEK_FLAG_KEY_UNIT,
+						(gint64)data->start_sec *
+						GST_SECOND))
+				g_printerr("Seek to %u s failed.\n",
+						data->start_sec);
+			data->seek_done = TRUE;
+		}
+		if (data->playing && data->lowlat)
+			query_latency(data);
+		break;
+	case GST_MESSAGE_LATENCY:
+		gst_bin_recalculate_latency(GST_BIN(data->pipeline));
+		query_latency(data);
+		break;
+	case GST_MESSAGE_BUFFERING:
+		if (data->jitter)
+			jitter_buffering(msg, data);
 		break;
 	default:
 		/* We should not reach here because we only asked for ERRORs and EOS */
@@ -101,13 +489,262 @@ static void gst_mesg_check(GstMessage *msg, struct CustomData *data)
 	gst_message_unref(msg);
 }
 
+static void appsrc_need_data(GstElement *src, guint length,
+		struct gstsink *gs)
+{
+	g_mutex_lock(&gs->lock);
+	gs->enough = FALSE;
+	g_cond_signal(&gs->cond);
+	g_mutex_unlock(&gs->lock);
+}
+
+static void appsrc_enough_data(GstElement *src, struct gstsink *gs)
+{
+	g_mutex_lock(&gs->lock);
+	gs->enough = TRUE;
+	g_mutex_unlock(&gs->lock);
+}
+
+static void * gstsink_get(struct netsink *ns, char **data, int *maxlen)
+{
+	struct gstsink *gs = (struct gstsink *)ns;
+	struct gstitem *item;
+	GstBuffer *buf;
+
+	if (gs->nfree == 0)
+		return NULL;
+	/* need-data, a reset or exit (gstsink_wake) ends the wait */
+	g_mutex_lock(&gs->lock);
+	while (gs->enough && *gs->g_exit == 0)
+		g_cond_wait(&gs->cond, &gs->lock);
+	g_mutex_unlock(&gs->lock);
+	if (*gs->g_exit)
+		return NULL;
+
+	if (gst_buffer_pool_acquire_buffer(gs->pool, &buf, NULL) !=
+			GST_FLOW_OK)
+		return NULL;
+	item = gs->freeitem[--gs->nfree];
+	item->buf = buf;
+	if (!gst_buffer_map(buf, &item->map, GST_MAP_WRITE)) {
+		gst_buffer_unref(buf);
+		gs->freeitem[gs->nfree++] = item;
+		return NULL;
+	}
+	*data = (char *)item->map.data;
+	*maxlen = item->map.size;
+	return item;
+}
+
+static void gstsink_put(struct netsink *ns, void *dat, int len)
+{
+	struct gstsink *gs = (struct gstsink *)ns;
+	struct gstitem *item = dat;
+
+	gst_buffer_unmap(item->buf, &item->map);
+	if (len == 0)
+		gst_buffer_unref(item->buf);
+	else {
+		gst_buffer_set_size(item->buf, len);
+		gst_app_src_push_buffer(gs->appsrc, item->buf);
+	}
+	item->buf = NULL;
+	gs->freeitem[gs->nfree++] = item;
+}
+
+static void gstsink_eos(struct netsink *ns)
+{
+	struct gstsink *gs = (struct gstsink *)ns;
+
+	gst_app_src_end_of_stream(gs->appsrc);
+}
+
+/*
+ * New connection in daemon mode: ask the main loop, through the bus, to
+ * reset the pipeline and wait until it is done.
+ */
+static int gstsink_begin(struct netsink *ns)
+{
+	struct gstsink *gs = (struct gstsink *)ns;
+	GstStructure *s;
+
+	g_mutex_lock(&gs->lock);
+	gs->ready = FALSE;
+	g_mutex_unlock(&gs->lock);
+	s = gst_structure_new_empty("netdisp-session");
+	gst_element_post_message(GST_ELEMENT(gs->appsrc),
+			gst_message_new_application(GST_OBJECT(gs->appsrc), s));
+
+	g_mutex_lock(&gs->lock);
+	while (!gs->ready && *gs->g_exit == 0)
+		g_cond_wait(&gs->cond, &gs->lock);
+	g_mutex_unlock(&gs->lock);
+	return *gs->g_exit ? -1 : 0;
+}
+
+/*
+ * Let the receiver go on: after a reset (ready), after an error when
+ * the rest of the stream is pushed into a stopped appsrc and dropped,
+ * or to see the exit flag.
+ */
+static void gstsink_wake(struct gstsink *gs, gboolean ready)
+{
+	g_mutex_lock(&gs->lock);
+	gs->enough = FALSE;
+	if (ready)
+		gs->ready = TRUE;
+	g_cond_broadcast(&gs->cond);
+	g_mutex_unlock(&gs->lock);
+}
+
+static int gstsink_init(struct gstsink *gs, GstElement *appsrc, int bufsz,
+		volatile int *g_exit)
+{
+	GstStructure *config;
+	int i;
+
+	memset(gs, 0, sizeof(struct gstsink));
+	g_mutex_init(&gs->lock);
+	g_cond_init(&gs->cond);
+	gs->g_exit = g_exit;
+	gs->appsrc = GST_APP_SRC(appsrc);
+	for (i = 0; i < APPSRC_ITEMS; i++)
+		gs->freeitem[i] = &gs->items[i];
+	gs->nfree = APPSRC_ITEMS;
+
+	gs->pool = gst_buffer_pool_new();
+	config = gst_buffer_pool_get_config(gs->pool);
+	gst_buffer_pool_config_set_params(config, NULL, bufsz,
+			APPSRC_ITEMS, 0);
+	if (!gst_buffer_pool_set_config(gs->pool, config) ||
+			!gst_buffer_pool_set_active(gs->pool, TRUE)) {
+		g_printerr("Cannot set up the buffer pool.\n");
+		return -1;
+	}
+
+	g_object_set(appsrc, "format", GST_FORMAT_BYTES,
+			"stream-type", GST_APP_STREAM_TYPE_STREAM,
+			"max-bytes", (guint64)APPSRC_MAXBYTES,
+			"block", FALSE, NULL);
+	g_signal_connect(appsrc, "need-data", G_CALLBACK(appsrc_need_data), gs);
+	g_signal_connect(appsrc, "enough-data",
+			G_CALLBACK(appsrc_enough_data), gs);
+	gs->ns.get = gstsink_get;
+	gs->ns.put = gstsink_put;
+	gs->ns.eos = gstsink_eos;
+	gs->ns.begin = gstsink_begin;
+	return 0;
+}
+
+static void gstsink_exit(struct gstsink *gs)
+{
+	if (gs->pool) {
+		gst_buffer_pool_set_active(gs->pool, FALSE);
+		gst_object_unref(gs->pool);
+	}
+	g_cond_clear(&gs->cond);
+	g_mutex_clear(&gs->lock);
+}
+
+static gboolean range_seek_data(GstElement *src, guint64 offset,
+		struct rangesrc *rs)
+{
+	rs->offset = offset;
+	return TRUE;
+}
+
+/*
+ * called by the thread pulling: the buffer must be all it asked for.
+ * The fetch waits on the exit event too, so stopping the pipeline
+ * never has to wait out a peer gone quiet.
+ */
+static void range_need_data(GstElement *src, guint length,
+		struct rangesrc *rs)
+{
+	GstBuffer *buf;
+	GstMapInfo map;
+	long len;
+
+	if (*rs->g_exit || rs->offset >= (guint64)rs->rc.size) {
+		gst_app_src_end_of_stream(rs->appsrc);
+		return;
+	}
+	if (length == 0 || length == (guint)-1)
+		length = RANGE_BLOCK;
+	if (length > rs->rc.size - rs->offset)
+		length = rs->rc.size - rs->offset;
+	buf = gst_buffer_new_allocate(NULL, length, NULL);
+	gst_buffer_map(buf, &map, GST_MAP_WRITE);
+	len = range_read(&rs->rc, rs->offset, (char *)map.data, length);
+	gst_buffer_unmap(buf, &map);
+	if (len <= 0) {
+		gst_buffer_unref(buf);
+		if (!*rs->g_exit)
+			g_printerr("Cannot read range at %llu.\n",
+					(unsigned long long)rs->offset);
+		netev_exit(rs->g_exit);
+		gst_app_src_end_of_stream(rs->appsrc);
+		return;
+	}
+	GST_BUFFER_OFFSET(buf) = rs->offset;
+	rs->offset += len;
+	gst_app_src_push_buffer(rs->appsrc, buf);
+}
+
+static void range_setup(struct rangesrc *rs, GstElement *appsrc,
+		volatile int *g_exit)
+{
+	rs->appsrc = GST_APP_SRC(appsrc);
+	rs->g_exit = g_exit;
+	rs->offset = 0;
+	g_object_set(appsrc, "format", GST_FORMAT_BYTES,
+			"stream-type", GST_APP_STREAM_TYPE_RANDOM_ACCESS,
+			"size", (gint64)rs->rc.size,
+			"blocksize", (guint)RANGE_BLOCK, NULL);
+	g_signal_connect(appsrc, "need-data", G_CALLBACK(range_need_data), rs);
+	g_signal_connect(appsrc, "seek-data", G_CALLBACK(range_seek_data), rs);
+	g_print("Random access to %lld bytes.\n", (long long)rs->rc.size);
+}
+
+/* -A: one connection from netplay -A, kept for the whole session */
+static int range_accept(const char *port)
+{
+	struct pollfd pfd;
+	int lsock, sock = -1, sysret;
+
+	lsock = prepare_net(port, SOCK_STREAM);
+	if (lsock < 0) {
+		fprintf(stderr, "Cannot initialize socket for receiving\n");
+		return -1;
+	}
+	if (listen(lsock, 1) == -1) {
+		fprintf(stderr, "Cannot listen to the socket: %s\n",
+				strerror(errno));
+		goto exit_10;
+	}
+	pfd.fd = lsock;
+	pfd.events = POLLIN;
+	do
+		sysret = netev_poll(&pfd, 1, -1);
+	while (sysret == -1 && errno == EINTR);
+	if (sysret == -1)
+		fprintf(stderr, "poll accept failed: %s\n", strerror(errno));
+	if (sysret <= 0)
+		goto exit_10;
+	sock = accept(lsock, NULL, NULL);
+	if (sock == -1)
+		fprintf(stderr, "accept failed: %s\n", strerror(errno));
+
+exit_10:
+	close(lsock);
+	return sock;
+}
+
 static void * net_receiver(void *dat)
 {
 	struct commarg *tharg = (struct commarg *)dat;
 
 	net_processing(tharg);
-
-	*tharg->start = -1;
 	return NULL;
 }
 
@@ -115,29 +752,209 @@ int main(int argc, char *argv[])
 {
 	struct CustomData data;
 	struct commarg tharg;
+	struct gstsink gsink;
+	struct rangesrc rsrc;
 	GstBus *bus;
 	GstMessage *msg;
 	GstStateChangeReturn ret;
 	GstMessageType mesg;
 	struct sigaction mact;
+	struct pollfd evs[2];
+	GPollFD busfd;
+	GstPad *pad;
+	GstElement *head;
 	int pfd[2], sysret, retv = 0;
 	pthread_t netsrc;
-	volatile int play;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	int c, finish, appsrc, interval, fake, ranged, rsock;
+	const char *statpath;
+	extern char *optarg;
+	extern int optind, opterr, optopt;
 
-	pthread_mutex_init(&mutex, NULL);
-	pthread_cond_init(&cond, NULL);
 	memset(&data, 0, sizeof(data));
+	memset(&tharg, 0, sizeof(tharg));
+	memset(&gsink, 0, sizeof(gsink));
+	memset(&rsrc, 0, sizeof(rsrc));
 	data.duration = GST_CLOCK_TIME_NONE;
 
 	data.terminate = &global_exit;
+	data.queue_ms = 1000;
+	data.low_pct = 10;
+	data.high_pct = 100;
+	data.rec_mb = 256;
 	gst_init(&argc, &argv);
-	if (argc > 1)
-		tharg.port = argv[1];
-	else
+	tharg.port = NULL;
+	appsrc = 0;
+	fake = 0;
+	ranged = 0;
+	rsock = -1;
+	statpath = NULL;
+	interval = 1000;
+	finish = 0;
+	opterr = 0;
+	do {
+		c = getopt(argc, argv, ":p:zualq:t:S:i:fdnckb:w:o:R:As:");
+		switch(c) {
+		case '?':
+			fprintf(stderr, "Unknown option: %c\n", (char)optopt);
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument for %c\n",
+					(char)optopt);
+			break;
+		case 'p':
+			tharg.port = optarg;
+			break;
+		case 'z':
+			tharg.splice = 1;
+			break;
+		case 'u':
+			tharg.socktype = SOCK_DGRAM;
+			break;
+		case 'a':
+			appsrc = 1;
+			break;
+		case 'l':
+			data.lowlat = TRUE;
+			break;
+		case 'q':
+			data.queue_ms = atoi(optarg);
+			break;
+		case 't':
+			data.dec_threads = atoi(optarg);
+			break;
+		case 'S':
+			statpath = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'f':
+			fake = 1;
+			break;
+		case 'd':
+			data.daemon = TRUE;
+			break;
+		case 'n':
+			tharg.stripe = 1;
+			break;
+		case 'c':
+			tharg.compress = 1;
+			break;
+		case 'k':
+			tharg.check = 1;
+			break;
+		case 'b':
+			if (jitter_parse(optarg, &data) == -1) {
+				fprintf(stderr, "Invalid jitter buffer size: " \
+						"%s\n", optarg);
+				retv = 6;
+				goto exit_10;
+			}
+			break;
+		case 'w':
+			if (sscanf(optarg, "%u,%u", &data.low_pct,
+						&data.high_pct) != 2 ||
+					data.low_pct >= data.high_pct ||
+					data.high_pct > 100) {
+				fprintf(stderr, "Invalid watermarks: %s, " \
+						"want low,high in %%\n", optarg);
+				retv = 6;
+				goto exit_10;
+			}
+			break;
+		case 'o':
+			data.rec_path = optarg;
+			break;
+		case 'A':
+			ranged = 1;
+			break;
+		case 's':
+			data.start_sec = atoi(optarg);
+			break;
+		case 'R':
+			data.rec_keep = 0;
+			if (sscanf(optarg, "%u,%u", &data.rec_mb,
+						&data.rec_keep) < 1 ||
+					data.rec_mb == 0) {
+				fprintf(stderr, "Invalid segments: %s, " \
+						"want MiB[,count]\n", optarg);
+				retv = 6;
+				goto exit_10;
+			}
+			break;
+		case -1:
+			finish = 1;
+			break;
+		default:
+			assert(0);
+		}
+	} while (finish == 0);
+	if (tharg.port == NULL && argc > optind)
+		tharg.port = argv[optind];
+	if (tharg.port == NULL)
 		tharg.port = "7800";
+	if (data.lowlat && !appsrc) {
+		g_print("Low latency profile needs a live source, using appsrc.\n");
+		appsrc = 1;
+	}
+	if (data.lowlat && (data.jitter_bytes || data.jitter_ms)) {
+		fprintf(stderr, "A jitter buffer is latency on purpose, " \
+				"-b goes without -l.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (ranged && (data.daemon || data.lowlat || tharg.stripe ||
+				tharg.compress || tharg.check ||
+				tharg.socktype == SOCK_DGRAM || data.rec_path ||
+				data.jitter_bytes || data.jitter_ms)) {
+		fprintf(stderr, "Random access reads on demand through its " \
+				"own cache, -A goes without -b -c -d -k -l " \
+				"-n -o -u.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (ranged)
+		appsrc = 1;
+	if (data.daemon && tharg.socktype == SOCK_DGRAM) {
+		fprintf(stderr, "Daemon mode is TCP only.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (tharg.stripe && (data.daemon || tharg.socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Striped transfer is one TCP stream, " \
+				"-n goes without -d -u.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (tharg.compress && (tharg.stripe || tharg.socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Compression is for a single TCP stream, " \
+				"-c goes without -n -u.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (tharg.check && (tharg.stripe || tharg.compress ||
+				tharg.socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Checked blocks are for a single plain TCP " \
+				"stream, -k goes without -c -n -u.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (data.daemon && !appsrc) {
+		g_print("Daemon mode resets the pipeline per stream, using appsrc.\n");
+		appsrc = 1;
+	}
 
+	tharg.start_fd = -1;
+	if (netev_init() == -1) {
+		retv = 2;
+		goto exit_10;
+	}
+	wake_fd = netev_new();
+	tharg.start_fd = netev_new();
+	if (wake_fd == -1 || tharg.start_fd == -1) {
+		retv = 2;
+		goto exit_10;
+	}
 	memset(&mact, 0, sizeof(mact));
 	mact.sa_handler = sig_handler;
 	if (sigaction(SIGUSR1, &mact, NULL) == -1 ||
@@ -146,26 +963,69 @@ int main(int argc, char *argv[])
 			sigaction(SIGTERM, &mact, NULL) == -1)
 		fprintf(stderr, "Cannot install signal handler: %s\n",
 				strerror(errno));
+	stats_start(statpath, interval, &global_exit);
 
-	sysret = pipe(pfd);
-	if (sysret == -1) {
-		fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
-		retv = 2;
-		goto exit_10;
+	if (appsrc)
+		pfd[0] = pfd[1] = -1;
+	else {
+		sysret = pipe(pfd);
+		if (sysret == -1) {
+			fprintf(stderr, "Cannot create pipe: %s\n",
+					strerror(errno));
+			retv = 2;
+			goto exit_10;
+		}
 	}
 	tharg.dstfd = pfd[1];
-	tharg.start = &play;
 	tharg.g_exit = &global_exit;
-	tharg.mutex = &mutex;
-	tharg.cond = &cond;
 
-	data.source = gst_element_factory_make("fdsrc", "source");
+	data.source = gst_element_factory_make(appsrc ? "appsrc" : "fdsrc",
+			"source");
 	data.decoder = gst_element_factory_make("decodebin", "decoder");
 	data.a_convert = gst_element_factory_make("audioconvert", "a_convert");
 	data.resample = gst_element_factory_make("audioresample", "resample");
-	data.a_sink = gst_element_factory_make("autoaudiosink", "a_sink");
+	data.a_sink = gst_element_factory_make(fake ? "fakesink" :
+			"autoaudiosink", "a_sink");
 	data.v_convert = gst_element_factory_make("videoconvert", "v_convert");
-	data.v_sink = gst_element_factory_make("autovideosink", "v_sink");
+	data.v_sink = gst_element_factory_make(fake ? "fakesink" :
+			"autovideosink", "v_sink");
+	/* -f: decode as fast as the data comes, for benchmarking */
+	if (fake && data.a_sink && data.v_sink) {
+		g_object_set(data.a_sink, "sync", FALSE, NULL);
+		g_object_set(data.v_sink, "sync", FALSE, NULL);
+	}
+
+	if (data.lowlat || data.queue_ms > 0) {
+		data.a_queue = gst_element_factory_make("queue", "a_queue");
+		data.v_queue = gst_element_factory_make("queue", "v_queue");
+		if (!data.a_queue || !data.v_queue) {
+			g_printerr("Not all elements could be created.\n");
+			retv = 4;
+			goto exit_25;
+		}
+	}
+	if (data.jitter_bytes || data.jitter_ms) {
+		data.jitter = gst_element_factory_make("queue2", "jitter");
+		if (!data.jitter) {
+			g_printerr("Not all elements could be created.\n");
+			retv = 4;
+			goto exit_25;
+		}
+	}
+	if (data.rec_path) {
+		data.tee = gst_element_factory_make("tee", "tee");
+		data.rec_queue = gst_element_factory_make("queue",
+				"rec_queue");
+		data.rec_sink = gst_element_factory_make("multifilesink",
+				"rec_sink");
+		if (!data.tee || !data.rec_queue || !data.rec_sink) {
+			g_printerr("Not all elements could be created.\n");
+			retv = 4;
+			goto exit_25;
+		}
+	}
+	data.a_head = data.a_queue ? data.a_queue : data.a_convert;
+	data.v_head = data.v_queue ? data.v_queue : data.v_convert;
 
 	data.pipeline = gst_pipeline_new("test-pipeline");
 	if (!data.source || !data.a_sink || !data.a_convert || !data.v_convert ||
@@ -189,28 +1049,109 @@ int main(int argc, char *argv[])
 		retv = 4;
 		goto exit_30;
 	}
-	if (gst_element_link_many(data.source, data.decoder, NULL) != TRUE) {
+	if (data.a_queue) {
+		gst_bin_add_many(GST_BIN(data.pipeline), data.a_queue,
+				data.v_queue, NULL);
+		if (gst_element_link(data.a_queue, data.a_convert) != TRUE ||
+				gst_element_link(data.v_queue,
+					data.v_convert) != TRUE) {
+			g_printerr ("Elements could not be linked.\n");
+			retv = 4;
+			goto exit_30;
+		}
+		queue_setup(&data);
+	}
+	if (data.lowlat)
+		lowlat_setup(&data);
+	g_signal_connect(data.pipeline, "deep-element-added",
+			G_CALLBACK(element_added), &data);
+	head = data.source;
+	if (data.tee) {
+		gst_bin_add_many(GST_BIN(data.pipeline), data.tee,
+				data.rec_queue, data.rec_sink, NULL);
+		if (gst_element_link(data.source, data.tee) != TRUE ||
+				gst_element_link_many(data.tee, data.rec_queue,
+					data.rec_sink, NULL) != TRUE) {
+			g_printerr ("Elements could not be linked.\n");
+			retv = 4;
+			goto exit_30;
+		}
+		if (rec_setup(&data) == -1) {
+			retv = 4;
+			goto exit_30;
+		}
+		pad = gst_element_get_static_pad(data.rec_queue, "src");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+				(GstPadProbeCallback)rec_probe, &data, NULL);
+		gst_object_unref(pad);
+		g_signal_connect(data.rec_queue, "overrun",
+				G_CALLBACK(rec_overrun), &data);
+		head = data.tee;
+	}
+	if (data.jitter) {
+		gst_bin_add(GST_BIN(data.pipeline), data.jitter);
+		if (gst_element_link_many(head, data.jitter,
+					data.decoder, NULL) != TRUE) {
+			g_printerr ("Elements could not be linked.\n");
+			retv = 4;
+			goto exit_30;
+		}
+		if (jitter_setup(&data) == -1) {
+			retv = 4;
+			goto exit_30;
+		}
+		pad = gst_element_get_static_pad(data.jitter, "src");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+				(GstPadProbeCallback)jitter_probe, &data, NULL);
+		gst_object_unref(pad);
+	} else if (gst_element_link_many(head, data.decoder,
+				NULL) != TRUE) {
 		g_printerr ("Elements could not be linked.\n");
 		gst_object_unref (data.pipeline);
 		retv = 4;
 		goto exit_30;
 	}
 
-	g_object_set(data.source, "fd", (gint)pfd[0], NULL);
+	if (ranged) {
+		rsock = range_accept(tharg.port);
+		if (rsock == -1 || range_open(&rsrc.rc, rsock,
+					stats_new("range")) == -1) {
+			retv = global_exit ? 0 : 3;
+			goto exit_30;
+		}
+		range_setup(&rsrc, data.source, &global_exit);
+	} else if (appsrc) {
+		if (gstsink_init(&gsink, data.source,
+					tharg.socktype == SOCK_DGRAM ?
+					APPSRC_DGRAMSZ : APPSRC_BUFSZ,
+					&global_exit) == -1) {
+			retv = 4;
+			goto exit_30;
+		}
+		tharg.sink = &gsink.ns;
+		tharg.persist = data.daemon;
+		data.gsink = &gsink;
+	} else
+		g_object_set(data.source, "fd", (gint)pfd[0], NULL);
 	g_signal_connect(data.decoder, "pad-added", G_CALLBACK(pad_added_handler), &data);
 
-	play = 0;
-	sysret = pthread_create(&netsrc, NULL, &net_receiver, &tharg);
-	if (sysret) {
-		fprintf(stderr, "Cannot create udp receiver: %s\n",
-				strerror(errno));
-		retv = 3;
+	if (!ranged) {
+		sysret = pthread_create(&netsrc, NULL, &net_receiver, &tharg);
+		if (sysret) {
+			fprintf(stderr, "Cannot create udp receiver: %s\n",
+					strerror(errno));
+			retv = 3;
+			goto exit_30;
+		}
+		netev_wait(tharg.start_fd);
 	}
-	pthread_mutex_lock(&mutex);
-	while (play == 0)
-		pthread_cond_wait(&cond, &mutex);
-	pthread_mutex_unlock(&mutex);
-	ret = gst_element_set_state(data.pipeline, GST_STATE_PLAYING);
+	/*
+	 * daemon: pre-roll nothing yet, each connection starts it. With a
+	 * jitter buffer PAUSED, its BUFFERING messages say when to play.
+	 */
+	ret = gst_element_set_state(data.pipeline, data.daemon ?
+			GST_STATE_READY : data.jitter ? GST_STATE_PAUSED :
+			GST_STATE_PLAYING);
 	if (ret == GST_STATE_CHANGE_FAILURE) {
 		g_printerr("Unable to set the pipeline to the playing state.\n");
 		gst_object_unref (data.pipeline);
@@ -218,15 +1159,29 @@ int main(int argc, char *argv[])
 		goto exit_50;
 	}
 
+	/* asleep until a message, a SIGUSR1/2 or exit */
 	bus = gst_element_get_bus(data.pipeline);
+	gst_bus_get_pollfd(bus, &busfd);
+	evs[0].fd = busfd.fd;
+	evs[0].events = POLLIN;
+	evs[1].fd = wake_fd;
+	evs[1].events = POLLIN;
+	mesg = GST_MESSAGE_STATE_CHANGED|GST_MESSAGE_ERROR|
+		GST_MESSAGE_EOS|GST_MESSAGE_DURATION|
+		GST_MESSAGE_LATENCY|GST_MESSAGE_APPLICATION|
+		GST_MESSAGE_BUFFERING;
 	do {
-		mesg = GST_MESSAGE_STATE_CHANGED|GST_MESSAGE_ERROR|
-			GST_MESSAGE_EOS|GST_MESSAGE_DURATION;
-		msg = gst_bus_timed_pop_filtered(bus, 200 * GST_MSECOND, mesg);
-		if (msg) {
-			gst_mesg_check(msg, &data);
-			continue;
+		sysret = netev_poll(evs, 2, -1);
+		if (sysret == -1 && errno != EINTR) {
+			fprintf(stderr, "poll bus failed: %s\n",
+					strerror(errno));
+			break;
 		}
+		if (evs[1].revents)
+			netev_wait(wake_fd);
+		while ((msg = gst_bus_pop_filtered(bus, mesg)) != NULL)
+			gst_mesg_check(msg, &data);
+
 		if (GST_CLOCK_TIME_IS_VALID(data.duration)) {
 			if (!print_current)
 				continue;
@@ -248,21 +1203,33 @@ int main(int argc, char *argv[])
 				GST_TIME_ARGS(data.duration));
 	} while(!(*data.terminate));
 
+	if (data.gsink)
+		gstsink_wake(&gsink, FALSE);
 	gst_object_unref(bus);
 	gst_element_set_state(data.pipeline, GST_STATE_NULL);
 
 exit_50:
-	pthread_join(netsrc, NULL);
+	if (!ranged)
+		pthread_join(netsrc, NULL);
 
 exit_30:
 	gst_object_unref(data.pipeline);
+	if (appsrc && !ranged)
+		gstsink_exit(&gsink);
+	if (rsrc.appsrc)
+		range_close(&rsrc.rc);
+	if (rsock != -1)
+		close(rsock);
 exit_25:
-	close(pfd[0]);
-	close(pfd[1]);
+	if (!appsrc) {
+		close(pfd[0]);
+		close(pfd[1]);
+	}
 
 exit_10:
-	pthread_mutex_destroy(&mutex);
-	pthread_cond_destroy(&cond);
+	stats_stop();
+	if (tharg.start_fd != -1)
+		close(tharg.start_fd);
 	return retv;
 }
 
@@ -282,13 +1249,13 @@ static void pad_added_handler(GstElement *src, GstPad *new_pad, struct CustomDat
 	new_pad_struct = gst_caps_get_structure(new_pad_caps, 0);
 	new_pad_type = gst_structure_get_name(new_pad_struct);
 	if (g_str_has_prefix(new_pad_type, "audio/x-raw")) {
-		sink_pad = gst_element_get_static_pad(data->a_convert, "sink");
+		sink_pad = gst_element_get_static_pad(data->a_head, "sink");
 		if (gst_pad_is_linked(sink_pad)) {
 			g_print("Audio already linked. Ignored.\n");
 			goto exit_10;
 		}
 	} else if (g_str_has_prefix(new_pad_type, "video/x-raw")) {
-	       sink_pad = gst_element_get_static_pad(data->v_convert, "sink");
+	       sink_pad = gst_element_get_static_pad(data->v_head, "sink");
 	       if (gst_pad_is_linked(sink_pad)) {
 		       g_print("Video already linked. Ignored.\n");
 		       goto exit_10;
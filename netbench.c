@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <time.h>
+#include "stats.h"
+
+#define BENCH_MAXARGS	32
+#define BENCH_CHUNK	(1024*1024)
+#define BENCH_TIMEOUT	120	/* seconds a single run may take */
+
+/*
+ * One transport/copy mode: the receiver binary and the extra options
+ * given to it and to netplay. Modes marked media need a real stream
+ * file since netdisp has to decode what it gets.
+ */
+struct benchmode {
+	const char *name;
+	const char *rcv;
+	const char *rargs;
+	const char *sargs;
+	int media;
+};
+
+static const struct benchmode modes[] = {
+	{"tcp-copy",     "netfile", "",        "-e copy",     0},
+	{"tcp-mmap",     "netfile", "",        "-e mmap",     0},
+	{"tcp-sendfile", "netfile", "",        "-e sendfile", 0},
+	{"tcp-splice",   "netfile", "-z",      "-e sendfile", 0},
+	{"tcp-queue",    "netfile", "-q",      "-e sendfile", 0},
+	{"tcp-direct",   "netfile", "-q -D",   "-e sendfile", 0},
+	{"udp-queue",    "netfile", "-u -q",   "-u -b 2000",  0},
+	{"disp-fdsrc",   "netdisp", "-f",      "-e sendfile", 1},
+	{"disp-appsrc",  "netdisp", "-f -a",   "-e sendfile", 1},
+	{NULL, NULL, NULL, NULL, 0}
+};
+
+struct benchres {
+	double secs;
+	double snd_cpu, rcv_cpu;
+	unsigned long bytes;
+	unsigned long lat[STATS_LATBKT];
+	int status;
+};
+
+static int verbose;
+
+static int make_payload(const char *fname, off_t size)
+{
+	struct stat st;
+	unsigned long long x, *buf;
+	off_t done;
+	int fd, i, len, retv = 0;
+
+	if (stat(fname, &st) == 0 && st.st_size == size)
+		return 0;
+	fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open %s for writing: %s\n", fname,
+				strerror(errno));
+		return -1;
+	}
+	buf = malloc(BENCH_CHUNK);
+	if (!buf) {
+		fprintf(stderr, "Out of Memory.\n");
+		close(fd);
+		return -1;
+	}
+	/* xorshift, incompressible and cheap to generate */
+	x = 0x9e3779b97f4a7c15ULL;
+	for (done = 0; done < size; done += len) {
+		for (i = 0; i < (int)(BENCH_CHUNK / sizeof(x)); i++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			buf[i] = x;
+		}
+		len = size - done > BENCH_CHUNK ? BENCH_CHUNK : size - done;
+		if (write(fd, buf, len) != len) {
+			fprintf(stderr, "Cannot write %s: %s\n", fname,
+					strerror(errno));
+			retv = -1;
+			break;
+		}
+	}
+	free(buf);
+	close(fd);
+	return retv;
+}
+
+static int split_args(char *argv[], int argc, char *str)
+{
+	char *tok, *save;
+
+	for (tok = strtok_r(str, " ", &save); tok && argc < BENCH_MAXARGS - 1;
+			tok = strtok_r(NULL, " ", &save))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+	return argc;
+}
+
+static pid_t spawn(char *argv[])
+{
+	pid_t pid;
+	int fd;
+
+	if (verbose) {
+		int i;
+
+		for (i = 0; argv[i]; i++)
+			fprintf(stderr, "%s%s", i ? " " : "+ ", argv[i]);
+		fprintf(stderr, "\n");
+	}
+	pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "fork failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		if (!verbose) {
+			fd = open("/dev/null", O_WRONLY);
+			dup2(fd, 1);
+			dup2(fd, 2);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+/* look for the port in /proc/net/{tcp,udp}, listening/unconnected */
+static int port_ready(int port, int udp)
+{
+	char line[256];
+	unsigned int lport, state;
+	FILE *fp;
+	int found = 0;
+
+	fp = fopen(udp ? "/proc/net/udp" : "/proc/net/tcp", "r");
+	if (!fp)
+		return 0;
+	while (!found && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, " %*d: %*x:%x %*x:%*x %x", &lport,
+					&state) != 2)
+			continue;
+		if (lport == (unsigned int)port && state == (udp ? 0x07 : 0x0a))
+			found = 1;
+	}
+	fclose(fp);
+	return found;
+}
+
+static double tv_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* wait for pid, killing it once deadline has passed */
+static int reap(pid_t pid, time_t deadline, double *cpu)
+{
+	struct rusage ru;
+	struct timespec tick = {.tv_sec = 0, .tv_nsec = 10000000};
+	pid_t sysret;
+	int status, killed = 0;
+
+	for (;;) {
+		sysret = wait4(pid, &status, WNOHANG, &ru);
+		if (sysret == pid)
+			break;
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "wait4 failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (time(NULL) > deadline && killed < 2) {
+			kill(pid, killed ? SIGKILL : SIGTERM);
+			killed++;
+			deadline += 2;
+		}
+		nanosleep(&tick, NULL);
+	}
+	*cpu = tv_secs(&ru.ru_utime) + tv_secs(&ru.ru_stime);
+	if (killed)
+		return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int read_stats(const char *fname, const char *stage,
+		struct benchres *res)
+{
+	char line[1024], key[32], *p;
+	FILE *fp;
+	int bkt, found = 0;
+
+	fp = fopen(fname, "r");
+	if (!fp)
+		return -1;
+	snprintf(key, sizeof(key), "stage=%s ", stage);
+	while (!found && fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, key, strlen(key)) != 0)
+			continue;
+		p = strstr(line, " bytes=");
+		if (p)
+			res->bytes = strtoul(p + 7, NULL, 10);
+		p = strstr(line, " lat=");
+		if (p) {
+			p += 5;
+			for (bkt = 0; bkt < STATS_LATBKT; bkt++) {
+				res->lat[bkt] = strtoul(p, &p, 10);
+				if (*p == ',')
+					p++;
+			}
+		}
+		found = 1;
+	}
+	fclose(fp);
+	return found ? 0 : -1;
+}
+
+static int same_file(const char *f1, const char *f2)
+{
+	char *b1, *b2;
+	int fd1, fd2, retv = 0;
+	ssize_t n1, n2;
+
+	fd1 = open(f1, O_RDONLY);
+	fd2 = open(f2, O_RDONLY);
+	b1 = malloc(BENCH_CHUNK);
+	b2 = malloc(BENCH_CHUNK);
+	if (fd1 == -1 || fd2 == -1 || !b1 || !b2)
+		goto exit_10;
+	do {
+		n1 = read(fd1, b1, BENCH_CHUNK);
+		n2 = read(fd2, b2, BENCH_CHUNK);
+		if (n1 != n2 || n1 < 0 || memcmp(b1, b2, n1) != 0)
+			goto exit_10;
+	} while (n1 > 0);
+	retv = 1;
+
+exit_10:
+	free(b1);
+	free(b2);
+	if (fd1 != -1)
+		close(fd1);
+	if (fd2 != -1)
+		close(fd2);
+	return retv;
+}
+
+static int run_mode(const struct benchmode *m, const char *bindir,
+		const char *input, const char *tmpdir, int port,
+		struct benchres *res)
+{
+	char rbin[256], sbin[256], pstr[16], outf[256], statf[256];
+	char rargs[128], sargs[128];
+	char *rargv[BENCH_MAXARGS], *sargv[BENCH_MAXARGS];
+	struct timespec t0, t1;
+	time_t deadline;
+	pid_t rpid, spid;
+	int rargc, sargc, udp, i, sstat;
+
+	memset(res, 0, sizeof(struct benchres));
+	snprintf(rbin, sizeof(rbin), "%s/%s", bindir, m->rcv);
+	snprintf(sbin, sizeof(sbin), "%s/netplay", bindir);
+	snprintf(pstr, sizeof(pstr), "%d", port);
+	snprintf(outf, sizeof(outf), "%s/netbench-out.dat", tmpdir);
+	snprintf(statf, sizeof(statf), "%s/netbench-stats.txt", tmpdir);
+	strncpy(rargs, m->rargs, sizeof(rargs) - 1);
+	rargs[sizeof(rargs) - 1] = 0;
+	strncpy(sargs, m->sargs, sizeof(sargs) - 1);
+	sargs[sizeof(sargs) - 1] = 0;
+	unlink(outf);
+	unlink(statf);
+	udp = strstr(m->rargs, "-u") != NULL;
+
+	rargc = 0;
+	rargv[rargc++] = rbin;
+	rargv[rargc++] = "-p";
+	rargv[rargc++] = pstr;
+	rargv[rargc++] = "-S";
+	rargv[rargc++] = statf;
+	rargv[rargc++] = "-i";
+	rargv[rargc++] = "100";
+	rargc = split_args(rargv, rargc, rargs);
+	if (!m->media)
+		rargv[rargc++] = outf;
+	rargv[rargc] = NULL;
+
+	sargc = 0;
+	sargv[sargc++] = sbin;
+	sargv[sargc++] = "-p";
+	sargv[sargc++] = pstr;
+	sargc = split_args(sargv, sargc, sargs);
+	sargv[sargc++] = (char *)input;
+	sargv[sargc] = NULL;
+
+	rpid = spawn(rargv);
+	if (rpid == -1)
+		return -1;
+	for (i = 0; i < 500 && !port_ready(port, udp); i++)
+		usleep(10000);
+	if (i == 500) {
+		fprintf(stderr, "%s: receiver did not come up\n", m->name);
+		kill(rpid, SIGKILL);
+		reap(rpid, 0, &res->rcv_cpu);
+		return -1;
+	}
+
+	deadline = time(NULL) + BENCH_TIMEOUT;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	spid = spawn(sargv);
+	if (spid == -1) {
+		kill(rpid, SIGKILL);
+		reap(rpid, 0, &res->rcv_cpu);
+		return -1;
+	}
+	sstat = reap(spid, deadline, &res->snd_cpu);
+	res->status = reap(rpid, deadline, &res->rcv_cpu);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	res->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (sstat != 0)
+		res->status = sstat;
+
+	if (read_stats(statf, "net", res) == -1) {
+		fprintf(stderr, "%s: no stats from receiver\n", m->name);
+		return -1;
+	}
+	if (!m->media && res->status == 0 && !udp && !same_file(input, outf))
+		res->status = -2;
+	unlink(outf);
+	return 0;
+}
+
+static void print_result(const struct benchmode *m, const struct benchres *res,
+		off_t size)
+{
+	double gb = res->bytes / 1e9;
+	char result[32], pct[3][16];
+	const int pcts[3] = {50, 90, 99};
+	unsigned long n;
+	int i;
+
+	if (res->status == -2)
+		snprintf(result, sizeof(result), "MISMATCH");
+	else if (res->status != 0)
+		snprintf(result, sizeof(result), "exit %d", res->status);
+	else if (res->bytes < (unsigned long)size)
+		snprintf(result, sizeof(result), "lost %.2f%%",
+				(size - res->bytes) * 100.0 / size);
+	else
+		snprintf(result, sizeof(result), "ok");
+	/* no samples is no measurement, not zero latency */
+	for (i = 0, n = 0; i < STATS_LATBKT; i++)
+		n += res->lat[i];
+	for (i = 0; i < 3; i++)
+		if (n)
+			snprintf(pct[i], sizeof(pct[i]), "%lu",
+					stats_percentile(res->lat, pcts[i]));
+		else
+			snprintf(pct[i], sizeof(pct[i]), "-");
+	printf("%-13s %9.1f %9.3f %9.3f %9.3f %8s %8s %8s  %s\n", m->name,
+			res->secs > 0 ? res->bytes / res->secs / 1e6 : 0,
+			gb > 0 ? (res->snd_cpu + res->rcv_cpu) / gb : 0,
+			res->snd_cpu, res->rcv_cpu, pct[0], pct[1], pct[2],
+			result);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct benchmode *m;
+	struct benchres res;
+	char payload[256], path[256];
+	const char *bindir, *tmpdir, *media, *only, *input;
+	struct stat st;
+	off_t size, expect;
+	int c, finish, port, runs, i, retv = 0;
+	extern char *optarg;
+	extern int optind, opterr, optopt;
+
+	bindir = ".";
+	tmpdir = "/tmp";
+	media = NULL;
+	only = NULL;
+	size = 256;
+	port = 7890;
+	runs = 1;
+	verbose = 0;
+	opterr = 0;
+	finish = 0;
+	do {
+		c = getopt(argc, argv, ":s:r:p:B:T:m:M:v");
+		switch(c) {
+		case '?':
+			fprintf(stderr, "Unknown option: %c\n", (char)optopt);
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument for %c\n",
+					(char)optopt);
+			break;
+		case 's':
+			size = atol(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'B':
+			bindir = optarg;
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		case 'm':
+			media = optarg;
+			break;
+		case 'M':
+			only = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case -1:
+			finish = 1;
+			break;
+		default:
+			assert(0);
+		}
+	} while (finish == 0);
+	if (size <= 0)
+		size = 256;
+	size *= 1024 * 1024;
+
+	snprintf(payload, sizeof(payload), "%s/netbench-payload.dat", tmpdir);
+	if (make_payload(payload, size) == -1)
+		return 1;
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("payload %lld bytes, %d run(s) per mode\n", (long long)size,
+			runs);
+	printf("p50/p90/p99-us: receiver latency per write into the " \
+			"pipe/queue/file, not per chunk end to end\n");
+	printf("%-13s %9s %9s %9s %9s %8s %8s %8s  %s\n", "mode", "MB/s",
+			"cpu-s/GB", "snd-cpu", "rcv-cpu", "p50-us", "p90-us",
+			"p99-us", "result");
+	for (m = modes; m->name; m++) {
+		if (only && strstr(m->name, only) == NULL)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", bindir, m->rcv);
+		if (access(path, X_OK) != 0) {
+			printf("%-13s skipped, %s not built\n", m->name, path);
+			continue;
+		}
+		if (m->media && !media) {
+			printf("%-13s skipped, needs a media file (-m)\n",
+					m->name);
+			continue;
+		}
+		input = m->media ? media : payload;
+		expect = size;
+		if (m->media)
+			expect = stat(media, &st) == 0 ? st.st_size : 0;
+		for (i = 0; i < runs; i++) {
+			if (run_mode(m, bindir, input, tmpdir, port++,
+						&res) == -1) {
+				retv = 2;
+				continue;
+			}
+			print_result(m, &res, expect);
+			if (res.status != 0)
+				retv = 2;
+		}
+	}
+	return retv;
+}
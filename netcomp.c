@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "netcomp.h"
+#include "proto.h"
+
+#define NETCOMP_ZSTD_LEVEL	1
+#define NETCOMP_ZLIB_LEVEL	1
+
+/* the receiver picks the first of these both sides have */
+static const int netcomp_order[] = {
+	NETCOMP_ZSTD, NETCOMP_LZ4, NETCOMP_ZLIB
+};
+
+unsigned int netcomp_supported(void)
+{
+	unsigned int codecs = 0;
+
+#ifdef HAVE_ZSTD
+	codecs |= 1 << NETCOMP_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+	codecs |= 1 << NETCOMP_LZ4;
+#endif
+#ifdef HAVE_ZLIB
+	codecs |= 1 << NETCOMP_ZLIB;
+#endif
+	return codecs;
+}
+
+const char * netcomp_name(int codec)
+{
+	switch (codec) {
+	case NETCOMP_ZSTD:
+		return "zstd";
+	case NETCOMP_LZ4:
+		return "lz4";
+	case NETCOMP_ZLIB:
+		return "zlib";
+	default:
+		return "none";
+	}
+}
+
+static int netcomp_send_hello(int sock, unsigned int codecs)
+{
+	struct netcomp_hello msg;
+
+	msg.magic = htobe32(NETCOMP_MAGIC);
+	msg.codecs = htobe32(codecs);
+	return proto_write(sock, &msg, sizeof(msg));
+}
+
+static int netcomp_recv_hello(int sock, unsigned int *codecs)
+{
+	struct netcomp_hello msg;
+
+	if (proto_read(sock, &msg, sizeof(msg)) == -1)
+		return -1;
+	if (be32toh(msg.magic) != NETCOMP_MAGIC) {
+		fprintf(stderr, "handshake: peer does not offer " \
+				"compression, -c on both sides?\n");
+		return -1;
+	}
+	*codecs = be32toh(msg.codecs);
+	return 0;
+}
+
+/* sender: offer what we have, codec is what the receiver took */
+int netcomp_offer(int sock, int *codec)
+{
+	unsigned int codecs, i;
+
+	if (netcomp_send_hello(sock, netcomp_supported()) == -1 ||
+			netcomp_recv_hello(sock, &codecs) == -1)
+		return -1;
+	*codec = NETCOMP_NONE;
+	for (i = 0; i < sizeof(netcomp_order) / sizeof(int); i++)
+		if (codecs == 1u << netcomp_order[i])
+			*codec = netcomp_order[i];
+	if (codecs && *codec == NETCOMP_NONE) {
+		fprintf(stderr, "handshake: receiver chose codec mask %#x\n",
+				codecs);
+		return -1;
+	}
+	return 0;
+}
+
+/* receiver: take the sender's offer and answer with our choice */
+int netcomp_accept(int sock, int *codec)
+{
+	unsigned int codecs, i;
+
+	if (netcomp_recv_hello(sock, &codecs) == -1)
+		return -1;
+	codecs &= netcomp_supported();
+	*codec = NETCOMP_NONE;
+	for (i = 0; i < sizeof(netcomp_order) / sizeof(int); i++)
+		if (codecs & (1 << netcomp_order[i])) {
+			*codec = netcomp_order[i];
+			break;
+		}
+	return netcomp_send_hello(sock, *codec == NETCOMP_NONE ? 0 :
+			1 << *codec);
+}
+
+size_t netcomp_bound(int codec, size_t len)
+{
+	switch (codec) {
+#ifdef HAVE_ZSTD
+	case NETCOMP_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_LZ4
+	case NETCOMP_LZ4:
+		return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_ZLIB
+	case NETCOMP_ZLIB:
+		return compressBound(len);
+#endif
+	default:
+		return len;
+	}
+}
+
+long netcomp_compress(int codec, char *dst, size_t dstlen, const char *src,
+		size_t len)
+{
+#ifdef HAVE_ZSTD
+	size_t zret;
+#endif
+#ifdef HAVE_ZLIB
+	uLongf zlen;
+#endif
+	int ret;
+
+	switch (codec) {
+#ifdef HAVE_ZSTD
+	case NETCOMP_ZSTD:
+		zret = ZSTD_compress(dst, dstlen, src, len,
+				NETCOMP_ZSTD_LEVEL);
+		return ZSTD_isError(zret) ? -1 : (long)zret;
+#endif
+#ifdef HAVE_LZ4
+	case NETCOMP_LZ4:
+		ret = LZ4_compress_default(src, dst, len, dstlen);
+		return ret > 0 ? ret : -1;
+#endif
+#ifdef HAVE_ZLIB
+	case NETCOMP_ZLIB:
+		zlen = dstlen;
+		ret = compress2((Bytef *)dst, &zlen, (const Bytef *)src, len,
+				NETCOMP_ZLIB_LEVEL);
+		return ret == Z_OK ? (long)zlen : -1;
+#endif
+	default:
+		ret = -1;
+	}
+	return ret;
+}
+
+long netcomp_decompress(int codec, char *dst, size_t dstlen,
+		const char *src, size_t len)
+{
+#ifdef HAVE_ZSTD
+	size_t zret;
+#endif
+#ifdef HAVE_ZLIB
+	uLongf zlen;
+#endif
+	int ret;
+
+	switch (codec) {
+#ifdef HAVE_ZSTD
+	case NETCOMP_ZSTD:
+		zret = ZSTD_decompress(dst, dstlen, src, len);
+		return ZSTD_isError(zret) ? -1 : (long)zret;
+#endif
+#ifdef HAVE_LZ4
+	case NETCOMP_LZ4:
+		ret = LZ4_decompress_safe(src, dst, len, dstlen);
+		return ret >= 0 ? ret : -1;
+#endif
+#ifdef HAVE_ZLIB
+	case NETCOMP_ZLIB:
+		zlen = dstlen;
+		ret = uncompress((Bytef *)dst, &zlen, (const Bytef *)src, len);
+		return ret == Z_OK ? (long)zlen : -1;
+#endif
+	default:
+		ret = -1;
+	}
+	return ret;
+}
@@ -0,0 +1,50 @@
+#ifndef NETCOMP_DSCAO__
+#define NETCOMP_DSCAO__
+#include <stddef.h>
+
+#define NETCOMP_MAGIC	0x4e47435a	/* "NGCZ" */
+#define NETCOMP_BLOCK	(256*1024)	/* raw bytes per frame at most */
+#define NETCOMP_POOR	90	/* frame above this % of raw is poor */
+#define NETCOMP_PROBE	16	/* poor frames in a row turn it off */
+#define NETCOMP_RETRY	32	/* off: still try one block in this many */
+#define NETCOMP_FRAMES	8	/* receive frames queued for decompression */
+
+enum netcomp_codec {
+	NETCOMP_NONE, NETCOMP_ZSTD, NETCOMP_LZ4, NETCOMP_ZLIB
+};
+
+/*
+ * Wire compression, netplay -c / netfile -c. After connecting (and
+ * after the resume handshake, if any) the sender offers the codecs it
+ * was built with as a bit mask, 1 << codec, and the receiver answers
+ * with the single one it picked, or 0 for a plain stream. Compressed,
+ * the stream is a sequence of frames: a netcomp_frame header and len
+ * bytes holding rawlen bytes of data, compressed unless len == rawlen,
+ * and their CRC32C, checked after decompression.
+ * Every frame is compressed on its own, so they can be worked on in
+ * parallel. Which codecs exist depends on the libraries found at build
+ * time, HAVE_ZSTD, HAVE_LZ4 and HAVE_ZLIB. All fields are big endian.
+ */
+struct netcomp_hello {
+	unsigned int magic;
+	unsigned int codecs;
+} __attribute__((packed));
+
+struct netcomp_frame {
+	unsigned int rawlen;
+	unsigned int len;
+	unsigned int crc;	/* CRC32C of the rawlen bytes */
+} __attribute__((packed));
+
+unsigned int netcomp_supported(void);
+const char * netcomp_name(int codec);
+int netcomp_offer(int sock, int *codec);
+int netcomp_accept(int sock, int *codec);
+size_t netcomp_bound(int codec, size_t len);
+/* bytes written to dst, -1 if it does not fit or on error */
+long netcomp_compress(int codec, char *dst, size_t dstlen, const char *src,
+		size_t len);
+long netcomp_decompress(int codec, char *dst, size_t dstlen,
+		const char *src, size_t len);
+
+#endif  /* NETCOMP_DSCAO__ */
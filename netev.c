@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include "netev.h"
+
+static int exit_fd = -1;
+
+int netev_init(void)
+{
+	if (exit_fd != -1)
+		return 0;
+	exit_fd = netev_new();
+	return exit_fd == -1 ? -1 : 0;
+}
+
+int netev_exit_fd(void)
+{
+	return exit_fd;
+}
+
+/* never read, so it stays readable for every waiter */
+void netev_exit(volatile int *g_exit)
+{
+	int saved = errno;
+
+	*g_exit = 1;
+	if (exit_fd != -1)
+		netev_post(exit_fd);
+	errno = saved;
+}
+
+int netev_poll(struct pollfd *pfd, int nfds, int timeout)
+{
+	struct pollfd all[NETEV_MAXFDS + 1];
+	int i, sysret;
+
+	if (exit_fd == -1 || nfds > NETEV_MAXFDS)
+		return poll(pfd, nfds, timeout);
+	memcpy(all, pfd, nfds * sizeof(struct pollfd));
+	all[nfds].fd = exit_fd;
+	all[nfds].events = POLLIN;
+	sysret = poll(all, nfds + 1, timeout);
+	for (i = 0; i < nfds; i++)
+		pfd[i].revents = sysret > 0 ? all[i].revents : 0;
+	if (sysret > 0 && all[nfds].revents)
+		sysret--;
+	return sysret;
+}
+
+/* level triggered: every epoll set with it keeps waking after exit */
+int netev_epoll_add(int epfd, void *tag)
+{
+	struct epoll_event ev;
+
+	if (exit_fd == -1)
+		return 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = tag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, exit_fd, &ev) == -1) {
+		fprintf(stderr, "epoll_ctl exit event failed: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int netev_new(void)
+{
+	int efd;
+
+	efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (efd == -1)
+		fprintf(stderr, "Cannot create eventfd: %s\n", strerror(errno));
+	return efd;
+}
+
+void netev_post(int efd)
+{
+	uint64_t one = 1;
+	ssize_t sysret;
+
+	do
+		sysret = write(efd, &one, sizeof(one));
+	while (sysret == -1 && errno == EINTR);
+}
+
+long netev_wait(int efd)
+{
+	struct pollfd pfd;
+	uint64_t cnt;
+	ssize_t sysret;
+
+	pfd.fd = efd;
+	pfd.events = POLLIN;
+	for (;;) {
+		sysret = read(efd, &cnt, sizeof(cnt));
+		if (sysret == sizeof(cnt))
+			return cnt;
+		if (sysret == -1 && errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "eventfd read failed: %s\n",
+					strerror(errno));
+			return -1;
+		}
+		sysret = netev_poll(&pfd, 1, -1);
+		if (sysret == -1 && errno != EINTR) {
+			fprintf(stderr, "poll eventfd failed: %s\n",
+					strerror(errno));
+			return -1;
+		} else if (sysret == 0)
+			return 0;
+	}
+}
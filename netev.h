@@ -0,0 +1,31 @@
+#ifndef NETEV_DSCAO__
+#define NETEV_DSCAO__
+#include <poll.h>
+
+#define NETEV_MAXFDS	4	/* fds a netev_poll() caller may pass */
+
+/*
+ * Wakeups without timeouts. netev_init() creates the process' shutdown
+ * eventfd; netev_exit() sets the exit flag and makes that fd readable
+ * for good, and since it is async-signal-safe the signal handlers call
+ * it. Every wait goes through netev_poll(), or has the fd in its epoll
+ * set, so threads sleep until their own fds are ready or the process
+ * is going down, and a return with nothing ready means exit. Without
+ * netev_init() netev_poll() is plain poll().
+ *
+ * netev_new() makes a one-shot or counting eventfd for hand-offs
+ * between threads: netev_post() from one side, netev_wait() on the
+ * other.
+ */
+int netev_init(void);
+int netev_exit_fd(void);
+void netev_exit(volatile int *g_exit);
+int netev_poll(struct pollfd *pfd, int nfds, int timeout);
+int netev_epoll_add(int epfd, void *tag);
+
+int netev_new(void);
+void netev_post(int efd);
+/* the posted count, 0 on exit, -1 on error */
+long netev_wait(int efd);
+
+#endif  /* NETEV_DSCAO__ */
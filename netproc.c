@@ -2,15 +2,30 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <errno.h>
 #include <pthread.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
 #include "netproc.h"
+#include "cirbuf.h"
+#include "stats.h"
+#include "proto.h"
+#include "stripe.h"
+#include "netcomp.h"
+#include "lfring.h"
+#include "crc32c.h"
+#include "netev.h"
 
-static int prepare_net(const char *port)
+#define SPLICE_PIPESZ	(1024*1024)
+#define UDP_BATCH	64
+#define UDP_RCVBUF	(8*1024*1024)
+
+int prepare_net(const char *port, int socktype)
 {
 	struct addrinfo hints, *adrlst;
 	int sysret, retv = 0;
@@ -18,7 +33,7 @@ static int prepare_net(const char *port)
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_socktype = socktype;
 	hints.ai_flags = AI_PASSIVE|AI_NUMERICSERV;
 	sysret = getaddrinfo(NULL, port, &hints, &adrlst);
 	if (sysret != 0) {
@@ -27,7 +42,7 @@ static int prepare_net(const char *port)
 		retv = -10;
 		return retv;
 	}
-	sock = socket(AF_INET, SOCK_STREAM, 0);
+	sock = socket(AF_INET, socktype, 0);
 	if (sock == -1) {
 		fprintf(stderr, "socket failed: %s\n", strerror(errno));
 		retv = -11;
@@ -49,29 +64,793 @@ err_exit_10:
 	return retv;
 }
 
+static void signal_start(struct commarg *arg)
+{
+	netev_post(arg->start_fd);
+}
+
+static int pipe_enlarge(int pfd, int size)
+{
+	int cursize, sysret;
+
+	cursize = fcntl(pfd, F_GETPIPE_SZ);
+	if (cursize == -1 || cursize >= size)
+		return cursize;
+	sysret = fcntl(pfd, F_SETPIPE_SZ, size);
+	if (sysret == -1) {
+		fprintf(stderr, "Cannot enlarge pipe to %d bytes: %s\n",
+				size, strerror(errno));
+		return cursize;
+	}
+	return sysret;
+}
+
+/*
+ * Wait until the socket has data and the pipe has room. A ready fd is
+ * dropped from the poll set so that it does not spin the loop while we
+ * wait for the other one.
+ */
+static int splice_wait(int sock, int dstfd, volatile int *g_exit,
+		struct stats *st)
+{
+	struct pollfd pfd[2];
+	int sysret;
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = dstfd;
+	pfd[1].events = POLLOUT;
+	do {
+		sysret = netev_poll(pfd, 2, -1);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll splice failed: %s\n",
+					strerror(errno));
+			return -1;
+		}
+		stats_add(&st->wakeups, 1);
+		if (pfd[0].revents)
+			pfd[0].fd = -1;
+		if (pfd[1].revents)
+			pfd[1].fd = -1;
+		else if (pfd[0].fd == -1)
+			stats_add(&st->stalls, 1);
+	} while ((pfd[0].fd != -1 || pfd[1].fd != -1) && *g_exit == 0);
+	return 0;
+}
+
+/*
+ * Move data from the socket into the pipe inside the kernel.
+ * Returns 0 at EOF or exit, -1 on error and 1 if splice is not supported
+ * on this socket/pipe pair, in which case nothing has been transferred
+ * and the caller should fall back to the copy loop.
+ */
+static int splice_loop(int sock, struct commarg *arg, unsigned long *numpkts)
+{
+	ssize_t len;
+	struct timespec t0;
+	int chunk, first, flags;
+
+	chunk = pipe_enlarge(arg->dstfd, SPLICE_PIPESZ);
+	if (chunk <= 0)
+		chunk = 65536;
+	flags = fcntl(sock, F_GETFL);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags|O_NONBLOCK) == -1) {
+		fprintf(stderr, "Cannot set socket non-blocking: %s\n",
+				strerror(errno));
+		return 1;
+	}
+
+	first = 1;
+	do {
+		stats_now(&t0);
+		len = splice(sock, NULL, arg->dstfd, NULL, chunk,
+				SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		stats_add(&arg->st->calls, 1);
+		if (len > 0) {
+			stats_lat(arg->st, &t0);
+			*numpkts += len;
+			stats_add(&arg->st->bytes, len);
+			tcptune_sample(&arg->tune);
+			first = 0;
+			continue;
+		} else if (len == 0)
+			return 0;
+
+		if (errno == EINTR)
+			continue;
+		if (first && (errno == EINVAL || errno == ENOSYS))
+			return 1;
+		if (errno != EAGAIN) {
+			fprintf(stderr, "splice failed at %lu: %s\n",
+					*numpkts, strerror(errno));
+			return -1;
+		}
+		stats_add(&arg->st->eagain, 1);
+		if (splice_wait(sock, arg->dstfd, arg->g_exit, arg->st) == -1)
+			return -1;
+	} while (*arg->g_exit == 0);
+	return 0;
+}
+
+/*
+ * recv() first and poll only when there is nothing to take, so a busy
+ * stream costs one syscall per buffer. Returns the bytes received, 0
+ * at EOF, -1 if recv() failed, -2 on exit and -3 if poll() failed.
+ */
+static int sink_recv(int sock, char *data, int maxlen, struct stats *st)
+{
+	struct pollfd pfd;
+	int curlen, sysret;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	for (;;) {
+		curlen = recv(sock, data, maxlen, MSG_DONTWAIT);
+		stats_add(&st->calls, 1);
+		if (curlen >= 0 || (errno != EAGAIN && errno != EINTR))
+			return curlen;
+		if (errno == EINTR)
+			continue;
+		stats_add(&st->eagain, 1);
+		sysret = netev_poll(&pfd, 1, -1);
+		stats_add(&st->wakeups, 1);
+		if (sysret == 0)
+			return -2;
+		if (sysret == -1 && errno != EINTR) {
+			fprintf(stderr, "poll sock receive failed: %s\n",
+					strerror(errno));
+			return -3;
+		}
+	}
+}
+
+/*
+ * Receive straight into buffers handed out by arg->sink instead of
+ * writing to dstfd.
+ */
+static int sink_loop(int sock, struct commarg *arg, unsigned long *numpkts)
+{
+	struct netsink *sink = arg->sink;
+	struct stats *st = arg->st;
+	struct timespec t0;
+	void *item;
+	char *data;
+	int maxlen, curlen, started, retv;
+
+	retv = 0;
+	started = 0;
+	while (*arg->g_exit == 0) {
+		item = sink->get(sink, &data, &maxlen);
+		if (item == NULL)
+			break;
+		curlen = sink_recv(sock, data, maxlen, st);
+		if (curlen <= 0) {
+			sink->put(sink, item, 0);
+			if (curlen == -1)
+				fprintf(stderr, "recv failed at %lu: %s\n",
+						*numpkts, strerror(errno));
+			if (curlen == -1 || curlen == -3)
+				retv = -1;
+			break;
+		}
+		*numpkts += curlen;
+		stats_add(&st->bytes, curlen);
+		tcptune_sample(&arg->tune);
+		stats_now(&t0);
+		sink->put(sink, item, curlen);
+		stats_lat(st, &t0);
+		if (!started) {
+			signal_start(arg);
+			started = 1;
+		}
+	}
+	if (!started)
+		signal_start(arg);
+	return retv;
+}
+
+int net_deliver(struct commarg *arg, const char *buf, unsigned int len)
+{
+	struct netsink *sink = arg->sink;
+	ssize_t sysret;
+	void *item;
+	char *data;
+	int maxlen;
+
+	while (len > 0) {
+		if (sink) {
+			item = sink->get(sink, &data, &maxlen);
+			if (item == NULL)
+				return -1;
+			if ((unsigned int)maxlen > len)
+				maxlen = len;
+			memcpy(data, buf, maxlen);
+			sink->put(sink, item, maxlen);
+			sysret = maxlen;
+		} else {
+			sysret = write(arg->dstfd, buf, len);
+			if (sysret == -1) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "write pipe failed: %s\n",
+						strerror(errno));
+				return -1;
+			}
+		}
+		buf += sysret;
+		len -= sysret;
+	}
+	return 0;
+}
+
+long net_read(int sock, char *buf, unsigned int len, struct stats *st,
+		volatile int *g_exit, int abortfd, volatile int *stop)
+{
+	struct pollfd pfd[2];
+	ssize_t sysret;
+	unsigned int got = 0;
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = abortfd;	/* poll() skips it if -1 */
+	pfd[1].events = POLLIN;
+	while (got < len) {
+		sysret = recv(sock, buf + got, len - got, MSG_DONTWAIT);
+		stats_add(&st->calls, 1);
+		if (sysret > 0) {
+			got += sysret;
+			continue;
+		} else if (sysret == 0) {
+			if (got == 0)
+				return 0;
+			fprintf(stderr, "Connection closed inside a block\n");
+			return -1;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			fprintf(stderr, "recv failed: %s\n", strerror(errno));
+			return -1;
+		}
+		stats_add(&st->eagain, 1);
+		do
+			sysret = netev_poll(pfd, 2, -1);
+		while (sysret == 0 && *g_exit == 0 && (!stop || !*stop));
+		stats_add(&st->wakeups, 1);
+		if (sysret == -1 && errno != EINTR) {
+			fprintf(stderr, "poll sock receive failed: %s\n",
+					strerror(errno));
+			return -1;
+		}
+		if (*g_exit || (stop && *stop))
+			return -1;
+	}
+	return got;
+}
+
+struct comp_frame {
+	unsigned int rawlen, len, crc;
+	char buf[];
+};
+
+struct comp_ctx {
+	struct commarg *arg;
+	int codec;
+	struct lfring *full, *empty;	/* frames to and back from worker */
+	int err;
+	unsigned long rawbytes;
+};
+
+/* decompress frames off cc->full in order and pass the data on */
+static void * comp_worker(void *dat)
+{
+	struct comp_ctx *cc = (struct comp_ctx *)dat;
+	struct stats *st = cc->arg->cst;
+	struct comp_frame *fr;
+	struct timespec t0;
+	const char *data;
+	char *out;
+	long numb;
+
+	out = malloc(NETCOMP_BLOCK);
+	if (!out) {
+		fprintf(stderr, "Out of Memory.\n");
+		__atomic_store_n(&cc->err, 1, __ATOMIC_RELAXED);
+	}
+	while ((fr = (struct comp_frame *)lfring_consume(cc->full)) != NULL) {
+		if (__atomic_load_n(&cc->err, __ATOMIC_RELAXED) == 0) {
+			stats_now(&t0);
+			if (fr->len == fr->rawlen) {
+				data = fr->buf;
+				numb = fr->len;
+			} else {
+				data = out;
+				numb = netcomp_decompress(cc->codec, out,
+						NETCOMP_BLOCK, fr->buf, fr->len);
+			}
+			stats_lat(st, &t0);
+			stats_add(&st->calls, 1);
+			if (numb != fr->rawlen ||
+					crc32c(0, data, numb) != fr->crc) {
+				fprintf(stderr, "Corrupt frame after %lu " \
+						"bytes\n", cc->rawbytes);
+				cc->arg->corrupt = 1;
+				__atomic_store_n(&cc->err, 1, __ATOMIC_RELAXED);
+			} else if (net_deliver(cc->arg, data, numb) == -1)
+				__atomic_store_n(&cc->err, 1, __ATOMIC_RELAXED);
+			else {
+				cc->rawbytes += numb;
+				stats_add(&st->bytes, numb);
+			}
+		}
+		lfring_insert(cc->empty, (const struct record *)fr);
+	}
+	free(out);
+	return NULL;
+}
+
+/*
+ * Compressed stream, see netcomp.h: this thread receives whole frames
+ * and a worker decompresses them, NETCOMP_FRAMES frames circulate
+ * between the two through a pair of lfrings.
+ */
+static int comp_loop(int sock, struct commarg *arg, int codec,
+		unsigned long *numpkts)
+{
+	struct comp_frame *frames[NETCOMP_FRAMES], *fr;
+	struct netcomp_frame hdr;
+	struct comp_ctx cc;
+	pthread_t thid;
+	size_t bound;
+	int i, sysret, retv = 0;
+
+	memset(&cc, 0, sizeof(cc));
+	memset(frames, 0, sizeof(frames));
+	cc.arg = arg;
+	cc.codec = codec;
+	if (arg->cst == NULL)
+		arg->cst = stats_new("dcomp");
+	cc.full = lfring_init();
+	cc.empty = lfring_init();
+	if (!arg->cst || !cc.full || !cc.empty) {
+		retv = -1;
+		goto exit_10;
+	}
+	bound = netcomp_bound(codec, NETCOMP_BLOCK);
+	for (i = 0; i < NETCOMP_FRAMES; i++) {
+		frames[i] = malloc(sizeof(struct comp_frame) + bound);
+		if (!frames[i]) {
+			fprintf(stderr, "Out of Memory.\n");
+			retv = -1;
+			goto exit_10;
+		}
+		lfring_insert(cc.empty, (const struct record *)frames[i]);
+	}
+	if (pthread_create(&thid, NULL, comp_worker, &cc)) {
+		fprintf(stderr, "Cannot create decompression thread: %s\n",
+				strerror(errno));
+		retv = -1;
+		goto exit_10;
+	}
+
+	signal_start(arg);
+	while (*arg->g_exit == 0 &&
+			__atomic_load_n(&cc.err, __ATOMIC_RELAXED) == 0) {
+		sysret = net_read(sock, (char *)&hdr, sizeof(hdr), arg->st,
+				arg->g_exit, -1, NULL);
+		if (sysret <= 0) {
+			retv = sysret;
+			break;
+		}
+		fr = (struct comp_frame *)lfring_consume(cc.empty);
+		fr->rawlen = be32toh(hdr.rawlen);
+		fr->len = be32toh(hdr.len);
+		fr->crc = be32toh(hdr.crc);
+		if (fr->rawlen == 0 || fr->rawlen > NETCOMP_BLOCK ||
+				fr->len == 0 || fr->len > fr->rawlen) {
+			fprintf(stderr, "Bad frame, %u bytes of %u\n",
+					fr->len, fr->rawlen);
+			retv = -1;
+			break;
+		}
+		if (net_read(sock, fr->buf, fr->len, arg->st, arg->g_exit,
+					-1, NULL) != fr->len) {
+			retv = -1;
+			break;
+		}
+		*numpkts += sizeof(hdr) + fr->len;
+		stats_add(&arg->st->bytes, sizeof(hdr) + fr->len);
+		tcptune_sample(&arg->tune);
+		lfring_insert(cc.full, (const struct record *)fr);
+	}
+	lfring_insert(cc.full, NULL);
+	pthread_join(thid, NULL);
+	printf("Decompressed %lu bytes into %lu with %s\n", *numpkts,
+			cc.rawbytes, netcomp_name(codec));
+	if (cc.err)
+		retv = -1;
+
+exit_10:
+	for (i = 0; i < NETCOMP_FRAMES; i++)
+		free(frames[i]);
+	lfring_exit(cc.full);
+	lfring_exit(cc.empty);
+	return retv;
+}
+
+/*
+ * Checked stream, see proto.h. Every block is received straight into
+ * the sink's buffers, or into buf for dstfd, and its CRC32C taken there
+ * while the data is still in cache. Written to dstfd only once it
+ * checks out; a sink has it already, but arg->corrupt tells.
+ */
+static int check_loop(int sock, struct commarg *arg, unsigned long *numpkts)
+{
+	struct netsink *sink = arg->sink;
+	struct proto_block hdr;
+	unsigned long nblk, bytes;
+	unsigned int len, crc, sent;
+	char *buf, *data;
+	void *item = NULL;
+	int maxlen, numb, retv = 0;
+
+	buf = NULL;
+	if (!sink) {
+		buf = malloc(PROTO_BLOCK);
+		if (!buf) {
+			fprintf(stderr, "Out of Memory.\n");
+			signal_start(arg);
+			return -1;
+		}
+	}
+	signal_start(arg);
+	nblk = bytes = 0;
+	while (*arg->g_exit == 0) {
+		numb = net_read(sock, (char *)&hdr, sizeof(hdr), arg->st,
+				arg->g_exit, -1, NULL);
+		if (numb <= 0) {
+			if (numb == 0)
+				fprintf(stderr, "Stream ended after %lu bytes " \
+						"without its end block\n",
+						bytes);
+			retv = -1;
+			break;
+		}
+		*numpkts += sizeof(hdr);
+		len = be32toh(hdr.len);
+		sent = be32toh(hdr.crc);
+		if (be32toh(hdr.magic) != PROTO_BLOCK_MAGIC ||
+				len > PROTO_BLOCK) {
+			fprintf(stderr, "Bad block header after %lu bytes, " \
+					"-k on both sides?\n", bytes);
+			retv = -1;
+			break;
+		}
+		if (len == 0)
+			break;
+		crc = 0;
+		for (data = buf; len > 0; len -= numb) {
+			maxlen = len;
+			if (sink) {
+				item = sink->get(sink, &data, &maxlen);
+				if (item == NULL)
+					break;
+				if ((unsigned int)maxlen > len)
+					maxlen = len;
+			}
+			numb = net_read(sock, data, maxlen, arg->st,
+					arg->g_exit, -1, NULL);
+			if (numb != maxlen) {
+				if (numb == 0)
+					fprintf(stderr, "Connection closed " \
+							"inside a block\n");
+				break;
+			}
+			crc = crc32c(crc, data, numb);
+			*numpkts += numb;
+			stats_add(&arg->st->bytes, numb);
+			tcptune_sample(&arg->tune);
+			if (sink) {
+				sink->put(sink, item, numb);
+				item = NULL;
+			}
+		}
+		if (item)
+			sink->put(sink, item, 0);
+		if (len > 0) {
+			retv = -1;
+			break;
+		}
+		len = be32toh(hdr.len);
+		if (crc != sent) {
+			fprintf(stderr, "CRC32C mismatch in block %lu at offset " \
+					"%lu: %08x, sent %08x\n", nblk, bytes,
+					crc, sent);
+			retv = -1;
+			break;
+		}
+		if (!sink && net_deliver(arg, buf, len) == -1) {
+			retv = -1;
+			break;
+		}
+		bytes += len;
+		nblk++;
+	}
+	if (retv == -1 && *arg->g_exit == 0)
+		arg->corrupt = 1;
+	else if (retv == 0 && *arg->g_exit == 0)
+		printf("Verified %lu blocks, %lu bytes, with CRC32C (%s)\n",
+				nblk, bytes, crc32c_engine());
+	free(buf);
+	return retv;
+}
+
+/*
+ * Offer arg->offset to the sender and take the offset it agrees to,
+ * which is either the same or 0.
+ */
+static int resume_handshake(int sock, struct commarg *arg)
+{
+	off_t offset;
+
+	if (proto_send_resume(sock, arg->offset, arg->tail_len,
+				arg->tail_crc) == -1 ||
+			proto_recv_start(sock, &offset) == -1)
+		return -1;
+	if (offset != 0 && offset != arg->offset) {
+		fprintf(stderr, "handshake: sender starts at %lld, " \
+				"we offered %lld\n", (long long)offset,
+				(long long)arg->offset);
+		return -1;
+	}
+	arg->offset = offset;
+	return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t sysret;
+
+	while (cnt > 0) {
+		sysret = writev(fd, iov, cnt);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt > 0 && (size_t)sysret >= iov->iov_len) {
+			sysret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + sysret;
+			iov->iov_len -= sysret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Datagram transport: receive up to UDP_BATCH datagrams per recvmmsg()
+ * straight into record slots, either the sink's or our own, and pass
+ * them on as one writev() to dstfd. A zero length datagram marks the
+ * end of the stream.
+ */
+static int dgram_loop(int sock, struct commarg *arg, unsigned long *numpkts)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	void *items[UDP_BATCH];
+	struct record *recs = NULL;
+	struct stats *st = arg->st;
+	struct timespec t0;
+	struct pollfd pfd;
+	char *data;
+	int i, n, nmsg, maxlen, sysret, started, eos, retv;
+
+	sysret = UDP_RCVBUF;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sysret,
+				sizeof(sysret)) == -1)
+		fprintf(stderr, "Cannot set receive buffer: %s\n",
+				strerror(errno));
+	if (!arg->sink) {
+		recs = malloc(UDP_BATCH * sizeof(struct record));
+		if (!recs) {
+			fprintf(stderr, "Out of Memory.\n");
+			signal_start(arg);
+			return -1;
+		}
+	}
+
+	retv = 0;
+	started = 0;
+	eos = 0;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while (!eos && *arg->g_exit == 0) {
+		for (i = 0; i < UDP_BATCH; i++) {
+			if (arg->sink) {
+				items[i] = arg->sink->get(arg->sink, &data,
+						&maxlen);
+				if (items[i] == NULL)
+					break;
+			} else {
+				data = recs[i].buf;
+				maxlen = sizeof(recs[i].buf);
+			}
+			iov[i].iov_base = data;
+			iov[i].iov_len = maxlen;
+			memset(&msgs[i], 0, sizeof(struct mmsghdr));
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		nmsg = i;
+		if (nmsg == 0)
+			break;
+
+		do
+			sysret = netev_poll(&pfd, 1, -1);
+		while (sysret == 0 && *arg->g_exit == 0);
+		n = 0;
+		stats_add(&st->wakeups, 1);
+		if (sysret > 0) {
+			n = recvmmsg(sock, msgs, nmsg, MSG_WAITFORONE, NULL);
+			stats_add(&st->calls, 1);
+			if (n == -1) {
+				if (errno == EAGAIN)
+					stats_add(&st->eagain, 1);
+				if (errno != EINTR && errno != EAGAIN) {
+					fprintf(stderr, "recvmmsg failed at " \
+							"%lu: %s\n", *numpkts,
+							strerror(errno));
+					retv = -1;
+				}
+				n = 0;
+			}
+		} else if (sysret == -1 && errno != EINTR) {
+			fprintf(stderr, "poll sock receive failed: %s\n",
+					strerror(errno));
+			retv = -1;
+		}
+
+		for (i = 0; i < n && !eos; i++) {
+			iov[i].iov_len = msgs[i].msg_len;
+			*numpkts += msgs[i].msg_len;
+			stats_add(&st->bytes, msgs[i].msg_len);
+			if (msgs[i].msg_len == 0)
+				eos = 1;
+		}
+		n = i;
+		stats_now(&t0);
+		if (arg->sink) {
+			for (i = 0; i < nmsg; i++)
+				arg->sink->put(arg->sink, items[i],
+						i < n ? iov[i].iov_len : 0);
+		} else if (n > 0 && writev_all(arg->dstfd, iov, n) == -1) {
+			fprintf(stderr, "write pipe failed at %lu: %s\n",
+					*numpkts, strerror(errno));
+			retv = -1;
+		}
+		if (n > 0)
+			stats_lat(st, &t0);
+		if (n > 0 && !started) {
+			signal_start(arg);
+			started = 1;
+		}
+		if (retv)
+			break;
+	}
+	if (!started)
+		signal_start(arg);
+	free(recs);
+	return retv;
+}
+
+/*
+ * Serve one connection after another into arg->sink until exit.
+ */
+static void persist_loop(int lsock, struct commarg *arg)
+{
+	struct netsink *sink = arg->sink;
+	struct pollfd pfd;
+	unsigned long numpkts;
+	int sock, sysret, codec;
+
+	signal_start(arg);
+	pfd.fd = lsock;
+	pfd.events = POLLIN;
+	while (*arg->g_exit == 0) {
+		sysret = netev_poll(&pfd, 1, -1);
+		if (sysret == 0)
+			continue;
+		else if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll accept failed: %s\n",
+					strerror(errno));
+			break;
+		}
+		sock = accept(lsock, NULL, NULL);
+		if (sock == -1) {
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+			continue;
+		}
+		if (sink->begin && sink->begin(sink) != 0) {
+			close(sock);
+			break;
+		}
+		numpkts = 0;
+		tcptune_init(&arg->tune, sock, TCPTUNE_RECV, arg->st);
+		codec = NETCOMP_NONE;
+		if (!arg->compress || netcomp_accept(sock, &codec) == 0) {
+			if (codec != NETCOMP_NONE)
+				comp_loop(sock, arg, codec, &numpkts);
+			else if (arg->check)
+				check_loop(sock, arg, &numpkts);
+			else
+				sink_loop(sock, arg, &numpkts);
+		}
+		sink->eos(sink);
+		printf("Total number of bytes received: %lu\n", numpkts);
+		close(sock);
+	}
+}
+
 void net_processing(struct commarg *arg)
 {
-	int lsock, sock, sysret;
+	int lsock, sock = -1, sysret, codec;
 	unsigned long numpkts;
-	char *buf;
+	char *buf = NULL;
 	int curlen, maxlen, err;
 	struct pollfd pfd, pfd1;
+	struct timespec t0;
 
-	lsock = prepare_net(arg->port);
+	if (arg->socktype == 0)
+		arg->socktype = SOCK_STREAM;
+	if (arg->st == NULL)
+		arg->st = stats_new("net");
+	if (arg->st == NULL) {
+		signal_start(arg);
+		goto exit_5;
+	}
+	lsock = prepare_net(arg->port, arg->socktype);
 	if (lsock < 0) {
 		fprintf(stderr, "Cannot initialize socket for receiving\n");
-		return;
+		signal_start(arg);
+		goto exit_5;
 	}
-	sysret = listen(lsock, 5);
+	if (arg->socktype == SOCK_DGRAM) {
+		numpkts = 0;
+		dgram_loop(lsock, arg, &numpkts);
+		printf("Total number of bytes received: %lu\n", numpkts);
+		goto exit_15;
+	}
+	sysret = listen(lsock, arg->stripe ? STRIPE_MAXCONN : 5);
 	if (sysret == -1) {
 		fprintf(stderr, "Cannot listen to the socket: %s\n",
 				strerror(errno));
 		goto exit_10;
 	}
+	if (arg->persist && arg->sink) {
+		persist_loop(lsock, arg);
+		goto exit_10;
+	}
+	if (arg->stripe) {
+		signal_start(arg);
+		numpkts = 0;
+		if (stripe_receive(lsock, arg, &numpkts) == -1 &&
+				*arg->g_exit == 0)
+			arg->corrupt = 1;
+		printf("Total number of bytes received: %lu\n", numpkts);
+		goto exit_15;
+	}
 	pfd.fd = lsock;
 	pfd.events = POLLIN;
 	do {
-		sysret = poll(&pfd, 1, 500);
+		sysret = netev_poll(&pfd, 1, -1);
 		if (sysret == 0)
 			continue;
 		else if (sysret == -1) {
@@ -82,21 +861,46 @@ void net_processing(struct commarg *arg)
 		sock = accept(lsock, NULL, NULL);
 	} while (sysret == 0 && *arg->g_exit == 0);
 	if (*arg->g_exit != 0 || sock == -1 || sysret == -1) {
-		if (sock == -1)
+		if (sock == -1 && sysret > 0)
 			fprintf(stderr, "accept failed: %s\n", strerror(errno));
-		pthread_mutex_lock(arg->mutex);
-		*arg->start = 1;
-		pthread_cond_signal(arg->cond);
-		pthread_mutex_unlock(arg->mutex);
+		signal_start(arg);
 		goto exit_15;
 	}
+	if (arg->resume && resume_handshake(sock, arg) == -1) {
+		arg->offset = -1;
+		signal_start(arg);
+		goto exit_20;
+	}
+
+	numpkts = 0;
+	tcptune_init(&arg->tune, sock, TCPTUNE_RECV, arg->st);
+	if (arg->compress) {
+		if (netcomp_accept(sock, &codec) == -1) {
+			signal_start(arg);
+			goto exit_20;
+		}
+		if (codec != NETCOMP_NONE) {
+			comp_loop(sock, arg, codec, &numpkts);
+			goto exit_30;
+		}
+	}
+	if (arg->check) {
+		check_loop(sock, arg, &numpkts);
+		goto exit_30;
+	}
+	if (arg->sink) {
+		sink_loop(sock, arg, &numpkts);
+		goto exit_30;
+	}
 
 	pfd.fd = sock;
 	pfd.events = POLLIN;
 	maxlen = 4096;
 	buf = malloc(maxlen);
+	/* stays -1 if exit or a poll error comes before any data */
+	curlen = -1;
 	do {
-		sysret = poll(&pfd, 1, 500);
+		sysret = netev_poll(&pfd, 1, -1);
 		if (sysret == 0)
 			continue;
 		else if (sysret == -1) {
@@ -107,41 +911,46 @@ void net_processing(struct commarg *arg)
 		curlen = recv(sock, buf, maxlen, 0);
 	} while (sysret == 0 && *arg->g_exit == 0);
 	if (curlen == -1 || *arg->g_exit != 0) {
-		if (curlen == -1)
+		if (curlen == -1 && sysret > 0)
 			fprintf(stderr, "recv failed at begining: %s\n",
 					strerror(errno));
-		pthread_mutex_lock(arg->mutex);
-		*arg->start = 1;
-		pthread_cond_signal(arg->cond);
-		pthread_mutex_unlock(arg->mutex);
+		signal_start(arg);
 		goto exit_20;
 	}
 	numpkts = curlen;
+	stats_add(&arg->st->bytes, curlen);
 	sysret = write(arg->dstfd, buf, curlen);
-	pthread_mutex_lock(arg->mutex);
-	*arg->start = 1;
-	pthread_cond_signal(arg->cond);
-	pthread_mutex_unlock(arg->mutex);
+	signal_start(arg);
 	if (sysret == -1) {
 		fprintf(stderr, "pipe write failed at start: %s\n",
 				strerror(errno));
 		goto exit_20;
 	}
 
+	if (arg->splice) {
+		sysret = splice_loop(sock, arg, &numpkts);
+		if (sysret <= 0)
+			goto exit_30;
+		fprintf(stderr, "splice not supported, falling back to copy\n");
+	}
+
 	err = 0;
 	pfd1.fd = arg->dstfd;
 	pfd1.events = POLLOUT;
 	do {
 		curlen = recv(sock, buf, maxlen, MSG_DONTWAIT);
+		stats_add(&arg->st->calls, 1);
 		if (curlen == -1) {
 			if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				fprintf(stderr, "recv failed at %lu: %s\n",
 						numpkts, strerror(errno));
 				break;
 			}
+			stats_add(&arg->st->eagain, 1);
 			do
-				sysret = poll(&pfd, 1, 500);
+				sysret = netev_poll(&pfd, 1, -1);
 			while (sysret == 0 && *arg->g_exit == 0);
+			stats_add(&arg->st->wakeups, 1);
 			if (sysret == -1) {
 				err = 1;
 				fprintf(stderr, "poll sock receive failed: %s\n",
@@ -153,8 +962,11 @@ void net_processing(struct commarg *arg)
 			break;
 
 		numpkts += curlen;
+		stats_add(&arg->st->bytes, curlen);
+		tcptune_sample(&arg->tune);
+		stats_now(&t0);
 		do {
-			sysret = poll(&pfd1, 1, 500);
+			sysret = netev_poll(&pfd1, 1, -1);
 			if (sysret == 0)
 				continue;
 			else if (sysret == -1) {
@@ -172,15 +984,23 @@ void net_processing(struct commarg *arg)
 				goto exit_30;
 			}
 			curlen -= sysret;
+			if (curlen > 0)
+				stats_add(&arg->st->stalls, 1);
 		} while(curlen > 0 && *arg->g_exit == 0);
+		stats_lat(arg->st, &t0);
 	} while (*arg->g_exit == 0 && err == 0);
 
 exit_30:
 	printf("Total number of bytes received: %lu\n", numpkts);
 exit_20:
+	free(buf);
 	close(sock);
 exit_15:
-	close(arg->dstfd);
+	if (arg->dstfd >= 0)
+		close(arg->dstfd);
 exit_10:
 	close(lsock);
+exit_5:
+	if (arg->sink)
+		arg->sink->eos(arg->sink);
 }
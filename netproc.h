@@ -1,15 +1,60 @@
 #ifndef UDP_PROC_DSCAO__
 #define UDP_PROC_DSCAO__
+#include <sys/types.h>
+#include "tcptune.h"
+
+/*
+ * Alternative to dstfd: the receiver asks the sink for an empty buffer,
+ * receives into it and hands it back with the number of bytes filled.
+ * A length of 0 returns the buffer unused. eos is called once when the
+ * receiver is done. With commarg.persist every connection is a stream
+ * of its own: begin, if set, is called before receiving from it, a
+ * non-zero return stops the receiver, and eos after it closes.
+ */
+struct netsink {
+	void * (*get)(struct netsink *sink, char **data, int *maxlen);
+	void (*put)(struct netsink *sink, void *item, int len);
+	void (*eos)(struct netsink *sink);
+	int (*begin)(struct netsink *sink);
+};
 
 struct commarg {
 	int dstfd;
-	volatile int *start;
-	volatile int *g_exit;
-	pthread_mutex_t *mutex;
-	pthread_cond_t *cond;
+	int start_fd;		/* eventfd, posted once data flows or it failed */
+	volatile int *g_exit;	/* set with netev_exit(), see netev.h */
 	const char *port;
+	int splice;		/* move socket data into dstfd with splice() */
+	struct netsink *sink;	/* if set, used instead of dstfd */
+	int socktype;		/* SOCK_STREAM (default) or SOCK_DGRAM */
+	int persist;		/* TCP sink: keep accepting connections */
+	struct stats *st;	/* receive stage counters, set up if NULL */
+	int resume;		/* offset handshake first, see proto.h */
+	off_t offset;		/* resume: in, bytes we have; out, start,
+				   -1 if the handshake failed */
+	unsigned int tail_len;	/* resume: CRC32C of the tail_len bytes */
+	unsigned int tail_crc;	/* before offset */
+	struct tcptune tune;	/* TCP receive buffer, per connection */
+	int stripe;		/* striped transfer, see stripe.h */
+	int stripe_fd;		/* stripe: if > 0 pwrite() blocks here */
+	int compress;		/* take compressed streams, see netcomp.h */
+	struct stats *cst;	/* decompression counters, set up if NULL */
+	int check;		/* CRC32C checked blocks, see proto.h */
+	int corrupt;		/* out: a block failed its check, or a
+				   striped transfer came short */
 };
 
+int prepare_net(const char *port, int socktype);
 void net_processing(struct commarg *arg);
 
+/* hand len bytes to arg->sink or write them all to arg->dstfd */
+int net_deliver(struct commarg *arg, const char *buf, unsigned int len);
+
+/*
+ * Fill buf from sock, waiting for it with netev_poll(). Returns len, 0
+ * on EOF before the first byte and -1 on error, EOF in the middle, exit
+ * or, if given, abortfd readable with *stop set.
+ */
+long net_read(int sock, char *buf, unsigned int len, struct stats *st,
+		volatile int *g_exit, int abortfd, volatile int *stop);
+
 #endif  /* UDP_PROC_DSCAO__ */
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "netrange.h"
+#include "proto.h"
+#include "netev.h"
+
+static int range_send(int sock, off_t offset, unsigned int len)
+{
+	struct proto_range msg;
+
+	msg.magic = htobe32(PROTO_RANGE_MAGIC);
+	msg.len = htobe32(len);
+	msg.offset = htobe64(offset);
+	return proto_write(sock, &msg, sizeof(msg));
+}
+
+static int range_recv(int sock, off_t *offset, unsigned int *len)
+{
+	struct proto_range msg;
+
+	if (proto_read(sock, &msg, sizeof(msg)) == -1)
+		return -1;
+	if (be32toh(msg.magic) != PROTO_RANGE_MAGIC) {
+		fprintf(stderr, "range: bad magic %#x, -A on both sides?\n",
+				be32toh(msg.magic));
+		return -1;
+	}
+	*offset = be64toh(msg.offset);
+	*len = be32toh(msg.len);
+	if (*offset < 0) {
+		fprintf(stderr, "range: bad offset\n");
+		return -1;
+	}
+	return 0;
+}
+
+int range_serve(int sock, int fd, struct stats *st, unsigned long *numpkts)
+{
+	struct stat mst;
+	struct pollfd pfd;
+	off_t size, offset, pos;
+	unsigned int len;
+	ssize_t sysret;
+
+	if (fstat(fd, &mst) == -1) {
+		fprintf(stderr, "Cannot stat the file: %s\n", strerror(errno));
+		return -1;
+	}
+	size = mst.st_size;
+	if (range_send(sock, size, 0) == -1)
+		return -1;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	for (;;) {
+		/* a paused viewer may take any time to ask again */
+		sysret = netev_poll(&pfd, 1, -1);
+		if (sysret == -1 && errno == EINTR)
+			continue;
+		if (sysret == -1) {
+			fprintf(stderr, "poll request failed: %s\n",
+					strerror(errno));
+			return -1;
+		} else if (sysret == 0)
+			return -1;
+		stats_add(&st->wakeups, 1);
+		if (range_recv(sock, &offset, &len) == -1)
+			return -1;
+		if (len == 0)
+			return 0;
+		if (offset >= size)
+			len = 0;
+		else if (len > size - offset)
+			len = size - offset;
+		if (range_send(sock, offset, len) == -1)
+			return -1;
+		for (pos = offset; pos < offset + len; ) {
+			stats_add(&st->calls, 1);
+			sysret = sendfile(sock, fd, &pos, offset + len - pos);
+			if (sysret == -1 && errno == EINTR)
+				continue;
+			if (sysret <= 0) {
+				fprintf(stderr, "sendfile range failed: %s\n",
+						sysret ? strerror(errno) :
+						"file shrank");
+				return -1;
+			}
+			stats_add(&st->bytes, sysret);
+			*numpkts += sysret;
+		}
+	}
+}
+
+int range_open(struct rangecli *rc, int sock, struct stats *st)
+{
+	unsigned int len;
+	int i;
+
+	memset(rc, 0, sizeof(*rc));
+	rc->sock = sock;
+	rc->st = st;
+	if (st == NULL || range_recv(sock, &rc->size, &len) == -1)
+		return -1;
+	for (i = 0; i < RANGE_SLOTS; i++) {
+		rc->slots[i].blk = -1;
+		rc->slots[i].data = malloc(RANGE_BLOCK);
+		if (rc->slots[i].data == NULL) {
+			fprintf(stderr, "Out of Memory.\n");
+			range_close(rc);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static struct rangeblk * range_lookup(struct rangecli *rc, off_t blk)
+{
+	int i;
+
+	for (i = 0; i < RANGE_SLOTS; i++)
+		if (rc->slots[i].blk == blk)
+			return rc->slots + i;
+	return NULL;
+}
+
+static struct rangeblk * range_victim(struct rangecli *rc)
+{
+	struct rangeblk *sl = rc->slots;
+	int i;
+
+	for (i = 1; i < RANGE_SLOTS && sl->blk != -1; i++)
+		if (rc->slots[i].blk == -1 || rc->slots[i].used < sl->used)
+			sl = rc->slots + i;
+	return sl;
+}
+
+/* bring in blk, and the blocks after it if we are reading on */
+static struct rangeblk * range_fetch(struct rangecli *rc, off_t blk)
+{
+	struct rangeblk *sl, *first = NULL;
+	off_t nblk, offset, roff;
+	unsigned int n, len, rlen;
+
+	nblk = (rc->size + RANGE_BLOCK - 1) / RANGE_BLOCK;
+	n = 1;
+	if (blk == rc->next)
+		while (n < RANGE_AHEAD && blk + n < nblk &&
+				range_lookup(rc, blk + n) == NULL)
+			n++;
+	offset = blk * RANGE_BLOCK;
+	len = n * RANGE_BLOCK;
+	if (len > rc->size - offset)
+		len = rc->size - offset;
+	stats_add(&rc->st->stalls, 1);
+	if (range_send(rc->sock, offset, len) == -1 ||
+			range_recv(rc->sock, &roff, &rlen) == -1)
+		return NULL;
+	if (roff != offset || rlen != len) {
+		fprintf(stderr, "range: asked %u at %lld, got %u at %lld\n",
+				len, (long long)offset, rlen,
+				(long long)roff);
+		return NULL;
+	}
+	for (; len > 0; blk++) {
+		sl = range_victim(rc);
+		sl->blk = -1;
+		sl->len = len < RANGE_BLOCK ? len : RANGE_BLOCK;
+		if (proto_read(rc->sock, sl->data, sl->len) == -1)
+			return NULL;
+		sl->blk = blk;
+		sl->used = ++rc->tick;
+		stats_add(&rc->st->bytes, sl->len);
+		len -= sl->len;
+		if (first == NULL)
+			first = sl;
+	}
+	rc->next = blk;
+	return first;
+}
+
+long range_read(struct rangecli *rc, off_t offset, char *buf, size_t len)
+{
+	struct rangeblk *sl;
+	off_t blk;
+	size_t off, numb;
+	long total = 0;
+
+	stats_add(&rc->st->calls, 1);
+	while (len > 0 && offset < rc->size) {
+		blk = offset / RANGE_BLOCK;
+		sl = range_lookup(rc, blk);
+		if (sl == NULL)
+			sl = range_fetch(rc, blk);
+		if (sl == NULL)
+			return -1;
+		sl->used = ++rc->tick;
+		off = offset - blk * RANGE_BLOCK;
+		numb = sl->len - off;
+		if (numb > len)
+			numb = len;
+		memcpy(buf, sl->data + off, numb);
+		buf += numb;
+		offset += numb;
+		len -= numb;
+		total += numb;
+	}
+	return total;
+}
+
+void range_close(struct rangecli *rc)
+{
+	int i;
+
+	if (rc->sock != -1)
+		range_send(rc->sock, 0, 0);
+	for (i = 0; i < RANGE_SLOTS; i++) {
+		free(rc->slots[i].data);
+		rc->slots[i].data = NULL;
+	}
+}
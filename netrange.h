@@ -0,0 +1,45 @@
+#ifndef NETRANGE_DSCAO__
+#define NETRANGE_DSCAO__
+#include <sys/types.h>
+#include "stats.h"
+
+#define RANGE_BLOCK	(256*1024)	/* cache unit, and request granularity */
+#define RANGE_SLOTS	32		/* blocks cached, 8 MiB */
+#define RANGE_AHEAD	4		/* blocks fetched at once reading on */
+
+/*
+ * Random access to a file on the other end of a connection: instead of
+ * the sender streaming it from offset 0, the receiver asks for the
+ * ranges it needs (see proto_range), so a player can seek and a demuxer
+ * read an index at the end of the file without transferring the rest.
+ *
+ * The receiver keeps the last RANGE_SLOTS blocks it fetched, replacing
+ * the least recently used. A miss right after the previous fetch is
+ * taken as reading on and gets RANGE_AHEAD blocks in one request, any
+ * other, an index lookup or a seek, just the one block.
+ */
+struct rangeblk {
+	off_t blk;		/* block number, -1: empty */
+	unsigned long used;	/* LRU tick */
+	unsigned int len;
+	char *data;
+};
+
+struct rangecli {
+	int sock;
+	off_t size;
+	off_t next;		/* block after the last fetched */
+	unsigned long tick;
+	struct stats *st;	/* bytes fetched, calls, stalls: misses */
+	struct rangeblk slots[RANGE_SLOTS];
+};
+
+/* sender: tell the size of fd and serve requests until the last one */
+int range_serve(int sock, int fd, struct stats *st, unsigned long *numpkts);
+
+/* receiver: take the size, then read; 0 at end of file, -1 on error */
+int range_open(struct rangecli *rc, int sock, struct stats *st);
+long range_read(struct rangecli *rc, off_t offset, char *buf, size_t len);
+void range_close(struct rangecli *rc);
+
+#endif  /* NETRANGE_DSCAO__ */
@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "netproc.h"
+#include "netsrv.h"
+#include "stats.h"
+#include "tcptune.h"
+#include "netev.h"
+
+#define SRV_MAXEVENTS	64
+#define SRV_BUFLEN	65536
+#define SRV_PIPESZ	(1024*1024)
+#define SRV_BUDGET	(4*1024*1024)	/* bytes per session per wakeup */
+
+struct session {
+	struct session *prev, *next;
+	int sock, outfd;
+	int pfd[2];
+	unsigned long numbytes;
+	struct tcptune tune;
+	char peer[INET_ADDRSTRLEN + 8];
+	char fname[256];
+};
+
+struct srvthread {
+	pthread_t thid;
+	int epfd, lsock;
+	struct srvarg *arg;
+	struct session *sessions;
+	char *buf;
+	struct stats *st;
+};
+
+static unsigned long session_seq;
+
+static int expand_name(char *out, int len, const char *tmpl,
+		const char *addr, int port, unsigned long seq)
+{
+	char name[256], num[24];
+	const char *sub;
+	time_t now;
+	struct tm tm;
+	int pos, n;
+
+	pos = 0;
+	while (*tmpl && pos < (int)sizeof(name) - 1) {
+		sub = NULL;
+		if (strncmp(tmpl, "{addr}", 6) == 0) {
+			sub = addr;
+			tmpl += 6;
+		} else if (strncmp(tmpl, "{port}", 6) == 0) {
+			snprintf(num, sizeof(num), "%d", port);
+			sub = num;
+			tmpl += 6;
+		} else if (strncmp(tmpl, "{seq}", 5) == 0) {
+			snprintf(num, sizeof(num), "%lu", seq);
+			sub = num;
+			tmpl += 5;
+		}
+		if (sub) {
+			n = snprintf(name + pos, sizeof(name) - pos, "%s", sub);
+			pos += n;
+			if (pos >= (int)sizeof(name))
+				return -1;
+		} else
+			name[pos++] = *tmpl++;
+	}
+	name[pos] = 0;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	if (strftime(out, len, name, &tm) == 0)
+		return -1;
+	return 0;
+}
+
+static void session_close(struct srvthread *th, struct session *ses)
+{
+	printf("Session %s: %lu bytes written to %s\n", ses->peer,
+			ses->numbytes, ses->fname);
+	epoll_ctl(th->epfd, EPOLL_CTL_DEL, ses->sock, NULL);
+	close(ses->sock);
+	close(ses->outfd);
+	if (ses->pfd[0] != -1) {
+		close(ses->pfd[0]);
+		close(ses->pfd[1]);
+	}
+	if (ses->prev)
+		ses->prev->next = ses->next;
+	else
+		th->sessions = ses->next;
+	if (ses->next)
+		ses->next->prev = ses->prev;
+	free(ses);
+}
+
+static void session_open(struct srvthread *th, int sock,
+		const struct sockaddr_in *peer)
+{
+	struct session *ses;
+	struct epoll_event ev;
+	char addr[INET_ADDRSTRLEN];
+	unsigned long seq;
+
+	ses = malloc(sizeof(struct session));
+	if (!ses) {
+		fprintf(stderr, "Out of Memory.\n");
+		close(sock);
+		return;
+	}
+	memset(ses, 0, sizeof(struct session));
+	ses->sock = sock;
+	ses->pfd[0] = ses->pfd[1] = -1;
+	tcptune_init(&ses->tune, sock, TCPTUNE_RECV, th->st);
+	inet_ntop(AF_INET, &peer->sin_addr, addr, sizeof(addr));
+	snprintf(ses->peer, sizeof(ses->peer), "%s:%d", addr,
+			ntohs(peer->sin_port));
+	seq = __atomic_fetch_add(&session_seq, 1, __ATOMIC_RELAXED);
+	if (expand_name(ses->fname, sizeof(ses->fname), th->arg->tmpl,
+				addr, ntohs(peer->sin_port), seq) == -1) {
+		fprintf(stderr, "Cannot expand file name template: %s\n",
+				th->arg->tmpl);
+		goto err_exit_10;
+	}
+	ses->outfd = open(ses->fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (ses->outfd == -1) {
+		fprintf(stderr, "Cannot open %s for writing: %s\n",
+				ses->fname, strerror(errno));
+		goto err_exit_10;
+	}
+	if (th->arg->splice) {
+		if (pipe2(ses->pfd, O_NONBLOCK) == -1) {
+			fprintf(stderr, "Cannot create pipe: %s\n",
+					strerror(errno));
+			ses->pfd[0] = ses->pfd[1] = -1;
+		} else
+			fcntl(ses->pfd[1], F_SETPIPE_SZ, SRV_PIPESZ);
+	}
+
+	ev.events = EPOLLIN|EPOLLRDHUP;
+	ev.data.ptr = ses;
+	if (epoll_ctl(th->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		fprintf(stderr, "epoll_ctl add failed: %s\n", strerror(errno));
+		goto err_exit_20;
+	}
+	ses->next = th->sessions;
+	if (th->sessions)
+		th->sessions->prev = ses;
+	th->sessions = ses;
+	printf("Session %s: receiving into %s\n", ses->peer, ses->fname);
+	return;
+
+err_exit_20:
+	if (ses->pfd[0] != -1) {
+		close(ses->pfd[0]);
+		close(ses->pfd[1]);
+	}
+	close(ses->outfd);
+err_exit_10:
+	close(sock);
+	free(ses);
+}
+
+static void accept_all(struct srvthread *th)
+{
+	struct sockaddr_in peer;
+	socklen_t plen;
+	int sock;
+
+	do {
+		plen = sizeof(peer);
+		sock = accept4(th->lsock, (struct sockaddr *)&peer, &plen,
+				SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)
+				fprintf(stderr, "accept failed: %s\n",
+						strerror(errno));
+			break;
+		}
+		session_open(th, sock, &peer);
+	} while (*th->arg->g_exit == 0);
+}
+
+static int write_all(int fd, const char *buf, int len)
+{
+	int sysret;
+
+	while (len > 0) {
+		sysret = write(fd, buf, len);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += sysret;
+		len -= sysret;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 when the session is finished (EOF or error), 0 when the
+ * socket has been drained or the per-wakeup budget is used up.
+ */
+static int session_copy(struct srvthread *th, struct session *ses)
+{
+	ssize_t curlen;
+	unsigned long budget;
+	struct timespec t0;
+
+	for (budget = 0; budget < SRV_BUDGET; budget += curlen) {
+		curlen = recv(ses->sock, th->buf, SRV_BUFLEN, 0);
+		stats_add(&th->st->calls, 1);
+		if (curlen == -1) {
+			if (errno == EINTR) {
+				curlen = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats_add(&th->st->eagain, 1);
+				return 0;
+			}
+			fprintf(stderr, "Session %s: recv failed at %lu: %s\n",
+					ses->peer, ses->numbytes,
+					strerror(errno));
+			return 1;
+		} else if (curlen == 0)
+			return 1;
+		stats_now(&t0);
+		if (write_all(ses->outfd, th->buf, curlen) == -1) {
+			fprintf(stderr, "Session %s: write %s failed: %s\n",
+					ses->peer, ses->fname, strerror(errno));
+			return 1;
+		}
+		stats_lat(th->st, &t0);
+		stats_add(&th->st->bytes, curlen);
+		ses->numbytes += curlen;
+	}
+	return 0;
+}
+
+static int session_splice(struct srvthread *th, struct session *ses)
+{
+	ssize_t curlen, outlen;
+	unsigned long budget;
+	struct timespec t0;
+
+	for (budget = 0; budget < SRV_BUDGET; budget += curlen) {
+		curlen = splice(ses->sock, NULL, ses->pfd[1], NULL, SRV_PIPESZ,
+				SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		stats_add(&th->st->calls, 1);
+		if (curlen == -1) {
+			if (errno == EINTR) {
+				curlen = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats_add(&th->st->eagain, 1);
+				return 0;
+			}
+			fprintf(stderr, "Session %s: splice failed at %lu: %s\n",
+					ses->peer, ses->numbytes,
+					strerror(errno));
+			return 1;
+		} else if (curlen == 0)
+			return 1;
+		/* the output is a regular file, so this drains the pipe */
+		stats_now(&t0);
+		for (outlen = curlen; outlen > 0; ) {
+			ssize_t sysret;
+
+			sysret = splice(ses->pfd[0], NULL, ses->outfd, NULL,
+					outlen, SPLICE_F_MOVE);
+			if (sysret == -1) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "Session %s: splice to %s " \
+						"failed: %s\n", ses->peer,
+						ses->fname, strerror(errno));
+				return 1;
+			}
+			outlen -= sysret;
+		}
+		stats_lat(th->st, &t0);
+		stats_add(&th->st->bytes, curlen);
+		ses->numbytes += curlen;
+	}
+	return 0;
+}
+
+static void * srv_thread(void *dat)
+{
+	struct srvthread *th = (struct srvthread *)dat;
+	struct epoll_event evs[SRV_MAXEVENTS], ev;
+	struct session *ses;
+	int i, nev, done;
+
+	ev.events = EPOLLIN|EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(th->epfd, EPOLL_CTL_ADD, th->lsock, &ev) == -1) {
+		fprintf(stderr, "epoll_ctl listen failed: %s\n",
+				strerror(errno));
+		return NULL;
+	}
+	if (netev_epoll_add(th->epfd, th) == -1)
+		return NULL;
+	while (*th->arg->g_exit == 0) {
+		nev = epoll_wait(th->epfd, evs, SRV_MAXEVENTS, -1);
+		if (nev == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "epoll_wait failed: %s\n",
+					strerror(errno));
+			break;
+		}
+		stats_add(&th->st->wakeups, 1);
+		for (i = 0; i < nev; i++) {
+			if (evs[i].data.ptr == th)
+				continue;	/* exit */
+			ses = evs[i].data.ptr;
+			if (ses == NULL) {
+				accept_all(th);
+				continue;
+			}
+			if (ses->pfd[0] != -1)
+				done = session_splice(th, ses);
+			else
+				done = session_copy(th, ses);
+			if (done)
+				session_close(th, ses);
+			else
+				tcptune_sample(&ses->tune);
+		}
+	}
+	while (th->sessions)
+		session_close(th, th->sessions);
+	return NULL;
+}
+
+int net_server(struct srvarg *arg)
+{
+	struct srvthread *ths;
+	int lsock, i, nth, sysret, retv = 0;
+	char name[16];
+
+	lsock = prepare_net(arg->port, SOCK_STREAM);
+	if (lsock < 0) {
+		fprintf(stderr, "Cannot initialize socket for receiving\n");
+		return -1;
+	}
+	sysret = listen(lsock, 128);
+	if (sysret == -1) {
+		fprintf(stderr, "Cannot listen to the socket: %s\n",
+				strerror(errno));
+		retv = -2;
+		goto exit_10;
+	}
+	fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL)|O_NONBLOCK);
+
+	if (arg->nthreads < 1)
+		arg->nthreads = 1;
+	ths = malloc(arg->nthreads * sizeof(struct srvthread));
+	if (!ths) {
+		fprintf(stderr, "Out of Memory.\n");
+		retv = -3;
+		goto exit_10;
+	}
+	memset(ths, 0, arg->nthreads * sizeof(struct srvthread));
+	for (nth = 0; nth < arg->nthreads; nth++) {
+		snprintf(name, sizeof(name), "srv%d", nth);
+		ths[nth].st = stats_new(name);
+		ths[nth].arg = arg;
+		ths[nth].lsock = lsock;
+		ths[nth].buf = malloc(SRV_BUFLEN);
+		ths[nth].epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (ths[nth].epfd == -1 || ths[nth].buf == NULL ||
+				ths[nth].st == NULL) {
+			fprintf(stderr, "Cannot set up server thread: %s\n",
+					strerror(errno));
+			retv = -4;
+			break;
+		}
+		sysret = pthread_create(&ths[nth].thid, NULL, &srv_thread,
+				&ths[nth]);
+		if (sysret) {
+			fprintf(stderr, "Cannot create server thread: %s\n",
+					strerror(sysret));
+			retv = -4;
+			break;
+		}
+	}
+	if (retv != 0)
+		netev_exit(arg->g_exit);
+	for (i = 0; i < nth; i++)
+		pthread_join(ths[i].thid, NULL);
+	for (i = 0; i < arg->nthreads; i++) {
+		if (ths[i].epfd > 0)
+			close(ths[i].epfd);
+		free(ths[i].buf);
+	}
+	free(ths);
+
+exit_10:
+	close(lsock);
+	return retv;
+}
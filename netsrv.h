@@ -0,0 +1,20 @@
+#ifndef NET_SERVER_DSCAO__
+#define NET_SERVER_DSCAO__
+
+struct srvarg {
+	const char *port;
+	const char *tmpl;	/* output file name template */
+	int nthreads;		/* number of epoll threads */
+	int splice;		/* socket->pipe->file with splice() */
+	volatile int *g_exit;
+};
+
+/*
+ * Long running ingest server. Every accepted connection gets its own
+ * output file, named by expanding tmpl: {addr}, {port} and {seq} are
+ * replaced by the peer address, peer port and a session sequence number,
+ * then the result is passed through strftime(3).
+ */
+int net_server(struct srvarg *arg);
+
+#endif  /* NET_SERVER_DSCAO__ */
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "proto.h"
+#include "crc32c.h"
+#include "netev.h"
+
+#define PROTO_CRC_CHUNK	65536
+
+/* CRC32C of the len bytes of fd that end at offset end */
+int proto_tail_crc(int fd, off_t end, unsigned int len, unsigned int *crc)
+{
+	char *buf;
+	off_t off;
+	ssize_t numb;
+	size_t chunk;
+
+	buf = malloc(PROTO_CRC_CHUNK);
+	if (!buf) {
+		fprintf(stderr, "Out of Memory.\n");
+		return -1;
+	}
+	*crc = 0;
+	for (off = end - len; off < end; off += numb) {
+		chunk = end - off > PROTO_CRC_CHUNK ? PROTO_CRC_CHUNK : end - off;
+		numb = pread(fd, buf, chunk, off);
+		if (numb == -1 && errno == EINTR) {
+			numb = 0;
+			continue;
+		}
+		if (numb <= 0) {
+			fprintf(stderr, "Cannot read at %lld: %s\n",
+					(long long)off,
+					numb ? strerror(errno) : "short file");
+			free(buf);
+			return -1;
+		}
+		*crc = crc32c(*crc, buf, numb);
+	}
+	free(buf);
+	return 0;
+}
+
+int proto_write(int sock, const void *buf, size_t len)
+{
+	struct pollfd pfd;
+	const char *p = buf;
+	ssize_t sysret;
+
+	pfd.fd = sock;
+	pfd.events = POLLOUT;
+	while (len > 0) {
+		sysret = send(sock, p, len, MSG_NOSIGNAL|MSG_DONTWAIT);
+		if (sysret == -1 && errno == EAGAIN) {
+			sysret = netev_poll(&pfd, 1, PROTO_TIMEOUT);
+			if (sysret == -1 && errno == EINTR)
+				continue;
+			if (sysret <= 0) {
+				fprintf(stderr, "handshake poll failed: %s\n",
+						sysret ? strerror(errno) :
+						"timeout or exit");
+				return -1;
+			}
+			continue;
+		}
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "handshake send failed: %s\n",
+					strerror(errno));
+			return -1;
+		}
+		p += sysret;
+		len -= sysret;
+	}
+	return 0;
+}
+
+int proto_read(int sock, void *buf, size_t len)
+{
+	struct pollfd pfd;
+	char *p = buf;
+	ssize_t sysret;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while (len > 0) {
+		sysret = netev_poll(&pfd, 1, PROTO_TIMEOUT);
+		if (sysret == -1 && errno == EINTR)
+			continue;
+		if (sysret <= 0) {
+			fprintf(stderr, "handshake poll failed: %s\n",
+					sysret ? strerror(errno) :
+					"timeout or exit");
+			return -1;
+		}
+		sysret = recv(sock, p, len, MSG_DONTWAIT);
+		if (sysret == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "handshake recv failed: %s\n",
+					strerror(errno));
+			return -1;
+		} else if (sysret == 0) {
+			fprintf(stderr, "handshake: peer closed\n");
+			return -1;
+		}
+		p += sysret;
+		len -= sysret;
+	}
+	return 0;
+}
+
+static int proto_check(unsigned int magic, unsigned int version)
+{
+	if (be32toh(magic) != PROTO_MAGIC) {
+		fprintf(stderr, "handshake: peer does not speak resume " \
+				"protocol, -r on both sides?\n");
+		return -1;
+	}
+	if (be32toh(version) != PROTO_VERSION) {
+		fprintf(stderr, "handshake: unsupported version %u\n",
+				be32toh(version));
+		return -1;
+	}
+	return 0;
+}
+
+int proto_send_resume(int sock, off_t offset, unsigned int tail_len,
+		unsigned int tail_crc)
+{
+	struct proto_resume msg;
+
+	msg.magic = htobe32(PROTO_MAGIC);
+	msg.version = htobe32(PROTO_VERSION);
+	msg.offset = htobe64(offset);
+	msg.tail_len = htobe32(tail_len);
+	msg.tail_crc = htobe32(tail_crc);
+	return proto_write(sock, &msg, sizeof(msg));
+}
+
+int proto_recv_resume(int sock, off_t *offset, unsigned int *tail_len,
+		unsigned int *tail_crc)
+{
+	struct proto_resume msg;
+
+	if (proto_read(sock, &msg, sizeof(msg)) == -1 ||
+			proto_check(msg.magic, msg.version) == -1)
+		return -1;
+	*offset = be64toh(msg.offset);
+	*tail_len = be32toh(msg.tail_len);
+	*tail_crc = be32toh(msg.tail_crc);
+	if (*offset < 0 || *tail_len > *offset) {
+		fprintf(stderr, "handshake: bad resume offset\n");
+		return -1;
+	}
+	return 0;
+}
+
+int proto_send_start(int sock, off_t offset)
+{
+	struct proto_start msg;
+
+	msg.magic = htobe32(PROTO_MAGIC);
+	msg.version = htobe32(PROTO_VERSION);
+	msg.offset = htobe64(offset);
+	return proto_write(sock, &msg, sizeof(msg));
+}
+
+int proto_recv_start(int sock, off_t *offset)
+{
+	struct proto_start msg;
+
+	if (proto_read(sock, &msg, sizeof(msg)) == -1 ||
+			proto_check(msg.magic, msg.version) == -1)
+		return -1;
+	*offset = be64toh(msg.offset);
+	if (*offset < 0) {
+		fprintf(stderr, "handshake: bad start offset\n");
+		return -1;
+	}
+	return 0;
+}
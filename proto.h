@@ -0,0 +1,74 @@
+#ifndef PROTO_DSCAO__
+#define PROTO_DSCAO__
+#include <sys/types.h>
+
+#define PROTO_MAGIC	0x4e475253	/* "NGRS" */
+#define PROTO_VERSION	1
+#define PROTO_TAIL	(1024*1024)	/* bytes covered by the tail check */
+#define PROTO_ALIGN	4096		/* resume offsets are multiples */
+#define PROTO_TIMEOUT	10000		/* ms to wait for the peer */
+
+/*
+ * Resume handshake, used when both sides run with -r. Right after the
+ * TCP connection is up the receiver sends a proto_resume: how many
+ * bytes it already has and the CRC32C of the last tail_len of them.
+ * The sender checks that tail against its own file and answers with a
+ * proto_start holding the offset it will stream from, either the
+ * offered one or 0 if the tails differ. All fields are big endian.
+ */
+struct proto_resume {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long long offset;
+	unsigned int tail_len;
+	unsigned int tail_crc;
+} __attribute__((packed));
+
+struct proto_start {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long long offset;
+} __attribute__((packed));
+
+#define PROTO_BLOCK_MAGIC	0x4e47424b	/* "NGBK" */
+#define PROTO_BLOCK	(256*1024)	/* data bytes per checked block */
+
+/*
+ * Checked stream, netplay -k / netfile -k: the data goes in blocks of at
+ * most PROTO_BLOCK bytes, each a proto_block header with the CRC32C of
+ * its len bytes, and ends with a block of len 0, so a stream cut short
+ * is told from a complete one. Big endian like the rest.
+ */
+struct proto_block {
+	unsigned int magic;
+	unsigned int len;
+	unsigned int crc;
+} __attribute__((packed));
+
+#define PROTO_RANGE_MAGIC	0x4e47524e	/* "NGRN" */
+
+/*
+ * Range protocol, netplay -A / netdisp -A, see netrange.h. Every message
+ * is a proto_range: the sender's first tells the file size in offset,
+ * with len 0; the receiver then asks for len bytes at offset and the
+ * sender answers with the range it has, cut at the end of the file,
+ * followed by its bytes. A request of len 0 ends the session.
+ */
+struct proto_range {
+	unsigned int magic;
+	unsigned int len;
+	unsigned long long offset;
+} __attribute__((packed));
+
+/* all of buf or -1, waiting at most PROTO_TIMEOUT for the peer or exit */
+int proto_write(int sock, const void *buf, size_t len);
+int proto_read(int sock, void *buf, size_t len);
+int proto_tail_crc(int fd, off_t end, unsigned int len, unsigned int *crc);
+int proto_send_resume(int sock, off_t offset, unsigned int tail_len,
+		unsigned int tail_crc);
+int proto_recv_resume(int sock, off_t *offset, unsigned int *tail_len,
+		unsigned int *tail_crc);
+int proto_send_start(int sock, off_t offset);
+int proto_recv_start(int sock, off_t *offset);
+
+#endif  /* PROTO_DSCAO__ */
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "recpool.h"
+
+#define TOP_IDX(top)	((unsigned int)((top) & 0xffffffffULL))
+#define TOP_TAG(top)	((top) >> 32)
+#define TOP_MAKE(tag, idx)	(((tag) << 32) | (idx))
+
+static void * arena_map(size_t len, int hugepage, int *huge)
+{
+	void *arena;
+
+	*huge = 0;
+	if (hugepage) {
+		arena = mmap(NULL, len, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE,
+				-1, 0);
+		if (arena != MAP_FAILED) {
+			*huge = 1;
+			return arena;
+		}
+		fprintf(stderr, "No hugepages for record pool: %s\n",
+				strerror(errno));
+	}
+	arena = mmap(NULL, len, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED)
+		return NULL;
+	if (hugepage)
+		madvise(arena, len, MADV_HUGEPAGE);
+	return arena;
+}
+
+struct recpool * recpool_init(unsigned int nrec, int hugepage)
+{
+	struct recpool *pool;
+	unsigned int i;
+
+	pool = malloc(sizeof(struct recpool));
+	if (pool == NULL) {
+		fprintf(stderr, "Out of Memory.\n");
+		return NULL;
+	}
+	memset(pool, 0, sizeof(struct recpool));
+	pool->nrec = nrec;
+	pool->maplen = nrec * sizeof(struct record);
+	pool->maplen = (pool->maplen + RECPOOL_HUGESZ - 1) &
+		~(size_t)(RECPOOL_HUGESZ - 1);
+	pool->recs = arena_map(pool->maplen, hugepage, &pool->huge);
+	pool->next = malloc(nrec * sizeof(unsigned int));
+	if (pool->recs == NULL || pool->next == NULL) {
+		fprintf(stderr, "Cannot allocate record pool: %s\n",
+				strerror(errno));
+		recpool_exit(pool);
+		return NULL;
+	}
+	for (i = 0; i < nrec; i++) {
+		pool->recs[i].maxlen = sizeof(pool->recs[i].buf);
+		pool->recs[i].curlen = 0;
+		pool->next[i] = i + 1 < nrec ? i + 2 : 0;
+	}
+	pool->top = nrec ? TOP_MAKE(0ULL, 1ULL) : 0;
+	return pool;
+}
+
+void recpool_exit(struct recpool *pool)
+{
+	if (pool == NULL)
+		return;
+	if (pool->recs)
+		munmap(pool->recs, pool->maplen);
+	free(pool->next);
+	free(pool);
+}
+
+struct record * recpool_get(struct recpool *pool)
+{
+	unsigned long long top, newtop;
+	unsigned int idx, nxt;
+
+	top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+	do {
+		idx = TOP_IDX(top);
+		if (idx == 0)
+			return NULL;
+		nxt = __atomic_load_n(&pool->next[idx - 1], __ATOMIC_RELAXED);
+		newtop = TOP_MAKE(TOP_TAG(top) + 1, nxt);
+	} while (!__atomic_compare_exchange_n(&pool->top, &top, newtop, 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return pool->recs + idx - 1;
+}
+
+void recpool_put(struct recpool *pool, struct record *rec)
+{
+	unsigned long long top, newtop;
+	unsigned int idx;
+
+	idx = rec - pool->recs;
+	rec->curlen = 0;
+	top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&pool->next[idx], TOP_IDX(top),
+				__ATOMIC_RELAXED);
+		newtop = TOP_MAKE(TOP_TAG(top) + 1, idx + 1ULL);
+	} while (!__atomic_compare_exchange_n(&pool->top, &top, newtop, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
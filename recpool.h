@@ -0,0 +1,27 @@
+#ifndef RECPOOL_DSCAO__
+#define RECPOOL_DSCAO__
+#include "cirbuf.h"
+
+#define RECPOOL_HUGESZ	(2*1024*1024)
+
+/*
+ * A fixed set of struct record carved out of one contiguous arena.
+ * Free records are kept on a lock free stack; the stack top packs a
+ * generation tag with the record index so a concurrent get/put cannot
+ * suffer from ABA. Any number of threads may get and put.
+ */
+struct recpool {
+	struct record *recs;
+	unsigned int *next;	/* index + 1 of the next free record */
+	unsigned long long top;	/* tag << 32 | (index + 1), 0 when empty */
+	unsigned int nrec;
+	size_t maplen;
+	int huge;		/* arena is backed by explicit hugepages */
+};
+
+struct recpool * recpool_init(unsigned int nrec, int hugepage);
+void recpool_exit(struct recpool *pool);
+struct record * recpool_get(struct recpool *pool);
+void recpool_put(struct recpool *pool, struct record *rec);
+
+#endif  /* RECPOOL_DSCAO__ */
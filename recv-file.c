@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -8,15 +9,33 @@
 #include <string.h>
 #include <signal.h>
 #include <pthread.h>
-#include <time.h>
 #include <assert.h>
+#include <sched.h>
 #include "netproc.h"
+#include "netsrv.h"
+#include "lfring.h"
+#include "recpool.h"
+#include "diskwr.h"
+#include "stats.h"
+#include "proto.h"
+#include "netev.h"
+
+/* ring capacity + one being filled + one being written out */
+#define NUM_RECORDS	(CIR_BUFLEN + 2)
+
+struct ringsink {
+	struct netsink ns;
+	struct lfring *ring;
+	struct recpool *pool;
+};
 
 static volatile int global_exit = 0;
 static void sig_handler(int sig)
 {
 	if (sig == SIGINT || sig == SIGTERM)
-		global_exit = 1;
+		netev_exit(&global_exit);
+	else if (sig == SIGUSR1)
+		stats_signal();
 }
 
 static void * net_receiver(void *dat)
@@ -24,35 +43,216 @@ static void * net_receiver(void *dat)
 	struct commarg *tharg = (struct commarg *)dat;
 
 	net_processing(tharg);
-
-	*tharg->start = -1;
 	return NULL;
 }
 
+static void * ringsink_get(struct netsink *ns, char **data, int *maxlen)
+{
+	struct ringsink *rs = (struct ringsink *)ns;
+	struct record *rec;
+
+	while ((rec = recpool_get(rs->pool)) == NULL)
+		sched_yield();
+	*data = rec->buf;
+	*maxlen = rec->maxlen;
+	return rec;
+}
+
+static void ringsink_put(struct netsink *ns, void *item, int len)
+{
+	struct ringsink *rs = (struct ringsink *)ns;
+	struct record *rec = item;
+
+	if (len == 0) {
+		recpool_put(rs->pool, rec);
+		return;
+	}
+	rec->curlen = len;
+	lfring_insert(rs->ring, rec);
+}
+
+static void ringsink_eos(struct netsink *ns)
+{
+	struct ringsink *rs = (struct ringsink *)ns;
+
+	lfring_insert(rs->ring, NULL);
+}
+
+static int ringsink_init(struct ringsink *rs, int hugepage)
+{
+	memset(rs, 0, sizeof(struct ringsink));
+	rs->ring = lfring_init();
+	rs->pool = recpool_init(NUM_RECORDS, hugepage);
+	if (!rs->ring || !rs->pool)
+		return -1;
+	rs->ns.get = ringsink_get;
+	rs->ns.put = ringsink_put;
+	rs->ns.eos = ringsink_eos;
+	return 0;
+}
+
+/* drain the ring until the receiver marks the end with a NULL record */
+static void ring_writer(struct ringsink *rs, struct diskwr *dw)
+{
+	struct record *rec;
+	int err = 0;
+
+	while ((rec = (struct record *)lfring_consume(rs->ring)) != NULL) {
+		if (!err && diskwr_write(dw, rec->buf, rec->curlen) == -1) {
+			netev_exit(&global_exit);
+			err = 1;
+		}
+		recpool_put(rs->pool, rec);
+	}
+	printf("End of queue\n");
+}
+
+static void pipe_writer(int pin, struct diskwr *dw)
+{
+	ssize_t numb;
+	char *buf;
+	int room;
+
+	do {
+		buf = diskwr_buf(dw, &room);
+		numb = read(pin, buf, room);
+		if (numb == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "pipe read failed: %s\n", strerror(errno));
+			break;
+		} else if (numb == 0) {
+			printf("End of PIPE\n");
+			break;
+		}
+		if (diskwr_commit(dw, numb) == -1) {
+			netev_exit(&global_exit);
+			break;
+		}
+	} while(global_exit == 0);
+}
+
+/* -n: the connection threads pwrite() the blocks into fname themselves */
+static int striped_receive(struct commarg *arg, const char *fname)
+{
+	int fd;
+
+	fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open %s: %s\n", fname,
+				strerror(errno));
+		return 1;
+	}
+	arg->stripe = 1;
+	arg->stripe_fd = fd;
+	arg->dstfd = -1;
+	net_processing(arg);
+	if (close(fd) == -1) {
+		fprintf(stderr, "Cannot close %s: %s\n", fname,
+				strerror(errno));
+		return 7;
+	}
+	if (arg->corrupt) {
+		fprintf(stderr, "%s did not arrive intact\n", fname);
+		return 8;
+	}
+	return 0;
+}
+
+/*
+ * What we can offer to resume from: the existing file cut down to a
+ * PROTO_ALIGN boundary, the last block may be torn, plus a CRC32C of the
+ * PROTO_TAIL bytes before that point.
+ */
+static int resume_point(const char *fname, struct commarg *arg)
+{
+	struct stat st;
+	int fd, retv = 0;
+
+	arg->offset = 0;
+	arg->tail_len = 0;
+	arg->tail_crc = 0;
+	fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Cannot open %s: %s\n", fname,
+				strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "Cannot stat %s: %s\n", fname,
+				strerror(errno));
+		retv = -1;
+		goto exit_10;
+	}
+	arg->offset = st.st_size & ~(off_t)(PROTO_ALIGN - 1);
+	arg->tail_len = arg->offset > PROTO_TAIL ? PROTO_TAIL : arg->offset;
+	if (proto_tail_crc(fd, arg->offset, arg->tail_len,
+				&arg->tail_crc) == -1)
+		retv = -1;
+
+exit_10:
+	close(fd);
+	return retv;
+}
+
+static off_t parse_size(const char *str)
+{
+	char *end;
+	off_t size;
+
+	size = strtoll(str, &end, 0);
+	switch (*end) {
+	case 'g':
+	case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		size <<= 10;
+	}
+	return size;
+}
+
 int main(int argc, char *argv[])
 {
 	struct commarg tharg;
+	struct srvarg srvarg;
+	struct ringsink rsink;
 	struct sigaction mact;
 	int pfd[2], sysret, retv = 0;
-	int pin, c, finish;
-	ssize_t numb;
+	int pin, c, finish, server, queue, hugepage;
 	pthread_t netsrc;
-	volatile int play;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	FILE *fout;
-	char *buf;
-	const char *fname;
+	struct diskwr *dw;
+	off_t prealloc;
+	int direct, interval, resume, stripe;
+	const char *fname, *statpath;
 	extern char *optarg;
 	extern int optind, opterr, optopt;
-	static const struct timespec itv = {.tv_sec = 0, .tv_nsec = 40000000};
 
+	memset(&tharg, 0, sizeof(tharg));
+	memset(&srvarg, 0, sizeof(srvarg));
 	tharg.port = NULL;
 	fname = NULL;
+	server = 0;
+	queue = 0;
+	hugepage = 0;
+	direct = 0;
+	prealloc = 0;
+	statpath = NULL;
+	interval = 1000;
+	resume = 0;
+	stripe = 0;
+	memset(&rsink, 0, sizeof(rsink));
 	finish = 0;
 	opterr = 0;
 	do {
-		c = getopt(argc, argv, ":p:");
+		c = getopt(argc, argv, ":p:zdt:qHDa:uS:i:rnck");
 		switch(c) {
 		case '?':
 			fprintf(stderr, "Unknown option: %c\n", (char)optopt);
@@ -64,6 +264,48 @@ int main(int argc, char *argv[])
 		case 'p':
 			tharg.port = optarg;
 			break;
+		case 'z':
+			tharg.splice = 1;
+			break;
+		case 'd':
+			server = 1;
+			break;
+		case 't':
+			srvarg.nthreads = atoi(optarg);
+			break;
+		case 'q':
+			queue = 1;
+			break;
+		case 'H':
+			hugepage = 1;
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		case 'a':
+			prealloc = parse_size(optarg);
+			break;
+		case 'u':
+			tharg.socktype = SOCK_DGRAM;
+			break;
+		case 'S':
+			statpath = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'r':
+			resume = 1;
+			break;
+		case 'n':
+			stripe = 1;
+			break;
+		case 'c':
+			tharg.compress = 1;
+			break;
+		case 'k':
+			tharg.check = 1;
+			break;
 		case -1:
 			finish = 1;
 			break;
@@ -75,40 +317,108 @@ int main(int argc, char *argv[])
 		tharg.port = "7800";
 	if (argc > optind)
 		fname = argv[optind];
+	else if (server)
+		fname = "/tmp/play-{addr}-{port}-%Y%m%d%H%M%S.dat";
 	else
 		fname = "/tmp/play.dat";
 
-	buf = malloc(2048);
-	pthread_mutex_init(&mutex, NULL);
-	pthread_cond_init(&cond, NULL);
-
+	tharg.start_fd = -1;
+	if (netev_init() == -1) {
+		retv = 2;
+		goto exit_5;
+	}
 	memset(&mact, 0, sizeof(mact));
 	mact.sa_handler = sig_handler;
 	if (sigaction(SIGINT, &mact, NULL) == -1 ||
-			sigaction(SIGTERM, &mact, NULL) == -1)
+			sigaction(SIGTERM, &mact, NULL) == -1 ||
+			sigaction(SIGUSR1, &mact, NULL) == -1)
 		fprintf(stderr, "Cannot install signal handler: %s\n",
 				strerror(errno));
+	stats_start(statpath, interval, &global_exit);
 
-	fout = fopen(fname, "wb");
-	if (!fout) {
-		fprintf(stderr, "Cannot open %s for writing: %s\n",
-				fname, strerror(errno));
-		retv = 1;
+	if (server && tharg.socktype == SOCK_DGRAM) {
+		fprintf(stderr, "Server mode is TCP only.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (resume && (server || tharg.socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Resume needs a single TCP transfer.\n");
+		retv = 6;
 		goto exit_10;
 	}
-	sysret = pipe(pfd);
-	if (sysret == -1) {
-		fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
+	if (tharg.compress && (server || stripe ||
+				tharg.socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Compression is for a single TCP stream, " \
+				"-c goes without -d -n -u.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (tharg.check && (server || stripe || tharg.compress ||
+				tharg.socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Checked blocks are for a single plain TCP " \
+				"stream, -k goes without -c -d -n -u.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (stripe && (server || resume || queue || direct ||
+				tharg.socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Striped transfer writes the file itself, " \
+				"-n goes without -d -r -q -D -u.\n");
+		retv = 6;
+		goto exit_10;
+	}
+	if (server) {
+		srvarg.port = tharg.port;
+		srvarg.tmpl = fname;
+		srvarg.splice = tharg.splice;
+		srvarg.g_exit = &global_exit;
+		if (net_server(&srvarg) != 0)
+			retv = 6;
+		goto exit_10;
+	}
+
+	tharg.start_fd = netev_new();
+	if (tharg.start_fd == -1) {
 		retv = 2;
-		goto exit_15;
+		goto exit_10;
+	}
+	if (stripe) {
+		tharg.g_exit = &global_exit;
+		retv = striped_receive(&tharg, fname);
+		goto exit_10;
+	}
+
+	if (resume) {
+		if (resume_point(fname, &tharg) == -1) {
+			retv = 1;
+			goto exit_10;
+		}
+		tharg.resume = 1;
+	}
+	dw = diskwr_open(fname, direct, prealloc, resume);
+	if (!dw) {
+		retv = 1;
+		goto exit_10;
+	}
+	if (queue) {
+		pfd[0] = pfd[1] = -1;
+		if (ringsink_init(&rsink, hugepage) == -1) {
+			retv = 2;
+			goto exit_15;
+		}
+		tharg.sink = &rsink.ns;
+	} else {
+		sysret = pipe(pfd);
+		if (sysret == -1) {
+			fprintf(stderr, "Cannot create pipe: %s\n",
+					strerror(errno));
+			retv = 2;
+			goto exit_15;
+		}
 	}
 	tharg.dstfd = pfd[1];
-	tharg.start = &play;
 	tharg.g_exit = &global_exit;
-	tharg.mutex = &mutex;
-	tharg.cond = &cond;
 
-	play = 0;
 	sysret = pthread_create(&netsrc, NULL, &net_receiver, &tharg);
 	if (sysret) {
 		fprintf(stderr, "Cannot create udp receiver: %s\n",
@@ -116,48 +426,55 @@ int main(int argc, char *argv[])
 		retv = 3;
 		goto exit_40;
 	}
-	pthread_mutex_lock(&mutex);
-	while (play == 0 && global_exit == 0)
-		pthread_cond_wait(&cond, &mutex);
-	pthread_mutex_unlock(&mutex);
+	netev_wait(tharg.start_fd);
+	if (resume && tharg.offset == -1) {
+		fprintf(stderr, "No resume agreement, %s left as is\n",
+				fname);
+		netev_exit(&global_exit);
+	} else if (resume) {
+		if (tharg.offset > 0)
+			printf("Resuming at offset %lld\n",
+					(long long)tharg.offset);
+		if (diskwr_seek(dw, tharg.offset) == -1) {
+			fprintf(stderr, "Cannot resume at offset %lld\n",
+					(long long)tharg.offset);
+			netev_exit(&global_exit);
+		}
+	}
 	if (global_exit == 0)
 		printf("Start playing...\n");
-	else
+	else if (!queue)
 		goto exit_50;
 
-	pin = pfd[0];
-	do {
-		numb = read(pin, buf, 2048);
-		if (numb == -1) {
-			if (errno == EINTR)
-				continue;
-			fprintf(stderr, "pipe read failed: %s\n", strerror(errno));
-			break;
-		} else if (numb == 0) {
-			printf("End of PIPE\n");
-			break;
-		}
-		sysret = fwrite(buf, 1, numb, fout);
-		if (sysret == -1) {
-			fprintf(stderr, "fwrite failed: %s\n", strerror(errno));
-			play = -1;
-			break;
-		}
-		nanosleep(&itv, NULL);
-	} while(global_exit == 0);
-	close(pin);
+	if (queue)
+		ring_writer(&rsink, dw);
+	else {
+		/* the read end stays open until the receiver is joined */
+		pin = pfd[0];
+		pipe_writer(pin, dw);
+	}
 	printf("global_exit: %d\n", global_exit);
 
 exit_50:
 	pthread_join(netsrc, NULL);
+	if (tharg.corrupt) {
+		fprintf(stderr, "%s did not arrive intact\n", fname);
+		retv = 8;
+	}
 exit_40:
-	close(pfd[0]);
-	close(pfd[1]);
+	if (!queue) {
+		close(pfd[0]);
+		close(pfd[1]);
+	}
 exit_15:
-	fclose(fout);
+	if (diskwr_close(dw) == -1)
+		retv = 7;
 exit_10:
-	pthread_cond_destroy(&cond);
-	pthread_mutex_destroy(&mutex);
-	free(buf);
+	stats_stop();
+	if (tharg.start_fd != -1)
+		close(tharg.start_fd);
+exit_5:
+	lfring_exit(rsink.ring);
+	recpool_exit(rsink.pool);
 	return retv;
 }
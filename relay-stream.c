@@ -0,0 +1,900 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <time.h>
+#include "netproc.h"
+#include "stats.h"
+#include "tcptune.h"
+#include "netev.h"
+
+#define RELAY_RINGSZ	(16*1024*1024)
+#define RELAY_CHUNK	(256*1024)	/* largest single recv into the ring */
+#define RELAY_PIPESZ	(1024*1024)	/* ingest pipe, and most per splice */
+#define RELAY_SUBPIPESZ	(2*RELAY_PIPESZ)	/* each subscriber's pipe */
+#define RELAY_STALL_MS	1000	/* full this long holding the ingest: slow */
+#define RELAY_BUDGET	(4*1024*1024)	/* ingest bytes per wakeup */
+#define RELAY_MAXEVENTS	64
+
+enum relay_policy {
+	POLICY_DROP, POLICY_DISCONNECT
+};
+
+struct subscriber {
+	struct subscriber *prev, *next;
+	int sock;
+	int pfd[2];			/* -z: this subscriber's pipe */
+	unsigned long long cursor;	/* ring: next byte to send */
+	unsigned long queued;		/* -z: bytes in pfd */
+	unsigned long pipesz;		/* -z: what pfd holds */
+	char *ovf;			/* -z: sent after pfd, see ingest_tee */
+	unsigned long ovflen, ovfoff, owe;
+	unsigned long long sent, dropped;
+	struct tcptune tune;
+	int blocked;			/* waiting for EPOLLOUT */
+	int lagging;			/* left out of the ingest gate */
+	int full;			/* no room since full_since */
+	struct timespec full_since;
+	int draining;			/* ingest ended, close once sent */
+	int dead;			/* close after this epoll batch */
+	char peer[INET_ADDRSTRLEN + 8];
+};
+
+/*
+ * One ingest connection is received once and fanned out to every
+ * subscriber. By default data lands in a byte ring and each subscriber
+ * sends from its own cursor into it. With -z the ingest is spliced into
+ * a pipe and tee()d into one pipe per subscriber, which is spliced on
+ * to its socket, so payload is normally never copied to user space.
+ * The ingest takes no more than every subscriber has room for, in the
+ * ring or in its pipe, and stops reading while one of them is full, so
+ * the sender is slowed down to the pace of the subscribers rather than
+ * data being dropped. Only a subscriber that stays full for
+ * RELAY_STALL_MS is handled by the policy: dropped from the gate and
+ * skipped over as the ingest overruns it until it has caught up, or
+ * disconnected. Subscribers either connect to the relay or, given as
+ * host:port arguments, are connected to whenever an ingest starts.
+ */
+struct relay {
+	int epfd, isock, ssock, in;
+	int zcopy;
+	enum relay_policy policy;
+	char *ring;
+	unsigned long ringsz;
+	unsigned long long wpos;	/* bytes ingested since start */
+	int pfd[2];			/* -z: ingest pipe */
+	char *scratch;			/* -z: a batch, when a tee falls short */
+	int paused;			/* EPOLLIN off the ingest */
+	int hangup;			/* ingest out of epoll, being drained */
+	struct tcptune tune;		/* ingest connection */
+	int devnull;
+	struct subscriber *subs;
+	char **dests;			/* pushed to on every ingest */
+	int ndests;
+	struct stats *ist, *ost;
+	volatile int *g_exit;
+};
+
+static volatile int global_exit = 0;
+static void sig_handler(int sig)
+{
+	if (sig == SIGINT || sig == SIGTERM)
+		netev_exit(&global_exit);
+	else if (sig == SIGUSR1)
+		stats_signal();
+}
+
+static void sub_events(struct relay *rl, struct subscriber *sub, int blocked)
+{
+	struct epoll_event ev;
+
+	if (sub->blocked == blocked)
+		return;
+	sub->blocked = blocked;
+	ev.events = EPOLLRDHUP|(blocked ? EPOLLOUT : 0);
+	ev.data.ptr = sub;
+	if (epoll_ctl(rl->epfd, EPOLL_CTL_MOD, sub->sock, &ev) == -1)
+		fprintf(stderr, "epoll_ctl mod failed: %s\n", strerror(errno));
+}
+
+static void sub_close(struct relay *rl, struct subscriber *sub)
+{
+	printf("Subscriber %s: %llu bytes sent, %llu dropped\n", sub->peer,
+			sub->sent, sub->dropped);
+	epoll_ctl(rl->epfd, EPOLL_CTL_DEL, sub->sock, NULL);
+	close(sub->sock);
+	if (sub->pfd[0] != -1) {
+		close(sub->pfd[0]);
+		close(sub->pfd[1]);
+	}
+	free(sub->ovf);
+	if (sub->prev)
+		sub->prev->next = sub->next;
+	else
+		rl->subs = sub->next;
+	if (sub->next)
+		sub->next->prev = sub->prev;
+	free(sub);
+}
+
+static void sub_reap(struct relay *rl)
+{
+	struct subscriber *sub, *next;
+
+	for (sub = rl->subs; sub; sub = next) {
+		next = sub->next;
+		if (sub->dead)
+			sub_close(rl, sub);
+	}
+}
+
+/* sub cannot keep up, skip bytes of the stream for it or cut it off */
+static void sub_lagging(struct relay *rl, struct subscriber *sub,
+		unsigned long long skip)
+{
+	stats_add(&rl->ost->stalls, 1);
+	if (rl->policy == POLICY_DISCONNECT) {
+		fprintf(stderr, "Subscriber %s too slow, disconnecting\n",
+				sub->peer);
+		sub->dead = 1;
+		return;
+	}
+	if (!sub->lagging)
+		fprintf(stderr, "Subscriber %s too slow, dropping data\n",
+				sub->peer);
+	sub->lagging = 1;
+	sub->dropped += skip;
+	sub->cursor += skip;
+}
+
+/* bytes the ingest may add for sub without overrunning it */
+static unsigned long sub_room(struct relay *rl, struct subscriber *sub)
+{
+	if (rl->zcopy) {
+		if (sub->ovflen || sub->queued >= sub->pipesz)
+			return 0;
+		return sub->pipesz - sub->queued;
+	}
+	return rl->ringsz - (rl->wpos - sub->cursor);
+}
+
+static ssize_t sub_write(struct relay *rl, struct subscriber *sub)
+{
+	unsigned long pos, len;
+
+	if (rl->zcopy) {
+		if (sub->queued > 0)
+			return splice(sub->pfd[0], NULL, sub->sock, NULL,
+					sub->queued,
+					SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (sub->ovflen == 0)
+			return 0;
+		return send(sub->sock, sub->ovf + sub->ovfoff,
+				sub->ovflen - sub->ovfoff,
+				MSG_DONTWAIT|MSG_NOSIGNAL);
+	}
+	if (sub->cursor == rl->wpos)
+		return 0;
+	pos = sub->cursor % rl->ringsz;
+	len = rl->wpos - sub->cursor;
+	if (len > rl->ringsz - pos)
+		len = rl->ringsz - pos;
+	return send(sub->sock, rl->ring + pos, len, MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+/* send whatever the subscriber has pending until the socket is full */
+static void sub_flush(struct relay *rl, struct subscriber *sub)
+{
+	ssize_t numb;
+
+	while (!sub->dead) {
+		numb = sub_write(rl, sub);
+		stats_add(&rl->ost->calls, 1);
+		if (numb == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats_add(&rl->ost->eagain, 1);
+				sub_events(rl, sub, 1);
+				return;
+			}
+			fprintf(stderr, "Subscriber %s: send failed: %s\n",
+					sub->peer, strerror(errno));
+			sub->dead = 1;
+			return;
+		} else if (numb == 0) {
+			/* nothing pending: caught up, back in the gate */
+			if (sub->lagging && !sub->draining) {
+				fprintf(stderr, "Subscriber %s caught up\n",
+						sub->peer);
+				sub->lagging = 0;
+			}
+			break;
+		}
+		stats_add(&rl->ost->bytes, numb);
+		tcptune_sample(&sub->tune);
+		sub->sent += numb;
+		if (rl->zcopy && sub->queued > 0)
+			sub->queued -= numb;
+		else if (rl->zcopy) {
+			sub->ovfoff += numb;
+			if (sub->ovfoff == sub->ovflen) {
+				free(sub->ovf);
+				sub->ovf = NULL;
+				sub->ovflen = sub->ovfoff = 0;
+			}
+		} else
+			sub->cursor += numb;
+	}
+	sub_events(rl, sub, 0);
+	if (sub->draining)
+		sub->dead = 1;
+}
+
+static void sub_add(struct relay *rl, int sock, const char *peer)
+{
+	struct subscriber *sub;
+	struct epoll_event ev;
+
+	sub = malloc(sizeof(struct subscriber));
+	if (!sub) {
+		fprintf(stderr, "Out of Memory.\n");
+		close(sock);
+		return;
+	}
+	memset(sub, 0, sizeof(struct subscriber));
+	sub->sock = sock;
+	sub->pfd[0] = sub->pfd[1] = -1;
+	/* joins live: gets the stream from the next ingested byte */
+	sub->cursor = rl->wpos;
+	strncpy(sub->peer, peer, sizeof(sub->peer) - 1);
+	tcptune_init(&sub->tune, sock, TCPTUNE_SEND, rl->ost);
+	if (rl->zcopy) {
+		if (pipe2(sub->pfd, O_NONBLOCK|O_CLOEXEC) == -1) {
+			fprintf(stderr, "Cannot create pipe: %s\n",
+					strerror(errno));
+			goto err_exit_10;
+		}
+		fcntl(sub->pfd[1], F_SETPIPE_SZ, RELAY_SUBPIPESZ);
+		sub->pipesz = fcntl(sub->pfd[1], F_GETPIPE_SZ);
+		if ((long)sub->pipesz <= 0)
+			sub->pipesz = 65536;
+	}
+	ev.events = EPOLLRDHUP;
+	ev.data.ptr = sub;
+	if (epoll_ctl(rl->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		fprintf(stderr, "epoll_ctl add failed: %s\n", strerror(errno));
+		goto err_exit_20;
+	}
+	sub->next = rl->subs;
+	if (rl->subs)
+		rl->subs->prev = sub;
+	rl->subs = sub;
+	printf("Subscriber %s joined\n", sub->peer);
+	return;
+
+err_exit_20:
+	if (sub->pfd[0] != -1) {
+		close(sub->pfd[0]);
+		close(sub->pfd[1]);
+	}
+err_exit_10:
+	close(sock);
+	free(sub);
+}
+
+static void sub_accept(struct relay *rl)
+{
+	struct sockaddr_in peer;
+	socklen_t plen;
+	char addr[INET_ADDRSTRLEN], name[INET_ADDRSTRLEN + 8];
+	int sock;
+
+	plen = sizeof(peer);
+	sock = accept4(rl->ssock, (struct sockaddr *)&peer, &plen,
+			SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if (sock == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+		return;
+	}
+	inet_ntop(AF_INET, &peer.sin_addr, addr, sizeof(addr));
+	snprintf(name, sizeof(name), "%s:%d", addr, ntohs(peer.sin_port));
+	sub_add(rl, sock, name);
+}
+
+/* push subscriber: a netfile/netdisp listening at host:port */
+static void sub_connect(struct relay *rl, const char *dest)
+{
+	struct addrinfo hints, *adrlst;
+	char host[256], *port;
+	int sock, sysret;
+
+	strncpy(host, dest, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+	port = strrchr(host, ':');
+	if (!port) {
+		fprintf(stderr, "Bad subscriber %s, host:port expected\n",
+				dest);
+		return;
+	}
+	*port++ = 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	sysret = getaddrinfo(host, port, &hints, &adrlst);
+	if (sysret != 0) {
+		fprintf(stderr, "getaddrinfo failed: %s\n",
+				gai_strerror(sysret));
+		return;
+	}
+	sock = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		fprintf(stderr, "Cannot create a socket: %s\n",
+				strerror(errno));
+		goto exit_10;
+	}
+	if (connect(sock, adrlst->ai_addr, adrlst->ai_addrlen) == -1) {
+		fprintf(stderr, "Connect to %s failed: %s\n", dest,
+				strerror(errno));
+		close(sock);
+		goto exit_10;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL)|O_NONBLOCK);
+	sub_add(rl, sock, dest);
+exit_10:
+	freeaddrinfo(adrlst);
+}
+
+static void ingest_accept(struct relay *rl)
+{
+	struct epoll_event ev;
+	int i, sock;
+
+	sock = accept4(rl->isock, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if (sock == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+		return;
+	}
+	if (rl->in != -1) {
+		fprintf(stderr, "Already relaying a stream, connection " \
+				"refused\n");
+		close(sock);
+		return;
+	}
+	ev.events = EPOLLIN|EPOLLRDHUP;
+	ev.data.ptr = &rl->in;
+	if (epoll_ctl(rl->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		fprintf(stderr, "epoll_ctl add failed: %s\n", strerror(errno));
+		close(sock);
+		return;
+	}
+	rl->in = sock;
+	tcptune_init(&rl->tune, sock, TCPTUNE_RECV, rl->ist);
+	printf("Ingest stream started\n");
+	for (i = 0; i < rl->ndests; i++)
+		sub_connect(rl, rl->dests[i]);
+}
+
+static void ingest_end(struct relay *rl)
+{
+	struct subscriber *sub;
+
+	printf("Ingest stream ended at %llu bytes\n", rl->wpos);
+	epoll_ctl(rl->epfd, EPOLL_CTL_DEL, rl->in, NULL);
+	close(rl->in);
+	rl->in = -1;
+	rl->paused = 0;
+	rl->hangup = 0;
+	/* everyone gets what is queued for them, then EOF */
+	for (sub = rl->subs; sub; sub = sub->next) {
+		sub->draining = 1;
+		if (!sub->blocked)
+			sub_flush(rl, sub);
+	}
+}
+
+static void ingest_events(struct relay *rl, int paused)
+{
+	struct epoll_event ev;
+
+	if (rl->paused == paused || rl->in == -1)
+		return;
+	rl->paused = paused;
+	if (paused)
+		stats_add(&rl->ist->stalls, 1);
+	if (rl->hangup)
+		return;
+	/* paused, EPOLLRDHUP would fire on and on as well */
+	ev.events = paused ? 0 : EPOLLIN|EPOLLRDHUP;
+	ev.data.ptr = &rl->in;
+	if (epoll_ctl(rl->epfd, EPOLL_CTL_MOD, rl->in, &ev) == -1)
+		fprintf(stderr, "epoll_ctl mod failed: %s\n", strerror(errno));
+}
+
+/*
+ * EPOLLHUP or EPOLLERR on the paused ingest. What arrived before it is
+ * still to be read, so only take the socket out of epoll, where it
+ * would keep waking us, and let relay_gate() drain it as subscribers
+ * make room. ingest_read() ends it at EOF or on the error.
+ */
+static void ingest_hangup(struct relay *rl)
+{
+	if (epoll_ctl(rl->epfd, EPOLL_CTL_DEL, rl->in, NULL) == -1)
+		fprintf(stderr, "epoll_ctl del failed: %s\n", strerror(errno));
+	rl->hangup = 1;
+}
+
+/* what the ingest may take: the least room among the gated subscribers */
+static unsigned long ingest_room(struct relay *rl)
+{
+	struct subscriber *sub;
+	unsigned long room, r;
+
+	room = rl->zcopy ? RELAY_PIPESZ : rl->ringsz;
+	for (sub = rl->subs; sub; sub = sub->next) {
+		if (sub->dead || sub->lagging)
+			continue;
+		r = sub_room(rl, sub);
+		if (r < room)
+			room = r;
+	}
+	return room;
+}
+
+/* ring: one recv into the ring, skipping over lagging subscribers */
+static ssize_t ingest_ring(struct relay *rl, unsigned long room)
+{
+	struct subscriber *sub;
+	unsigned long pos, len;
+
+	pos = rl->wpos % rl->ringsz;
+	len = rl->ringsz - pos;
+	if (len > RELAY_CHUNK)
+		len = RELAY_CHUNK;
+	if (len > room)
+		len = room;
+	for (sub = rl->subs; sub; sub = sub->next)
+		if (!sub->dead && sub->lagging &&
+				rl->wpos + len - sub->cursor > rl->ringsz)
+			sub_lagging(rl, sub,
+				rl->wpos + len - sub->cursor - rl->ringsz);
+	return recv(rl->in, rl->ring + pos, len, MSG_DONTWAIT);
+}
+
+/*
+ * -z: the tee()s of a batch came up short for a subscriber in the gate,
+ * its pipe held fewer bytes than it has room for as pages were partly
+ * filled. Read the batch out and keep the rest of it for the ones
+ * short, sent once their pipes are empty, instead of dropping it.
+ */
+static int ingest_owed(struct relay *rl, ssize_t numb)
+{
+	struct subscriber *sub;
+	ssize_t sysret, got;
+
+	for (got = 0; got < numb; got += sysret) {
+		sysret = read(rl->pfd[0], rl->scratch + got, numb - got);
+		if (sysret == -1 && errno == EINTR)
+			sysret = 0;
+		else if (sysret <= 0) {
+			fprintf(stderr, "Cannot read ingest pipe: %s\n",
+					strerror(errno));
+			return -1;
+		}
+	}
+	for (sub = rl->subs; sub; sub = sub->next) {
+		if (sub->owe == 0)
+			continue;
+		sub->ovf = malloc(sub->owe);
+		if (sub->ovf == NULL) {
+			fprintf(stderr, "Out of Memory.\n");
+			sub->dead = 1;
+			sub->owe = 0;
+			continue;
+		}
+		memcpy(sub->ovf, rl->scratch + numb - sub->owe, sub->owe);
+		sub->ovflen = sub->owe;
+		sub->ovfoff = 0;
+		sub->owe = 0;
+		if (!sub->blocked)
+			sub_flush(rl, sub);
+	}
+	return 0;
+}
+
+/* -z: splice into the ingest pipe, tee to every subscriber, discard */
+static ssize_t ingest_tee(struct relay *rl, unsigned long room)
+{
+	struct subscriber *sub;
+	ssize_t numb, sysret, left;
+	int owed = 0;
+
+	numb = splice(rl->in, NULL, rl->pfd[1], NULL,
+			room < RELAY_PIPESZ ? room : RELAY_PIPESZ,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (numb <= 0)
+		return numb;
+	for (sub = rl->subs; sub; sub = sub->next) {
+		if (sub->dead)
+			continue;
+		/* still owed older data: new data cannot go before it */
+		if (sub->ovflen) {
+			sub_lagging(rl, sub, numb);
+			continue;
+		}
+		/* make room in its pipe first, then hand it the new data */
+		if (!sub->blocked)
+			sub_flush(rl, sub);
+		sysret = tee(rl->pfd[0], sub->pfd[1], numb, SPLICE_F_NONBLOCK);
+		if (sysret == -1)
+			sysret = 0;
+		sub->queued += sysret;
+		if (sysret < numb && sub->lagging)
+			sub_lagging(rl, sub, numb - sysret);
+		else if (sysret < numb) {
+			sub->owe = numb - sysret;
+			owed = 1;
+		}
+		if (!sub->blocked)
+			sub_flush(rl, sub);
+	}
+	if (owed) {
+		if (ingest_owed(rl, numb) == -1)
+			netev_exit(rl->g_exit);
+		return numb;
+	}
+	for (left = numb; left > 0; left -= sysret) {
+		sysret = splice(rl->pfd[0], NULL, rl->devnull, NULL, left,
+				SPLICE_F_MOVE);
+		if (sysret == -1 && errno == EINTR)
+			sysret = 0;
+		else if (sysret <= 0) {
+			fprintf(stderr, "Cannot drain ingest pipe: %s\n",
+					strerror(errno));
+			netev_exit(rl->g_exit);
+			break;
+		}
+	}
+	return numb;
+}
+
+static void relay_flush(struct relay *rl)
+{
+	struct subscriber *sub;
+
+	for (sub = rl->subs; sub; sub = sub->next)
+		if (!sub->dead && !sub->blocked)
+			sub_flush(rl, sub);
+}
+
+static void ingest_read(struct relay *rl)
+{
+	unsigned long budget, room;
+	ssize_t numb;
+
+	for (budget = 0; budget < RELAY_BUDGET; budget += numb) {
+		room = ingest_room(rl);
+		if (room == 0) {
+			relay_flush(rl);
+			room = ingest_room(rl);
+			if (room == 0)
+				break;	/* relay_gate() pauses the ingest */
+		}
+		numb = rl->zcopy ? ingest_tee(rl, room) : ingest_ring(rl, room);
+		stats_add(&rl->ist->calls, 1);
+		if (numb == -1) {
+			if (errno == EINTR) {
+				numb = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats_add(&rl->ist->eagain, 1);
+				/* nothing more will come after a hangup */
+				if (rl->hangup)
+					ingest_end(rl);
+				break;
+			}
+			fprintf(stderr, "Ingest receive failed at %llu: %s\n",
+					rl->wpos, strerror(errno));
+			ingest_end(rl);
+			return;
+		} else if (numb == 0) {
+			ingest_end(rl);
+			return;
+		}
+		rl->wpos += numb;
+		stats_add(&rl->ist->bytes, numb);
+		tcptune_sample(&rl->tune);
+	}
+	relay_flush(rl);
+}
+
+/*
+ * Pause the ingest while a gated subscriber is full, it is resumed
+ * once EPOLLOUT let that one send. Whoever has been full for
+ * RELAY_STALL_MS is slow: out of the gate, to the policy. An ingest
+ * that hung up is read from here while there is room. Returns the
+ * epoll timeout, until the next of them would be.
+ */
+static int relay_gate(struct relay *rl)
+{
+	struct subscriber *sub;
+	struct timespec now;
+	long ms, wait = -1;
+
+	if (rl->in == -1)
+		return -1;
+	stats_now(&now);
+	for (sub = rl->subs; sub; sub = sub->next) {
+		if (sub->dead || sub->lagging)
+			continue;
+		if (sub_room(rl, sub) > 0) {
+			sub->full = 0;
+			continue;
+		}
+		if (!sub->full) {
+			sub->full = 1;
+			sub->full_since = now;
+		}
+		ms = (now.tv_sec - sub->full_since.tv_sec) * 1000 +
+			(now.tv_nsec - sub->full_since.tv_nsec) / 1000000;
+		if (ms >= RELAY_STALL_MS) {
+			sub->full = 0;
+			sub_lagging(rl, sub, 0);
+			continue;
+		}
+		if (wait == -1 || RELAY_STALL_MS - ms < wait)
+			wait = RELAY_STALL_MS - ms;
+	}
+	ingest_events(rl, wait != -1);
+	if (rl->hangup && wait == -1) {
+		ingest_read(rl);
+		/* round again without sleeping, until it ends or is full */
+		return rl->in == -1 ? -1 : 0;
+	}
+	return wait;
+}
+
+static int relay_listen(const char *port)
+{
+	int sock;
+
+	sock = prepare_net(port, SOCK_STREAM);
+	if (sock < 0)
+		return -1;
+	if (listen(sock, 16) == -1) {
+		fprintf(stderr, "Cannot listen to the socket: %s\n",
+				strerror(errno));
+		close(sock);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL)|O_NONBLOCK);
+	return sock;
+}
+
+static void relay_run(struct relay *rl)
+{
+	struct epoll_event evs[RELAY_MAXEVENTS];
+	struct subscriber *sub;
+	void *ptr;
+	int i, nev, timeout;
+
+	timeout = -1;
+	while (*rl->g_exit == 0) {
+		nev = epoll_wait(rl->epfd, evs, RELAY_MAXEVENTS, timeout);
+		if (nev == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "epoll_wait failed: %s\n",
+					strerror(errno));
+			break;
+		}
+		stats_add(&rl->ist->wakeups, 1);
+		for (i = 0; i < nev; i++) {
+			ptr = evs[i].data.ptr;
+			if (ptr == rl)
+				continue;	/* exit */
+			else if (ptr == &rl->isock)
+				ingest_accept(rl);
+			else if (ptr == &rl->ssock)
+				sub_accept(rl);
+			else if (ptr == &rl->in) {
+				/* paused, only a hangup or error wakes us */
+				if (rl->in != -1 && rl->paused)
+					ingest_hangup(rl);
+				else if (rl->in != -1)
+					ingest_read(rl);
+			} else {
+				sub = ptr;
+				if (sub->dead)
+					continue;
+				if (evs[i].events & (EPOLLRDHUP|EPOLLHUP|
+							EPOLLERR))
+					sub->dead = 1;
+				else if (evs[i].events & EPOLLOUT)
+					sub_flush(rl, sub);
+			}
+		}
+		sub_reap(rl);
+		timeout = relay_gate(rl);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct relay rl;
+	struct sigaction mact;
+	struct epoll_event ev;
+	const char *iport, *sport, *statpath;
+	int c, finish, interval, retv = 0;
+	extern char *optarg;
+	extern int optind, opterr, optopt;
+
+	memset(&rl, 0, sizeof(rl));
+	rl.in = -1;
+	rl.pfd[0] = rl.pfd[1] = -1;
+	rl.devnull = -1;
+	rl.ringsz = RELAY_RINGSZ;
+	rl.policy = POLICY_DROP;
+	rl.g_exit = &global_exit;
+	iport = NULL;
+	sport = NULL;
+	statpath = NULL;
+	interval = 1000;
+	opterr = 0;
+	finish = 0;
+	do {
+		c = getopt(argc, argv, ":p:o:m:zP:S:i:");
+		switch(c) {
+		case '?':
+			fprintf(stderr, "Unknown option: %c\n", (char)optopt);
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument for %c\n",
+					(char)optopt);
+			break;
+		case 'p':
+			iport = optarg;
+			break;
+		case 'o':
+			sport = optarg;
+			break;
+		case 'm':
+			rl.ringsz = strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'z':
+			rl.zcopy = 1;
+			break;
+		case 'P':
+			if (strcmp(optarg, "drop") == 0)
+				rl.policy = POLICY_DROP;
+			else if (strcmp(optarg, "disconnect") == 0)
+				rl.policy = POLICY_DISCONNECT;
+			else
+				fprintf(stderr, "Unknown policy: %s\n", optarg);
+			break;
+		case 'S':
+			statpath = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case -1:
+			finish = 1;
+			break;
+		default:
+			assert(0);
+		}
+	} while (finish == 0);
+	if (iport == NULL)
+		iport = "7800";
+	if (sport == NULL)
+		sport = "7801";
+	rl.dests = argv + optind;
+	rl.ndests = argc - optind;
+	if (rl.ringsz < RELAY_CHUNK)
+		rl.ringsz = RELAY_CHUNK;
+
+	if (netev_init() == -1)
+		return 2;
+	memset(&mact, 0, sizeof(mact));
+	mact.sa_handler = sig_handler;
+	if (sigaction(SIGINT, &mact, NULL) == -1 ||
+			sigaction(SIGTERM, &mact, NULL) == -1 ||
+			sigaction(SIGUSR1, &mact, NULL) == -1)
+		fprintf(stderr, "Cannot install signal handler: %s\n",
+				strerror(errno));
+	signal(SIGPIPE, SIG_IGN);
+	rl.ist = stats_new("ingest");
+	rl.ost = stats_new("fanout");
+	if (!rl.ist || !rl.ost) {
+		retv = 2;
+		goto exit_10;
+	}
+	stats_start(statpath, interval, &global_exit);
+
+	if (rl.zcopy) {
+		rl.devnull = open("/dev/null", O_WRONLY|O_CLOEXEC);
+		if (rl.devnull == -1 || pipe2(rl.pfd, O_NONBLOCK|O_CLOEXEC)) {
+			fprintf(stderr, "Cannot set up splice: %s\n",
+					strerror(errno));
+			retv = 2;
+			goto exit_10;
+		}
+		fcntl(rl.pfd[1], F_SETPIPE_SZ, RELAY_PIPESZ);
+		rl.scratch = malloc(RELAY_PIPESZ);
+		if (!rl.scratch) {
+			fprintf(stderr, "Out of Memory.\n");
+			retv = 2;
+			goto exit_10;
+		}
+	} else {
+		rl.ring = malloc(rl.ringsz);
+		if (!rl.ring) {
+			fprintf(stderr, "Out of Memory.\n");
+			retv = 2;
+			goto exit_10;
+		}
+	}
+
+	rl.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (rl.epfd == -1) {
+		fprintf(stderr, "epoll_create failed: %s\n", strerror(errno));
+		retv = 3;
+		goto exit_10;
+	}
+	rl.isock = relay_listen(iport);
+	if (rl.isock == -1) {
+		retv = 4;
+		goto exit_20;
+	}
+	rl.ssock = relay_listen(sport);
+	if (rl.ssock == -1) {
+		retv = 4;
+		goto exit_30;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &rl.isock;
+	epoll_ctl(rl.epfd, EPOLL_CTL_ADD, rl.isock, &ev);
+	ev.data.ptr = &rl.ssock;
+	epoll_ctl(rl.epfd, EPOLL_CTL_ADD, rl.ssock, &ev);
+	netev_epoll_add(rl.epfd, &rl);
+	printf("Relaying port %s to subscribers on port %s%s\n", iport, sport,
+			rl.zcopy ? ", zero copy" : "");
+
+	relay_run(&rl);
+
+	while (rl.subs)
+		sub_close(&rl, rl.subs);
+	if (rl.in != -1)
+		close(rl.in);
+	close(rl.ssock);
+exit_30:
+	close(rl.isock);
+exit_20:
+	close(rl.epfd);
+exit_10:
+	if (rl.pfd[0] != -1) {
+		close(rl.pfd[0]);
+		close(rl.pfd[1]);
+	}
+	if (rl.devnull != -1)
+		close(rl.devnull);
+	free(rl.ring);
+	free(rl.scratch);
+	stats_stop();
+	return retv;
+}
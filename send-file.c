@@ -1,6 +1,12 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -11,35 +17,825 @@
 #include <poll.h>
 #include <assert.h>
 #include <time.h>
+#include <sched.h>
+#include <endian.h>
+#include <pthread.h>
 #include "netproc.h"
+#include "stats.h"
+#include "proto.h"
+#include "tcptune.h"
+#include "stripe.h"
+#include "netcomp.h"
+#include "netrange.h"
+#include "transcode.h"
+#include "crc32c.h"
+#include "netev.h"
+
+#define SEND_CHUNK	(1024*1024)
+#define COPY_BUFLEN	65536
+#define UDP_PAYLOAD	1472	/* fits a 1500 byte MTU and a struct record */
+#define UDP_BATCH	16
+#define UDP_GSO_SEGS	44	/* 44 * 1472 stays below the 64 KiB limit */
+
+enum xmit_engine {
+	XMIT_AUTO, XMIT_SENDFILE, XMIT_MMAP, XMIT_COPY
+};
 
 static volatile int global_exit = 0;
+static struct stats *sst;
+static struct tcptune stt;
+
 static void sig_handler(int sig)
 {
 	if (sig == SIGINT || sig == SIGTERM)
-		global_exit = 1;
+		netev_exit(&global_exit);
+	else if (sig == SIGUSR1)
+		stats_signal();
+}
+
+static int send_all(int sock, const char *buf, size_t len,
+		unsigned long *numpkts)
+{
+	ssize_t sysret;
+	struct timespec t0;
+
+	while (len > 0 && global_exit == 0) {
+		stats_now(&t0);
+		sysret = send(sock, buf, len, 0);
+		stats_add(&sst->calls, 1);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "UDP send failed at offset " \
+					"%lu: %s\n", *numpkts,
+					strerror(errno));
+			return -1;
+		}
+		stats_lat(sst, &t0);
+		stats_add(&sst->bytes, sysret);
+		tcptune_sample(&stt);
+		buf += sysret;
+		len -= sysret;
+		*numpkts += sysret;
+	}
+	return 0;
+}
+
+/*
+ * The engines start at the current file position, which is not 0 when
+ * resuming.
+ * Returns 1 if sendfile() cannot be used with this file/socket pair and
+ * nothing has been sent yet, so the caller may try another engine.
+ */
+static int xmit_sendfile(int sock, int fd, unsigned long *numpkts)
+{
+	off_t offset, start;
+	ssize_t len;
+	struct timespec t0;
+
+	start = offset = lseek(fd, 0, SEEK_CUR);
+	if (start == -1)
+		return 1;
+	do {
+		stats_now(&t0);
+		len = sendfile(sock, fd, &offset, SEND_CHUNK);
+		stats_add(&sst->calls, 1);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (offset == start &&
+					(errno == EINVAL || errno == ENOSYS))
+				return 1;
+			fprintf(stderr, "sendfile failed at offset %lu: %s\n",
+					*numpkts, strerror(errno));
+			return -1;
+		}
+		stats_lat(sst, &t0);
+		stats_add(&sst->bytes, len);
+		tcptune_sample(&stt);
+		*numpkts += len;
+	} while (len != 0 && global_exit == 0);
+	return 0;
+}
+
+static int xmit_mmap(int sock, int fd, off_t size, unsigned long *numpkts)
+{
+	char *map;
+	off_t offset;
+	size_t len;
+	int retv = 0;
+
+	if (size == 0)
+		return 0;
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset == -1)
+		return 1;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return 1;
+	madvise(map, size, MADV_SEQUENTIAL);
+	for (; offset < size && global_exit == 0; offset += len) {
+		len = size - offset;
+		if (len > SEND_CHUNK)
+			len = SEND_CHUNK;
+		retv = send_all(sock, map + offset, len, numpkts);
+		if (retv)
+			break;
+	}
+	munmap(map, size);
+	return retv;
+}
+
+static int xmit_copy(int sock, int fd, unsigned long *numpkts)
+{
+	char *buf;
+	ssize_t numb;
+	int retv = 0;
+
+	buf = malloc(COPY_BUFLEN);
+	if (!buf) {
+		fprintf(stderr, "Out of Memory.\n");
+		return -1;
+	}
+	do {
+		numb = read(fd, buf, COPY_BUFLEN);
+		if (numb == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "read failed at offset %lu: %s\n",
+					*numpkts, strerror(errno));
+			retv = -1;
+			break;
+		}
+		retv = send_all(sock, buf, numb, numpkts);
+	} while (numb > 0 && retv == 0 && global_exit == 0);
+	free(buf);
+	return retv;
+}
+
+static ssize_t read_full(int fd, char *buf, size_t len)
+{
+	ssize_t numb;
+	size_t pos = 0;
+
+	while (pos < len) {
+		numb = read(fd, buf + pos, len - pos);
+		if (numb == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (numb == 0)
+			break;
+		pos += numb;
+	}
+	return pos;
+}
+
+static void pace(const struct timespec *t0, unsigned long sent,
+		unsigned long rate)
+{
+	struct timespec now, itv;
+	long long due, elapsed;
+
+	due = (long long)((double)sent * 1000000000.0 / rate);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - t0->tv_sec) * 1000000000LL +
+		now.tv_nsec - t0->tv_nsec;
+	if (due <= elapsed)
+		return;
+	itv.tv_sec = (due - elapsed) / 1000000000LL;
+	itv.tv_nsec = (due - elapsed) % 1000000000LL;
+	nanosleep(&itv, NULL);
+}
+
+/*
+ * Datagram transport: the file is cut into UDP_PAYLOAD sized datagrams
+ * and sent UDP_BATCH messages per sendmmsg(). With UDP GSO every message
+ * carries UDP_GSO_SEGS datagrams that the kernel segments for us.
+ * rate, in bytes per second, paces the sender since UDP has no flow
+ * control. A zero length datagram tells the receiver we are done.
+ */
+static int xmit_dgram(int sock, int fd, unsigned long rate,
+		unsigned long *numpkts)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	struct timespec t0, t1;
+	char *buf;
+	int seg, msglen, i, n, sent, sysret, retv = 0;
+	ssize_t numb;
+
+	seg = UDP_PAYLOAD;
+	if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0)
+		msglen = UDP_GSO_SEGS * UDP_PAYLOAD;
+	else
+		msglen = UDP_PAYLOAD;
+	buf = malloc(UDP_BATCH * msglen);
+	if (!buf) {
+		fprintf(stderr, "Out of Memory.\n");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		numb = read_full(fd, buf, UDP_BATCH * msglen);
+		if (numb == -1) {
+			fprintf(stderr, "read failed at offset %lu: %s\n",
+					*numpkts, strerror(errno));
+			retv = -1;
+			break;
+		} else if (numb == 0)
+			break;
+		n = (numb + msglen - 1) / msglen;
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = buf + i * msglen;
+			iov[i].iov_len = numb - i * msglen;
+			if (iov[i].iov_len > (size_t)msglen)
+				iov[i].iov_len = msglen;
+			memset(&msgs[i], 0, sizeof(struct mmsghdr));
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		for (sent = 0; sent < n && global_exit == 0; ) {
+			stats_now(&t1);
+			sysret = sendmmsg(sock, msgs + sent, n - sent, 0);
+			stats_add(&sst->calls, 1);
+			if (sysret == -1) {
+				if (errno == ENOBUFS)
+					stats_add(&sst->stalls, 1);
+				if (errno == EINTR || errno == ENOBUFS) {
+					sched_yield();
+					continue;
+				}
+				fprintf(stderr, "UDP send failed at offset " \
+						"%lu: %s\n", *numpkts,
+						strerror(errno));
+				retv = -1;
+				goto exit_10;
+			}
+			stats_lat(sst, &t1);
+			for (i = sent; i < sent + sysret; i++) {
+				*numpkts += msgs[i].msg_len;
+				stats_add(&sst->bytes, msgs[i].msg_len);
+			}
+			sent += sysret;
+		}
+		if (rate)
+			pace(&t0, *numpkts, rate);
+	} while (global_exit == 0);
+
+	for (i = 0; i < 3; i++)
+		send(sock, buf, 0, 0);
+exit_10:
+	free(buf);
+	return retv;
+}
+
+/*
+ * Take the receiver's resume offer, check its tail against our file and
+ * position fd where the stream is to continue.
+ */
+static int resume_handshake(int sock, int fd, const char *fname)
+{
+	struct stat st;
+	off_t offset;
+	unsigned int tail_len, tail_crc, crc;
+
+	if (proto_recv_resume(sock, &offset, &tail_len, &tail_crc) == -1)
+		return -1;
+	if (offset > 0) {
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+				offset > st.st_size) {
+			printf("Cannot resume %s at offset %lld, " \
+					"starting over\n", fname,
+					(long long)offset);
+			offset = 0;
+		} else if (proto_tail_crc(fd, offset, tail_len, &crc) == -1 ||
+				crc != tail_crc) {
+			printf("Receiver data differs from %s, " \
+					"starting over\n", fname);
+			offset = 0;
+		}
+	}
+	if (proto_send_start(sock, offset) == -1)
+		return -1;
+	if (offset == 0)
+		return 0;
+	if (lseek(fd, offset, SEEK_SET) == -1) {
+		fprintf(stderr, "Cannot seek to %lld: %s\n",
+				(long long)offset, strerror(errno));
+		return -1;
+	}
+	printf("Resuming at offset %lld\n", (long long)offset);
+	return 0;
+}
+
+static int xmit_file(int sock, int fd, enum xmit_engine engine,
+		unsigned long *numpkts)
+{
+	struct stat st;
+	int retv;
+
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "Cannot stat input: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode))
+		engine = XMIT_COPY;
+
+	retv = 1;
+	if (engine == XMIT_AUTO || engine == XMIT_SENDFILE)
+		retv = xmit_sendfile(sock, fd, numpkts);
+	if (retv == 1 && engine != XMIT_COPY)
+		retv = xmit_mmap(sock, fd, st.st_size, numpkts);
+	if (retv == 1)
+		retv = xmit_copy(sock, fd, numpkts);
+	return retv;
+}
+
+/* hlen bytes of header and len of data with as few calls as it takes */
+static int send_frame(int sock, void *hdr, size_t hlen, char *data,
+		size_t len, unsigned long *numpkts)
+{
+	struct timespec t0;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t sysret;
+	size_t left;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = len ? 2 : 1;
+	left = hlen + len;
+	while (left > 0 && global_exit == 0) {
+		stats_now(&t0);
+		sysret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		stats_add(&sst->calls, 1);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "send failed at offset %lu: %s\n",
+					*numpkts, strerror(errno));
+			return -1;
+		}
+		stats_lat(sst, &t0);
+		stats_add(&sst->bytes, sysret);
+		tcptune_sample(&stt);
+		*numpkts += sysret;
+		left -= sysret;
+		while (msg.msg_iovlen > 0 &&
+				(size_t)sysret >= msg.msg_iov->iov_len) {
+			sysret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base +
+				sysret;
+			msg.msg_iov->iov_len -= sysret;
+		}
+	}
+	return left ? -1 : 0;
+}
+
+/*
+ * Checked stream, see proto.h. sendfile() would never bring the data
+ * into the CPU, so every block is read into buf instead, its CRC32C
+ * taken while it is still in cache and both sent with one sendmsg().
+ */
+static int xmit_checked(int sock, int fd, unsigned long *numpkts)
+{
+	struct proto_block hdr;
+	unsigned long nblk;
+	char *buf;
+	ssize_t numb;
+	int retv = 0;
+
+	buf = malloc(PROTO_BLOCK);
+	if (!buf) {
+		fprintf(stderr, "Out of Memory.\n");
+		return -1;
+	}
+	nblk = 0;
+	do {
+		numb = read_full(fd, buf, PROTO_BLOCK);
+		if (numb == -1) {
+			fprintf(stderr, "read failed at offset %lu: %s\n",
+					*numpkts, strerror(errno));
+			retv = -1;
+			break;
+		}
+		hdr.magic = htobe32(PROTO_BLOCK_MAGIC);
+		hdr.len = htobe32(numb);
+		hdr.crc = htobe32(crc32c(0, buf, numb));
+		retv = send_frame(sock, &hdr, sizeof(hdr), buf, numb, numpkts);
+		if (numb > 0)
+			nblk++;
+	} while (numb > 0 && retv == 0 && global_exit == 0);
+	if (retv == 0 && numb == 0)
+		printf("Sent %lu blocks with their CRC32C (%s)\n", nblk,
+				crc32c_engine());
+	free(buf);
+	return retv;
+}
+
+enum cjob_state {
+	CJOB_FREE, CJOB_READY, CJOB_BUSY, CJOB_DONE
+};
+
+struct cjob {
+	enum cjob_state state;
+	int compress;		/* or send it as is */
+	unsigned int rawlen, len;
+	unsigned int crc;	/* of raw */
+	char *raw, *out;
+};
+
+/*
+ * Compressing sender: the main thread reads the file into jobs in
+ * order, nthreads workers compress whichever job is ready and the main
+ * thread sends them out again in order. jobs[seq % njobs] holds block
+ * seq.
+ */
+struct cpipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct cjob *jobs;
+	int njobs;
+	int codec;
+	size_t bound;
+	int quit;
+};
+
+static void * cpipe_worker(void *dat)
+{
+	struct cpipe *cp = (struct cpipe *)dat;
+	struct cjob *job;
+	long numb;
+	int i;
+
+	pthread_mutex_lock(&cp->lock);
+	while (!cp->quit) {
+		job = NULL;
+		for (i = 0; i < cp->njobs && !job; i++)
+			if (cp->jobs[i].state == CJOB_READY)
+				job = cp->jobs + i;
+		if (!job) {
+			pthread_cond_wait(&cp->cond, &cp->lock);
+			continue;
+		}
+		job->state = CJOB_BUSY;
+		pthread_mutex_unlock(&cp->lock);
+		job->crc = crc32c(0, job->raw, job->rawlen);
+		numb = -1;
+		if (job->compress)
+			numb = netcomp_compress(cp->codec, job->out, cp->bound,
+					job->raw, job->rawlen);
+		/* not smaller, or not tried: it goes as is */
+		job->len = numb > 0 && numb < job->rawlen ? numb : job->rawlen;
+		pthread_mutex_lock(&cp->lock);
+		job->state = CJOB_DONE;
+		pthread_cond_broadcast(&cp->cond);
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return NULL;
+}
+
+static int cpipe_send(int sock, struct cjob *job, unsigned long *numpkts)
+{
+	struct netcomp_frame hdr;
+
+	hdr.rawlen = htobe32(job->rawlen);
+	hdr.len = htobe32(job->len);
+	hdr.crc = htobe32(job->crc);
+	return send_frame(sock, &hdr, sizeof(hdr),
+			job->len == job->rawlen ? job->raw : job->out,
+			job->len, numpkts);
+}
+
+/*
+ * Whether to compress block seq. NETCOMP_PROBE poor blocks in a row
+ * switch compression off, data that is compressed already only costs
+ * CPU; one block in NETCOMP_RETRY is still tried and a good one
+ * switches it back on.
+ */
+static int cpipe_policy(unsigned long seq, int poor)
+{
+	return poor < NETCOMP_PROBE || seq % NETCOMP_RETRY == 0;
+}
+
+static int xmit_compressed(int sock, int fd, int codec, int nthreads,
+		unsigned long *numpkts)
+{
+	struct cpipe cp;
+	struct cjob *job;
+	struct stats *cst;
+	pthread_t *ths;
+	unsigned long rseq, sseq, rawbytes;
+	ssize_t numb;
+	int i, nth, eof, poor, retv = 0;
+
+	memset(&cp, 0, sizeof(cp));
+	pthread_mutex_init(&cp.lock, NULL);
+	pthread_cond_init(&cp.cond, NULL);
+	cp.codec = codec;
+	cp.bound = netcomp_bound(codec, NETCOMP_BLOCK);
+	cp.njobs = nthreads * 2;
+	cp.jobs = calloc(cp.njobs, sizeof(struct cjob));
+	ths = calloc(nthreads, sizeof(pthread_t));
+	if (!cp.jobs || !ths) {
+		fprintf(stderr, "Out of Memory.\n");
+		retv = -1;
+		goto exit_10;
+	}
+	for (i = 0; i < cp.njobs; i++) {
+		cp.jobs[i].raw = malloc(NETCOMP_BLOCK);
+		cp.jobs[i].out = malloc(cp.bound);
+		if (!cp.jobs[i].raw || !cp.jobs[i].out) {
+			fprintf(stderr, "Out of Memory.\n");
+			retv = -1;
+			goto exit_10;
+		}
+	}
+	cst = stats_new("comp");
+	if (!cst) {
+		retv = -1;
+		goto exit_10;
+	}
+	for (nth = 0; nth < nthreads; nth++)
+		if (pthread_create(ths + nth, NULL, cpipe_worker, &cp)) {
+			fprintf(stderr, "Cannot create compression thread: " \
+					"%s\n", strerror(errno));
+			break;
+		}
+	if (nth == 0) {
+		retv = -1;
+		goto exit_10;
+	}
+
+	rseq = sseq = 0;
+	rawbytes = 0;
+	eof = 0;
+	poor = 0;
+	while (global_exit == 0) {
+		while (!eof && rseq < sseq + cp.njobs) {
+			job = cp.jobs + rseq % cp.njobs;
+			numb = read_full(fd, job->raw, NETCOMP_BLOCK);
+			if (numb == -1) {
+				fprintf(stderr, "read failed at offset %lu: " \
+						"%s\n", rawbytes,
+						strerror(errno));
+				retv = -1;
+				goto exit_20;
+			} else if (numb == 0) {
+				eof = 1;
+				break;
+			}
+			job->rawlen = numb;
+			job->compress = cpipe_policy(rseq, poor);
+			pthread_mutex_lock(&cp.lock);
+			job->state = CJOB_READY;
+			pthread_cond_broadcast(&cp.cond);
+			pthread_mutex_unlock(&cp.lock);
+			rseq++;
+		}
+		if (sseq == rseq)
+			break;
+		job = cp.jobs + sseq % cp.njobs;
+		pthread_mutex_lock(&cp.lock);
+		while (job->state != CJOB_DONE)
+			pthread_cond_wait(&cp.cond, &cp.lock);
+		pthread_mutex_unlock(&cp.lock);
+		if (cpipe_send(sock, job, numpkts) == -1) {
+			retv = -1;
+			goto exit_20;
+		}
+		if (job->compress) {
+			stats_add(&cst->calls, 1);
+			stats_add(&cst->bytes, job->rawlen);
+			if ((unsigned long)job->len * 100 >
+					(unsigned long)job->rawlen *
+					NETCOMP_POOR) {
+				if (++poor == NETCOMP_PROBE)
+					printf("Data does not compress, " \
+						"sending it as is\n");
+			} else if (poor >= NETCOMP_PROBE) {
+				printf("Compressing again at %lu\n",
+						rawbytes);
+				poor = 0;
+			} else
+				poor = 0;
+		} else
+			stats_add(&cst->stalls, 1);
+		rawbytes += job->rawlen;
+		sseq++;
+	}
+	printf("Compressed %lu bytes into %lu with %s\n", rawbytes, *numpkts,
+			netcomp_name(codec));
+
+exit_20:
+	pthread_mutex_lock(&cp.lock);
+	cp.quit = 1;
+	pthread_cond_broadcast(&cp.cond);
+	pthread_mutex_unlock(&cp.lock);
+	for (i = 0; i < nth; i++)
+		pthread_join(ths[i], NULL);
+exit_10:
+	if (cp.jobs)
+		for (i = 0; i < cp.njobs; i++) {
+			free(cp.jobs[i].raw);
+			free(cp.jobs[i].out);
+		}
+	free(cp.jobs);
+	free(ths);
+	pthread_cond_destroy(&cp.cond);
+	pthread_mutex_destroy(&cp.lock);
+	return retv;
+}
+
+struct striper {
+	int fd;
+	off_t size;
+	unsigned long next;	/* next block to hand out */
+	int err;
+};
+
+struct stripe_sender {
+	struct striper *sp;
+	pthread_t thid;
+	int sock;
+	unsigned long numbytes;
+	struct stats *st;
+	struct tcptune tune;
+};
+
+/* take blocks off the shared counter until the file is done */
+static void * stripe_xmit(void *dat)
+{
+	struct stripe_sender *ss = (struct stripe_sender *)dat;
+	struct striper *sp = ss->sp;
+	struct timespec t0;
+	off_t offset;
+	size_t len;
+	ssize_t numb;
+
+	while (sp->err == 0 && global_exit == 0) {
+		offset = (off_t)__atomic_fetch_add(&sp->next, 1,
+				__ATOMIC_RELAXED) * STRIPE_BLOCK;
+		if (offset >= sp->size)
+			break;
+		len = sp->size - offset;
+		if (len > STRIPE_BLOCK)
+			len = STRIPE_BLOCK;
+		if (stripe_send_block(ss->sock, offset, len) == -1)
+			goto err_exit_10;
+		while (len > 0) {
+			stats_now(&t0);
+			numb = sendfile(ss->sock, sp->fd, &offset, len);
+			stats_add(&ss->st->calls, 1);
+			if (numb == -1 && errno == EINTR)
+				continue;
+			if (numb <= 0) {
+				fprintf(stderr, "sendfile failed at offset " \
+						"%lld: %s\n", (long long)offset,
+						numb ? strerror(errno) :
+						"file shrank");
+				goto err_exit_10;
+			}
+			stats_lat(ss->st, &t0);
+			stats_add(&ss->st->bytes, numb);
+			tcptune_sample(&ss->tune);
+			ss->numbytes += numb;
+			len -= numb;
+		}
+	}
+	return NULL;
+
+err_exit_10:
+	sp->err = 1;
+	return NULL;
+}
+
+/*
+ * -n: sock is the first of nconn connections to ai, the file goes over
+ * all of them in STRIPE_BLOCK pieces, see stripe.h.
+ */
+static int xmit_striped(int sock, const struct addrinfo *ai, int fd,
+		int nconn, unsigned long *numpkts)
+{
+	struct stripe_sender *ss;
+	struct striper sp;
+	struct stat mst;
+	char name[16];
+	int i, nth, retv = 0;
+
+	if (fstat(fd, &mst) == -1) {
+		fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&sp, 0, sizeof(sp));
+	sp.fd = fd;
+	sp.size = mst.st_size;
+	ss = calloc(nconn, sizeof(struct stripe_sender));
+	if (!ss) {
+		fprintf(stderr, "Out of Memory.\n");
+		return -1;
+	}
+	for (i = 0; i < nconn; i++)
+		ss[i].sock = -1;
+	ss[0].sock = sock;
+	for (i = 0; i < nconn; i++) {
+		if (i > 0)
+			ss[i].sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (ss[i].sock == -1) {
+			fprintf(stderr, "Cannot create a socket: %s\n",
+					strerror(errno));
+			retv = -1;
+			goto exit_10;
+		}
+		if (i > 0 && connect(ss[i].sock, ai->ai_addr,
+					ai->ai_addrlen) == -1) {
+			fprintf(stderr, "Connect %d failed: %s\n", i,
+					strerror(errno));
+			retv = -1;
+			goto exit_10;
+		}
+		if (stripe_send_hello(ss[i].sock, nconn, i, sp.size) == -1) {
+			retv = -1;
+			goto exit_10;
+		}
+		snprintf(name, sizeof(name), "send%d", i);
+		ss[i].sp = &sp;
+		ss[i].st = i ? stats_new(name) : sst;
+		if (!ss[i].st) {
+			retv = -1;
+			goto exit_10;
+		}
+		tcptune_init(&ss[i].tune, ss[i].sock, TCPTUNE_SEND, ss[i].st);
+	}
+
+	for (nth = 0; nth < nconn; nth++)
+		if (pthread_create(&ss[nth].thid, NULL, stripe_xmit,
+					ss + nth)) {
+			fprintf(stderr, "Cannot create stripe thread: %s\n",
+					strerror(errno));
+			sp.err = 1;
+			break;
+		}
+	for (i = 0; i < nth; i++) {
+		pthread_join(ss[i].thid, NULL);
+		*numpkts += ss[i].numbytes;
+	}
+	if (sp.err)
+		retv = -1;
+
+exit_10:
+	for (i = 1; i < nconn; i++)
+		if (ss[i].sock != -1)
+			close(ss[i].sock);
+	free(ss);
+	return retv;
 }
 
 int main(int argc, char *argv[])
 {
 	struct sigaction mact;
 	int sock, sysret, retv = 0;
-	FILE *fin;
-	ssize_t numb;
+	int fin;
 	int c, finish;
 	unsigned long numpkts;
 	const char *fname, *port, *svrip;
-	char *buf;
-	int buflen, len;
+	enum xmit_engine engine;
+	int socktype;
+	unsigned long rate;
+	const char *statpath;
+	int interval, resume, nconn, cthreads, codec, check, ranged;
+	unsigned int tkbps;
 	extern char *optarg;
 	extern int optind, opterr, optopt;
 
 	svrip = NULL;
 	port = NULL;
+	engine = XMIT_AUTO;
+	socktype = SOCK_STREAM;
+	rate = 0;
+	statpath = NULL;
+	interval = 1000;
+	resume = 0;
+	nconn = 0;
+	cthreads = 0;
+	codec = NETCOMP_NONE;
+	check = 0;
+	ranged = 0;
+	tkbps = 0;
 	opterr = 0;
 	finish = 0;
 	do {
-		c = getopt(argc, argv, ":s:p:");
+		c = getopt(argc, argv, ":s:p:e:ub:S:i:rn:c:kAT:");
 		switch(c) {
 		case '?':
 			fprintf(stderr, "Unknown option: %c\n", (char)optopt);
@@ -54,6 +850,48 @@ int main(int argc, char *argv[])
 		case 'p':
 			port = optarg;
 			break;
+		case 'e':
+			if (strcmp(optarg, "sendfile") == 0)
+				engine = XMIT_SENDFILE;
+			else if (strcmp(optarg, "mmap") == 0)
+				engine = XMIT_MMAP;
+			else if (strcmp(optarg, "copy") == 0)
+				engine = XMIT_COPY;
+			else if (strcmp(optarg, "auto") == 0)
+				engine = XMIT_AUTO;
+			else
+				fprintf(stderr, "Unknown engine: %s\n", optarg);
+			break;
+		case 'u':
+			socktype = SOCK_DGRAM;
+			break;
+		case 'b':
+			rate = strtoul(optarg, NULL, 10) * 1000000 / 8;
+			break;
+		case 'S':
+			statpath = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'r':
+			resume = 1;
+			break;
+		case 'n':
+			nconn = atoi(optarg);
+			break;
+		case 'c':
+			cthreads = atoi(optarg);
+			break;
+		case 'k':
+			check = 1;
+			break;
+		case 'A':
+			ranged = 1;
+			break;
+		case 'T':
+			tkbps = strtoul(optarg, NULL, 10);
+			break;
 		case -1:
 			finish = 1;
 			break;
@@ -66,6 +904,41 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Usage: %s filename\n", argv[0]);
 		return 1;
 	}
+	if (resume && socktype == SOCK_DGRAM) {
+		fprintf(stderr, "Resume needs TCP.\n");
+		return 1;
+	}
+	if (nconn && (nconn > STRIPE_MAXCONN || resume ||
+				socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Striping needs TCP, no -r and at most %d " \
+				"connections.\n", STRIPE_MAXCONN);
+		return 1;
+	}
+	if (cthreads && (nconn || socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Compression is for a single TCP stream.\n");
+		return 1;
+	}
+	if (check && (nconn || cthreads || socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Checked blocks are for a single plain TCP " \
+				"stream, -k goes without -c -n -u.\n");
+		return 1;
+	}
+	if (ranged && (nconn || cthreads || check || resume ||
+				socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Ranges are served over a single TCP " \
+				"stream, -A goes without -n -c -k -r -u.\n");
+		return 1;
+	}
+	if (tkbps && (nconn || cthreads || check || resume || ranged ||
+				socktype == SOCK_DGRAM)) {
+		fprintf(stderr, "Transcoding makes a live TCP stream, " \
+				"-T goes without -n -c -k -r -A -u.\n");
+		return 1;
+	}
+	if (tkbps && !transcode_supported()) {
+		fprintf(stderr, "Built without GStreamer, no -T.\n");
+		return 1;
+	}
 	if (!svrip)
 		svrip = "localhost";
 	if (!port)
@@ -75,20 +948,28 @@ int main(int argc, char *argv[])
 	else
 		fname = "/etc/passwd";
 
+	if (netev_init() == -1)
+		return 1;
 	memset(&mact, 0, sizeof(mact));
 	mact.sa_handler = sig_handler;
 	if (sigaction(SIGINT, &mact, NULL) == -1 ||
-			sigaction(SIGTERM, &mact, NULL) == -1)
+			sigaction(SIGTERM, &mact, NULL) == -1 ||
+			sigaction(SIGUSR1, &mact, NULL) == -1)
 		fprintf(stderr, "Cannot install signal handler: %s\n",
 				strerror(errno));
-	fin = fopen(fname, "rb");
-	if (!fin) {
+	sst = stats_new("send");
+	if (sst == NULL)
+		return 2;
+	stats_start(statpath, interval, &global_exit);
+	fin = open(fname, O_RDONLY);
+	if (fin == -1) {
 		fprintf(stderr, "Cannot open file %s: %s\n", fname,
 				strerror(errno));
-		return 2;
+		retv = 2;
+		goto exit_5;
 	}
 
-	sock = socket(AF_INET, SOCK_STREAM, 0);
+	sock = socket(AF_INET, socktype, 0);
 	if (sock == -1) {
 		fprintf(stderr, "Cannot create a socket: %s\n", strerror(errno));
 		retv = 3;
@@ -98,7 +979,7 @@ int main(int argc, char *argv[])
 	struct addrinfo hints, *adrlst;
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_socktype = socktype;
 	hints.ai_flags = AI_NUMERICSERV;
 	sysret = getaddrinfo(svrip, port, &hints, &adrlst);
 	if (sysret != 0) {
@@ -113,36 +994,52 @@ int main(int argc, char *argv[])
 		goto exit_30;
 	}
 
-	buflen = 4096;
-	buf = malloc(buflen);
-	numpkts = 0;
-	numb = fread(buf, 1, buflen, fin);
-	while (numb > 0 && global_exit == 0) {
-		len = numb;
-		do {
-			sysret = send(sock, buf, numb, 0);
-			if (sysret == -1) {
-				if (errno == EINTR)
-					continue;
-				fprintf(stderr, "UDP send failed at offset " \
-						"%lu: %s\n", numpkts,
-						strerror(errno));
-				goto exit_40;
-			}
-			numb -= sysret;
-		} while (numb > 0 && global_exit == 0);
-		numpkts += len;
-		numb = fread(buf, 1, buflen, fin);
+	if (resume && resume_handshake(sock, fin, fname) == -1) {
+		retv = 6;
+		goto exit_30;
 	}
 
-exit_40:
+	if (cthreads > 0) {
+		if (netcomp_offer(sock, &codec) == -1) {
+			retv = 6;
+			goto exit_30;
+		}
+		if (codec == NETCOMP_NONE)
+			printf("No codec in common, sending as is\n");
+	}
+
+	numpkts = 0;
+	if (socktype == SOCK_DGRAM)
+		sysret = xmit_dgram(sock, fin, rate, &numpkts);
+	else if (nconn > 0)
+		sysret = xmit_striped(sock, adrlst, fin, nconn, &numpkts);
+	else if (codec != NETCOMP_NONE) {
+		tcptune_init(&stt, sock, TCPTUNE_SEND, sst);
+		sysret = xmit_compressed(sock, fin, codec, cthreads, &numpkts);
+	} else if (tkbps) {
+		tcptune_init(&stt, sock, TCPTUNE_SEND, sst);
+		sysret = xmit_transcoded(sock, fname, tkbps, &stt, sst,
+				&global_exit, &numpkts);
+	} else if (ranged) {
+		tcptune_init(&stt, sock, TCPTUNE_SEND, sst);
+		sysret = range_serve(sock, fin, sst, &numpkts);
+	} else if (check) {
+		tcptune_init(&stt, sock, TCPTUNE_SEND, sst);
+		sysret = xmit_checked(sock, fin, &numpkts);
+	} else {
+		tcptune_init(&stt, sock, TCPTUNE_SEND, sst);
+		sysret = xmit_file(sock, fin, engine, &numpkts);
+	}
+	if (sysret != 0)
+		retv = 5;
 	printf("Total bytes sent: %lu\n", numpkts);
-	free(buf);
 exit_30:
 	freeaddrinfo(adrlst);
 exit_20:
 	close(sock);
 exit_10:
-	fclose(fin);
+	close(fin);
+exit_5:
+	stats_stop();
 	return retv;
 }
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "stats.h"
+#include "netev.h"
+
+static struct stats *stats_list;
+static volatile sig_atomic_t stats_requested;
+
+static struct {
+	pthread_t thid;
+	int running;
+	volatile int stop;
+	volatile int *g_exit;
+	const char *path;
+	int interval_ms;
+	int kick;		/* eventfd: dump requested or stop */
+} reporter = { .kick = -1 };
+
+struct stats * stats_new(const char *name)
+{
+	struct stats *st;
+
+	st = aligned_alloc(64, sizeof(struct stats));
+	if (st == NULL) {
+		fprintf(stderr, "Out of Memory.\n");
+		return NULL;
+	}
+	memset(st, 0, sizeof(struct stats));
+	strncpy(st->name, name, sizeof(st->name) - 1);
+	stats_now(&st->last_ts);
+	st->next = __atomic_load_n(&stats_list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&stats_list, &st->next, st, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return st;
+}
+
+void stats_lat(struct stats *st, const struct timespec *t0)
+{
+	struct timespec now;
+	unsigned long usec;
+	int bkt;
+
+	stats_now(&now);
+	usec = (now.tv_sec - t0->tv_sec) * 1000000 +
+		(now.tv_nsec - t0->tv_nsec) / 1000;
+	for (bkt = 0; usec && bkt < STATS_LATBKT - 1; bkt++)
+		usec >>= 1;
+	stats_add(&st->lat[bkt], 1);
+}
+
+/* upper bound, in microseconds, of the bucket holding percentile pct */
+unsigned long stats_percentile(const unsigned long *lat, int pct)
+{
+	unsigned long sum, want, n;
+	int bkt;
+
+	for (n = 0, bkt = 0; bkt < STATS_LATBKT; bkt++)
+		n += lat[bkt];
+	if (n == 0)
+		return 0;
+	want = (n * pct + 99) / 100;
+	sum = 0;
+	for (bkt = 0; bkt < STATS_LATBKT; bkt++) {
+		sum += lat[bkt];
+		if (sum >= want)
+			break;
+	}
+	return 1UL << bkt;
+}
+
+static void stats_dump_one(FILE *fp, struct stats *st,
+		const struct timespec *now)
+{
+	unsigned long lat[STATS_LATBKT], bytes, n;
+	double secs, mbps;
+	int bkt;
+
+	bytes = __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+	secs = (now->tv_sec - st->last_ts.tv_sec) +
+		(now->tv_nsec - st->last_ts.tv_nsec) / 1e9;
+	mbps = secs > 0 ? (bytes - st->last_bytes) / secs / 1e6 : 0;
+	st->last_bytes = bytes;
+	st->last_ts = *now;
+
+	n = 0;
+	for (bkt = 0; bkt < STATS_LATBKT; bkt++) {
+		lat[bkt] = __atomic_load_n(&st->lat[bkt], __ATOMIC_RELAXED);
+		n += lat[bkt];
+	}
+	fprintf(fp, "stage=%s bytes=%lu calls=%lu eagain=%lu wakeups=%lu " \
+			"stalls=%lu mbps=%.2f writes=%lu p50_us=%lu " \
+			"p99_us=%lu ", st->name, bytes,
+			__atomic_load_n(&st->calls, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->eagain, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->wakeups, __ATOMIC_RELAXED),
+			__atomic_load_n(&st->stalls, __ATOMIC_RELAXED),
+			mbps, n, stats_percentile(lat, 50),
+			stats_percentile(lat, 99));
+	if (__atomic_load_n(&st->sockbuf, __ATOMIC_RELAXED))
+		fprintf(fp, "rtt_us=%lu bdp=%lu sockbuf=%lu lowat=%lu ",
+				__atomic_load_n(&st->rtt_us, __ATOMIC_RELAXED),
+				__atomic_load_n(&st->bdp, __ATOMIC_RELAXED),
+				__atomic_load_n(&st->sockbuf, __ATOMIC_RELAXED),
+				__atomic_load_n(&st->lowat, __ATOMIC_RELAXED));
+	if (__atomic_load_n(&st->fillmax, __ATOMIC_RELAXED))
+		fprintf(fp, "fill=%lu fillmax=%lu ",
+				__atomic_load_n(&st->fill, __ATOMIC_RELAXED),
+				__atomic_load_n(&st->fillmax, __ATOMIC_RELAXED));
+	fprintf(fp, "lat=");
+	for (bkt = 0; bkt < STATS_LATBKT; bkt++)
+		fprintf(fp, "%s%lu", bkt ? "," : "", lat[bkt]);
+	fprintf(fp, "\n");
+}
+
+void stats_dump(FILE *fp)
+{
+	struct stats *st;
+	struct timespec now, wall;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	fprintf(fp, "time=%ld.%03ld\n", (long)wall.tv_sec,
+			wall.tv_nsec / 1000000);
+	stats_now(&now);
+	for (st = __atomic_load_n(&stats_list, __ATOMIC_ACQUIRE); st;
+			st = st->next)
+		stats_dump_one(fp, st, &now);
+	fflush(fp);
+}
+
+/* async signal safe, the reporter thread does the actual dump */
+void stats_signal(void)
+{
+	int saved = errno;
+
+	stats_requested = 1;
+	if (reporter.kick != -1)
+		netev_post(reporter.kick);
+	errno = saved;
+}
+
+static void stats_write_file(const char *path)
+{
+	char tmp[256];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		fprintf(stderr, "Cannot open %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	stats_dump(fp);
+	fclose(fp);
+	if (rename(tmp, path) == -1)
+		fprintf(stderr, "Cannot rename %s: %s\n", tmp, strerror(errno));
+}
+
+/* asleep until a dump is asked for, the file is due, or stop/exit */
+static void * stats_thread(void *dat)
+{
+	struct timespec last, now;
+	struct pollfd pfd;
+	uint64_t cnt;
+	int elapsed, wait;
+
+	(void)dat;
+	pfd.fd = reporter.kick;
+	pfd.events = POLLIN;
+	stats_now(&last);
+	while (!reporter.stop && *reporter.g_exit == 0) {
+		wait = -1;
+		if (reporter.path) {
+			stats_now(&now);
+			elapsed = (now.tv_sec - last.tv_sec) * 1000 +
+				(now.tv_nsec - last.tv_nsec) / 1000000;
+			if (elapsed >= reporter.interval_ms) {
+				stats_write_file(reporter.path);
+				last = now;
+				continue;
+			}
+			wait = reporter.interval_ms - elapsed;
+		}
+		if (netev_poll(&pfd, 1, wait) > 0 &&
+				read(reporter.kick, &cnt, sizeof(cnt)) == -1)
+			fprintf(stderr, "stats kick read failed: %s\n",
+					strerror(errno));
+		if (stats_requested) {
+			stats_requested = 0;
+			stats_dump(stderr);
+		}
+	}
+	if (reporter.path)
+		stats_write_file(reporter.path);
+	return NULL;
+}
+
+/*
+ * Start the reporter: it dumps to stderr after stats_signal() and, if
+ * path is given, rewrites path atomically every interval_ms.
+ */
+int stats_start(const char *path, int interval_ms, volatile int *g_exit)
+{
+	int sysret;
+
+	reporter.path = path;
+	reporter.interval_ms = interval_ms > 0 ? interval_ms : 1000;
+	reporter.g_exit = g_exit;
+	reporter.stop = 0;
+	reporter.kick = netev_new();
+	if (reporter.kick == -1)
+		return -1;
+	sysret = pthread_create(&reporter.thid, NULL, stats_thread, NULL);
+	if (sysret) {
+		fprintf(stderr, "Cannot create stats reporter: %s\n",
+				strerror(sysret));
+		return -1;
+	}
+	reporter.running = 1;
+	return 0;
+}
+
+void stats_stop(void)
+{
+	int kick;
+
+	if (!reporter.running)
+		return;
+	reporter.stop = 1;
+	netev_post(reporter.kick);
+	pthread_join(reporter.thid, NULL);
+	reporter.running = 0;
+	kick = reporter.kick;
+	reporter.kick = -1;
+	close(kick);
+}
@@ -0,0 +1,55 @@
+#ifndef STATS_DSCAO__
+#define STATS_DSCAO__
+#include <stdio.h>
+#include <time.h>
+
+#define STATS_LATBKT	24	/* log2 microsecond buckets, last one open */
+
+/*
+ * Counters of one transfer stage. Every block has a single writer, the
+ * thread running the stage, which bumps the counters with relaxed
+ * atomic stores; the reporter only ever loads them, so nothing on the
+ * data path takes a lock.
+ */
+struct stats {
+	struct stats *next;
+	char name[16];
+	unsigned long bytes;
+	unsigned long calls;	/* recv/read/splice calls */
+	unsigned long eagain;
+	unsigned long wakeups;	/* poll/epoll returns */
+	unsigned long stalls;	/* destination full, had to wait */
+	unsigned long lat[STATS_LATBKT];	/* write latency histogram */
+	/* last socket tuning, see tcptune.h */
+	unsigned long rtt_us, bdp, sockbuf, lowat;
+	/* jitter buffer: bytes queued now and its size, see netdisp -b */
+	unsigned long fill, fillmax;
+	/* reporter private */
+	unsigned long last_bytes;
+	struct timespec last_ts;
+} __attribute__((aligned(64)));
+
+static inline void stats_add(unsigned long *cnt, unsigned long n)
+{
+	__atomic_store_n(cnt, *cnt + n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_set(unsigned long *val, unsigned long n)
+{
+	__atomic_store_n(val, n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+struct stats * stats_new(const char *name);
+void stats_lat(struct stats *st, const struct timespec *t0);
+unsigned long stats_percentile(const unsigned long *lat, int pct);
+void stats_dump(FILE *fp);
+void stats_signal(void);
+int stats_start(const char *path, int interval_ms, volatile int *g_exit);
+void stats_stop(void);
+
+#endif  /* STATS_DSCAO__ */
@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "netproc.h"
+#include "stripe.h"
+#include "stats.h"
+#include "proto.h"
+#include "tcptune.h"
+#include "netev.h"
+
+struct stripe_slot {
+	unsigned long long blk;
+	unsigned int len;
+	int full;
+};
+
+/* one striped transfer being received */
+struct stripe_rx {
+	struct commarg *arg;
+	int nconn;
+	unsigned long long size;	/* from the hellos */
+	int socks[STRIPE_MAXCONN];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int err;
+	int abortfd;			/* eventfd, posted with err */
+	int donefd;			/* eventfd, +1 per finished thread */
+	/* reorder mode, all under lock */
+	char *win;			/* nslots blocks */
+	struct stripe_slot *slots;
+	int nslots;
+	unsigned long long next;	/* next block to deliver */
+	int flushing;			/* some thread is delivering */
+};
+
+struct stripe_conn {
+	struct stripe_rx *rx;
+	pthread_t thid;
+	int sock;
+	char *buf;			/* pwrite mode */
+	unsigned long numbytes;
+	struct stats *st;
+	struct tcptune tune;
+};
+
+int stripe_send_hello(int sock, int nconn, int index, off_t size)
+{
+	struct stripe_hello msg;
+
+	msg.magic = htobe32(STRIPE_MAGIC);
+	msg.nconn = htobe32(nconn);
+	msg.index = htobe32(index);
+	msg.size = htobe64(size);
+	return proto_write(sock, &msg, sizeof(msg));
+}
+
+/* the payload follows right away, keep the header in its segment */
+int stripe_send_block(int sock, off_t offset, unsigned int len)
+{
+	struct stripe_block msg;
+	const char *p = (const char *)&msg;
+	size_t left = sizeof(msg);
+	ssize_t sysret;
+
+	msg.offset = htobe64(offset);
+	msg.len = htobe32(len);
+	while (left > 0) {
+		sysret = send(sock, p, left, MSG_MORE|MSG_NOSIGNAL);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "block header send failed: %s\n",
+					strerror(errno));
+			return -1;
+		}
+		p += sysret;
+		left -= sysret;
+	}
+	return 0;
+}
+
+static void stripe_fail(struct stripe_rx *rx)
+{
+	pthread_mutex_lock(&rx->lock);
+	rx->err = 1;
+	pthread_cond_broadcast(&rx->cond);
+	pthread_mutex_unlock(&rx->lock);
+	netev_post(rx->abortfd);
+}
+
+/* from the connection, given up when another one fails, see net_read() */
+static long stripe_read(struct stripe_conn *sc, char *buf, unsigned int len)
+{
+	return net_read(sc->sock, buf, len, sc->st, sc->rx->arg->g_exit,
+			sc->rx->abortfd, &sc->rx->err);
+}
+
+static int stripe_pwrite(int fd, const char *buf, unsigned int len,
+		off_t offset)
+{
+	ssize_t sysret;
+
+	while (len > 0) {
+		sysret = pwrite(fd, buf, len, offset);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "pwrite at %lld failed: %s\n",
+					(long long)offset, strerror(errno));
+			return -1;
+		}
+		buf += sysret;
+		len -= sysret;
+		offset += sysret;
+	}
+	return 0;
+}
+
+/* wait until blk fits in the reorder window, NULL on error or exit */
+static char * stripe_slot_wait(struct stripe_conn *sc, unsigned long long blk)
+{
+	struct stripe_rx *rx = sc->rx;
+	char *buf = NULL;
+
+	/* on exit stripe_receive() sets err and wakes us */
+	pthread_mutex_lock(&rx->lock);
+	if (blk >= rx->next + rx->nslots)
+		stats_add(&sc->st->stalls, 1);
+	while (blk >= rx->next + rx->nslots && !rx->err &&
+			*rx->arg->g_exit == 0)
+		pthread_cond_wait(&rx->cond, &rx->lock);
+	if (rx->err || *rx->arg->g_exit) {
+		pthread_mutex_unlock(&rx->lock);
+		return NULL;
+	}
+	if (blk < rx->next || rx->slots[blk % rx->nslots].full) {
+		fprintf(stderr, "Duplicate block %llu\n", blk);
+		rx->err = 1;
+		pthread_cond_broadcast(&rx->cond);
+	} else
+		buf = rx->win + (blk % rx->nslots) * STRIPE_BLOCK;
+	pthread_mutex_unlock(&rx->lock);
+	return buf;
+}
+
+/*
+ * Mark blk received. Whoever finds nobody delivering takes over and
+ * passes on blocks from next for as long as they are there, with the
+ * lock dropped while writing.
+ */
+static void stripe_slot_fill(struct stripe_rx *rx, unsigned long long blk,
+		unsigned int len)
+{
+	struct stripe_slot *slot;
+	int sysret;
+
+	pthread_mutex_lock(&rx->lock);
+	slot = rx->slots + blk % rx->nslots;
+	slot->blk = blk;
+	slot->len = len;
+	slot->full = 1;
+	if (!rx->flushing) {
+		rx->flushing = 1;
+		for (;;) {
+			slot = rx->slots + rx->next % rx->nslots;
+			if (!slot->full || rx->err)
+				break;
+			pthread_mutex_unlock(&rx->lock);
+			sysret = net_deliver(rx->arg, rx->win +
+					(rx->next % rx->nslots) * STRIPE_BLOCK,
+					slot->len);
+			pthread_mutex_lock(&rx->lock);
+			slot->full = 0;
+			rx->next++;
+			if (sysret == -1)
+				rx->err = 1;
+			pthread_cond_broadcast(&rx->cond);
+		}
+		rx->flushing = 0;
+	}
+	pthread_mutex_unlock(&rx->lock);
+}
+
+static void * stripe_conn_main(void *dat)
+{
+	struct stripe_conn *sc = (struct stripe_conn *)dat;
+	struct stripe_rx *rx = sc->rx;
+	struct stripe_block hdr;
+	unsigned long long offset;
+	unsigned int len;
+	struct timespec t0;
+	char *buf;
+	int sysret;
+
+	while (!rx->err && *rx->arg->g_exit == 0) {
+		sysret = stripe_read(sc, (char *)&hdr, sizeof(hdr));
+		if (sysret == 0)
+			break;
+		else if (sysret == -1)
+			goto err_exit_10;
+		offset = be64toh(hdr.offset);
+		len = be32toh(hdr.len);
+		if (offset % STRIPE_BLOCK || len == 0 || len > STRIPE_BLOCK ||
+				offset + len > rx->size) {
+			fprintf(stderr, "Bad block at %llu, length %u\n",
+					offset, len);
+			goto err_exit_10;
+		}
+		if (rx->arg->stripe_fd > 0)
+			buf = sc->buf;
+		else
+			buf = stripe_slot_wait(sc, offset / STRIPE_BLOCK);
+		if (buf == NULL || stripe_read(sc, buf, len) != len)
+			goto err_exit_10;
+		sc->numbytes += len;
+		stats_add(&sc->st->bytes, len);
+		tcptune_sample(&sc->tune);
+		if (rx->arg->stripe_fd > 0) {
+			stats_now(&t0);
+			if (stripe_pwrite(rx->arg->stripe_fd, buf, len,
+						offset) == -1)
+				goto err_exit_10;
+			stats_lat(sc->st, &t0);
+		} else
+			stripe_slot_fill(rx, offset / STRIPE_BLOCK, len);
+	}
+	netev_post(rx->donefd);
+	return NULL;
+
+err_exit_10:
+	stripe_fail(rx);
+	netev_post(rx->donefd);
+	return NULL;
+}
+
+/* collect all connections of the transfer, in hello index order */
+static int stripe_accept(int lsock, struct stripe_rx *rx)
+{
+	struct stripe_hello hello;
+	struct pollfd pfd;
+	unsigned int nconn, index;
+	unsigned long long size;
+	int sock, sysret, accepted;
+
+	pfd.fd = lsock;
+	pfd.events = POLLIN;
+	accepted = 0;
+	do {
+		/* the first may come any time, the rest follow it */
+		sysret = netev_poll(&pfd, 1, accepted ? PROTO_TIMEOUT : -1);
+		if (sysret == -1 && errno != EINTR) {
+			fprintf(stderr, "poll accept failed: %s\n",
+					strerror(errno));
+			return -1;
+		} else if (sysret <= 0) {
+			if (accepted && sysret == 0 && *rx->arg->g_exit == 0) {
+				fprintf(stderr, "Only %d of %d striped " \
+						"connections came\n",
+						accepted, rx->nconn);
+				return -1;
+			}
+			continue;
+		}
+		sock = accept(lsock, NULL, NULL);
+		if (sock == -1) {
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (proto_read(sock, &hello, sizeof(hello)) == -1)
+			goto err_exit_10;
+		nconn = be32toh(hello.nconn);
+		index = be32toh(hello.index);
+		size = be64toh(hello.size);
+		if (be32toh(hello.magic) != STRIPE_MAGIC) {
+			fprintf(stderr, "Peer is not striping, -n on both " \
+					"sides?\n");
+			goto err_exit_10;
+		}
+		/* both from the wire, unsigned so that no index is below 0 */
+		if (nconn < 1 || nconn > STRIPE_MAXCONN || index >= nconn ||
+				(accepted && ((int)nconn != rx->nconn ||
+					size != rx->size)) ||
+				rx->socks[index] != -1) {
+			fprintf(stderr, "Bad stripe %u of %u\n", index, nconn);
+			goto err_exit_10;
+		}
+		rx->nconn = nconn;
+		rx->size = size;
+		rx->socks[index] = sock;
+		accepted++;
+	} while ((accepted == 0 || accepted < rx->nconn) &&
+			*rx->arg->g_exit == 0);
+	return accepted && accepted == rx->nconn ? 0 : -1;
+
+err_exit_10:
+	close(sock);
+	return -1;
+}
+
+int stripe_receive(int lsock, struct commarg *arg, unsigned long *numpkts)
+{
+	struct stripe_rx rx;
+	struct stripe_conn *conns;
+	char name[16];
+	unsigned long long total;
+	int i, nth, done, retv = 0;
+	long cnt;
+
+	memset(&rx, 0, sizeof(rx));
+	rx.arg = arg;
+	for (i = 0; i < STRIPE_MAXCONN; i++)
+		rx.socks[i] = -1;
+	pthread_mutex_init(&rx.lock, NULL);
+	pthread_cond_init(&rx.cond, NULL);
+	conns = NULL;
+	rx.abortfd = netev_new();
+	rx.donefd = netev_new();
+	if (rx.abortfd == -1 || rx.donefd == -1 ||
+			stripe_accept(lsock, &rx) == -1) {
+		retv = -1;
+		goto exit_10;
+	}
+	conns = calloc(rx.nconn, sizeof(struct stripe_conn));
+	if (arg->stripe_fd <= 0) {
+		rx.nslots = rx.nconn * STRIPE_WINDOW;
+		rx.win = malloc((size_t)rx.nslots * STRIPE_BLOCK);
+		rx.slots = calloc(rx.nslots, sizeof(struct stripe_slot));
+	}
+	if (!conns || (arg->stripe_fd <= 0 && (!rx.win || !rx.slots))) {
+		fprintf(stderr, "Out of Memory.\n");
+		retv = -1;
+		goto exit_10;
+	}
+	printf("Receiving over %d connections\n", rx.nconn);
+
+	for (nth = 0; nth < rx.nconn; nth++) {
+		conns[nth].rx = &rx;
+		conns[nth].sock = rx.socks[nth];
+		snprintf(name, sizeof(name), "%.12s%d", arg->st->name, nth);
+		conns[nth].st = nth ? stats_new(name) : arg->st;
+		if (!conns[nth].st) {
+			stripe_fail(&rx);
+			break;
+		}
+		tcptune_init(&conns[nth].tune, conns[nth].sock, TCPTUNE_RECV,
+				conns[nth].st);
+		if (arg->stripe_fd > 0) {
+			conns[nth].buf = malloc(STRIPE_BLOCK);
+			if (!conns[nth].buf) {
+				fprintf(stderr, "Out of Memory.\n");
+				stripe_fail(&rx);
+				break;
+			}
+		}
+		if (pthread_create(&conns[nth].thid, NULL, stripe_conn_main,
+					conns + nth)) {
+			fprintf(stderr, "Cannot create stripe thread: %s\n",
+					strerror(errno));
+			free(conns[nth].buf);
+			stripe_fail(&rx);
+			break;
+		}
+	}
+	for (done = 0; done < nth; done += cnt) {
+		cnt = netev_wait(rx.donefd);
+		if (cnt <= 0) {
+			stripe_fail(&rx);
+			break;
+		}
+	}
+	total = 0;
+	for (i = 0; i < nth; i++) {
+		pthread_join(conns[i].thid, NULL);
+		total += conns[i].numbytes;
+		free(conns[i].buf);
+	}
+	*numpkts += total;
+	if (!rx.err && rx.slots) {
+		for (i = 0; i < rx.nslots; i++)
+			if (rx.slots[i].full) {
+				fprintf(stderr, "Block %llu missing\n",
+						rx.next);
+				rx.err = 1;
+				break;
+			}
+	}
+	/* every connection at EOF, but the sender may have given up */
+	if (!rx.err && *arg->g_exit == 0 && total != rx.size) {
+		fprintf(stderr, "Striped transfer ended at %llu of %llu " \
+				"bytes\n", total, rx.size);
+		rx.err = 1;
+	}
+	if (rx.err || *arg->g_exit)
+		retv = -1;
+
+exit_10:
+	for (i = 0; i < STRIPE_MAXCONN; i++)
+		if (rx.socks[i] != -1)
+			close(rx.socks[i]);
+	free(conns);
+	free(rx.slots);
+	free(rx.win);
+	if (rx.abortfd != -1)
+		close(rx.abortfd);
+	if (rx.donefd != -1)
+		close(rx.donefd);
+	pthread_cond_destroy(&rx.cond);
+	pthread_mutex_destroy(&rx.lock);
+	return retv;
+}
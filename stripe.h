@@ -0,0 +1,45 @@
+#ifndef STRIPE_DSCAO__
+#define STRIPE_DSCAO__
+#include <sys/types.h>
+
+#define STRIPE_MAGIC	0x4e475354	/* "NGST" */
+#define STRIPE_BLOCK	(1024*1024)
+#define STRIPE_MAXCONN	64
+#define STRIPE_WINDOW	4		/* reorder blocks per connection */
+
+/*
+ * Striped transfer over nconn TCP connections, netplay -n / netfile -n.
+ * Every connection opens with a stripe_hello giving the file size, then
+ * carries blocks, each a stripe_block header and len bytes of the file
+ * at offset. Block k covers [k * STRIPE_BLOCK, (k + 1) * STRIPE_BLOCK),
+ * the senders take them in increasing order from a shared counter and
+ * a connection ends with EOF after its last block. The transfer is
+ * complete only when the blocks add up to size. All fields are big
+ * endian.
+ */
+struct stripe_hello {
+	unsigned int magic;
+	unsigned int nconn;
+	unsigned int index;
+	unsigned long long size;
+} __attribute__((packed));
+
+struct stripe_block {
+	unsigned long long offset;
+	unsigned int len;
+} __attribute__((packed));
+
+struct commarg;
+
+int stripe_send_hello(int sock, int nconn, int index, off_t size);
+int stripe_send_block(int sock, off_t offset, unsigned int len);
+
+/*
+ * Accept the connections of one striped transfer on lsock and receive
+ * it. With arg->stripe_fd the blocks are pwrite()n there as they come,
+ * otherwise they pass a reorder window and go to arg->sink or
+ * arg->dstfd in file order. -1 if it failed or did not come complete.
+ */
+int stripe_receive(int lsock, struct commarg *arg, unsigned long *numpkts);
+
+#endif  /* STRIPE_DSCAO__ */
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include "tcptune.h"
+
+static int tcptune_getbuf(struct tcptune *tt)
+{
+	int opt, val;
+	socklen_t len;
+
+	opt = tt->dir == TCPTUNE_SEND ? SO_SNDBUF : SO_RCVBUF;
+	len = sizeof(val);
+	if (getsockopt(tt->sock, SOL_SOCKET, opt, &val, &len) == -1)
+		return -1;
+	/* the kernel reports twice what was asked for, half is overhead */
+	return val / 2;
+}
+
+void tcptune_init(struct tcptune *tt, int sock, enum tcptune_dir dir,
+		struct stats *st)
+{
+	struct tcp_info ti;
+	socklen_t len;
+	int val;
+
+	memset(tt, 0, sizeof(struct tcptune));
+	tt->sock = sock;
+	tt->dir = dir;
+	tt->st = st;
+	len = sizeof(ti);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1 ||
+			len < offsetof(struct tcp_info, tcpi_delivery_rate) +
+			sizeof(ti.tcpi_delivery_rate)) {
+		tt->sock = -1;
+		return;
+	}
+	tt->last_bytes = ti.tcpi_bytes_received;
+	stats_now(&tt->last);
+	val = tcptune_getbuf(tt);
+	if (val > 0)
+		tt->bufsz = val;
+	stats_set(&st->sockbuf, tt->bufsz);
+	if (dir == TCPTUNE_SEND) {
+		val = 1;
+		if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val,
+					sizeof(val)) == -1)
+			fprintf(stderr, "Cannot set TCP_NODELAY: %s\n",
+					strerror(errno));
+	}
+}
+
+/* more than a quarter off */
+static int tcptune_differs(unsigned long cur, unsigned long want)
+{
+	return want > cur + cur / 4 || want < cur - cur / 4;
+}
+
+void tcptune_update(struct tcptune *tt, const struct timespec *now)
+{
+	struct tcp_info ti;
+	socklen_t len;
+	unsigned long long msecs;
+	unsigned long want;
+	int val, opt;
+
+	len = sizeof(ti);
+	if (getsockopt(tt->sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1) {
+		tt->sock = -1;
+		return;
+	}
+	msecs = (now->tv_sec - tt->last.tv_sec) * 1000 +
+		(now->tv_nsec - tt->last.tv_nsec) / 1000000;
+	tt->last = *now;
+	if (tt->dir == TCPTUNE_SEND) {
+		tt->rtt_us = ti.tcpi_rtt;
+		/* app limited samples say more about us than the path */
+		if (!ti.tcpi_delivery_rate_app_limited)
+			tt->rate = ti.tcpi_delivery_rate;
+	} else {
+		tt->rtt_us = ti.tcpi_rcv_rtt ? ti.tcpi_rcv_rtt : ti.tcpi_rtt;
+		if (msecs > 0)
+			tt->rate = (ti.tcpi_bytes_received - tt->last_bytes) *
+				1000 / msecs;
+		tt->last_bytes = ti.tcpi_bytes_received;
+	}
+	tt->bdp = (unsigned long long)tt->rate * tt->rtt_us / 1000000;
+	stats_set(&tt->st->rtt_us, tt->rtt_us);
+	stats_set(&tt->st->bdp, tt->bdp);
+	if (tt->bdp == 0)
+		return;
+
+	/* autotuning may have grown it since the last look */
+	val = tcptune_getbuf(tt);
+	if (val > 0 && (unsigned long)val != tt->bufsz) {
+		tt->bufsz = val;
+		stats_set(&tt->st->sockbuf, tt->bufsz);
+	}
+	want = tt->bdp * 2;
+	if (want > TCPTUNE_MAXBUF)
+		want = TCPTUNE_MAXBUF;
+	if (want > tt->bufsz && tcptune_differs(tt->bufsz, want)) {
+		opt = tt->dir == TCPTUNE_SEND ? SO_SNDBUF : SO_RCVBUF;
+		val = want;
+		if (setsockopt(tt->sock, SOL_SOCKET, opt, &val,
+					sizeof(val)) == 0) {
+			/* may be capped by net.core.[rw]mem_max */
+			val = tcptune_getbuf(tt);
+			if (val > 0)
+				tt->bufsz = val;
+			stats_set(&tt->st->sockbuf, tt->bufsz);
+		}
+	}
+
+	if (tt->dir != TCPTUNE_SEND)
+		return;
+	want = tt->bdp;
+	if (want < TCPTUNE_MINLOWAT)
+		want = TCPTUNE_MINLOWAT;
+	if (tt->lowat == 0 || tcptune_differs(tt->lowat, want)) {
+		val = want;
+		if (setsockopt(tt->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val,
+					sizeof(val)) == 0) {
+			tt->lowat = want;
+			stats_set(&tt->st->lowat, tt->lowat);
+		}
+	}
+}
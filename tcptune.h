@@ -0,0 +1,52 @@
+#ifndef TCPTUNE_DSCAO__
+#define TCPTUNE_DSCAO__
+#include <time.h>
+#include "stats.h"
+
+#define TCPTUNE_PERIOD	200		/* ms between TCP_INFO samples */
+#define TCPTUNE_MAXBUF	(64*1024*1024)
+#define TCPTUNE_MINLOWAT	(128*1024)
+
+enum tcptune_dir {
+	TCPTUNE_SEND, TCPTUNE_RECV
+};
+
+/*
+ * Socket buffer sizing from the measured bandwidth-delay product. The
+ * data loop calls tcptune_sample() as often as it likes; every
+ * TCPTUNE_PERIOD it reads TCP_INFO, takes the smoothed RTT and the
+ * delivery rate (the sender's estimate, or the receive rate on the
+ * receiving side) and grows SO_SNDBUF/SO_RCVBUF to twice the BDP once
+ * that exceeds what the kernel autotuned. Buffers are never shrunk and
+ * left alone while autotuning keeps up, setting them turns it off. A
+ * sender also gets TCP_NODELAY and a TCP_NOTSENT_LOWAT of one BDP (at
+ * least TCPTUNE_MINLOWAT), so no more than that sits unsent in the
+ * socket. The values chosen are published in st.
+ */
+struct tcptune {
+	int sock;		/* -1: not a TCP socket or TCP_INFO missing */
+	enum tcptune_dir dir;
+	struct stats *st;
+	struct timespec last;
+	unsigned long long last_bytes;	/* receiver: tcpi_bytes_received */
+	unsigned long rtt_us, rate, bdp, bufsz, lowat;
+};
+
+void tcptune_init(struct tcptune *tt, int sock, enum tcptune_dir dir,
+		struct stats *st);
+void tcptune_update(struct tcptune *tt, const struct timespec *now);
+
+static inline void tcptune_sample(struct tcptune *tt)
+{
+	struct timespec now;
+
+	if (tt->sock == -1)
+		return;
+	stats_now(&now);
+	if ((now.tv_sec - tt->last.tv_sec) * 1000 +
+			(now.tv_nsec - tt->last.tv_nsec) / 1000000 >=
+			TCPTUNE_PERIOD)
+		tcptune_update(tt, &now);
+}
+
+#endif  /* TCPTUNE_DSCAO__ */
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#ifdef HAVE_GST
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#endif
+#include "transcode.h"
+#include "netev.h"
+
+#ifndef HAVE_GST
+int transcode_supported(void)
+{
+	return 0;
+}
+
+int xmit_transcoded(int sock, const char *fname, unsigned int kbps,
+		struct tcptune *tt, struct stats *st, volatile int *g_exit,
+		unsigned long *numpkts)
+{
+	(void)sock;
+	(void)fname;
+	(void)kbps;
+	(void)tt;
+	(void)st;
+	(void)g_exit;
+	(void)numpkts;
+	fprintf(stderr, "Built without GStreamer, cannot transcode.\n");
+	return -1;
+}
+#else
+struct transcode {
+	GstElement *pipeline;
+	GstElement *source, *decoder;
+	GstElement *v_queue, *v_convert, *scale, *capsf, *venc;
+	GstElement *a_queue, *a_convert, *resample, *aenc;
+	GstElement *mux, *appsink;
+	int width, height;	/* decoded picture, 0 until known */
+	unsigned int max_kbps, kbps;
+	int level;		/* picture scaled by 1 / (1 << level) */
+	int hold;		/* periods until the size may change again */
+	int clean;		/* uncongested periods in a row */
+	int last_unsent;
+	long blocked_us;	/* in send() this period */
+	struct timespec last;
+	int sock;
+	struct tcptune *tt;
+	struct stats *st;
+	volatile int *g_exit;
+	GstBus *bus;
+	int stopfd;		/* eventfd, the sending loop is done */
+	int err;		/* the pipeline posted an error */
+};
+
+int transcode_supported(void)
+{
+	return 1;
+}
+
+static long elapsed_us(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000 +
+		(t1->tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/* link a decoded stream to its encoder, and that to the muxer */
+static void transcode_pad_added(GstElement *src, GstPad *pad,
+		struct transcode *tc)
+{
+	GstPad *sink_pad = NULL;
+	GstCaps *caps;
+	GstStructure *st;
+	GstElement *enc;
+	const gchar *type;
+
+	(void)src;
+	caps = gst_pad_get_current_caps(pad);
+	st = gst_caps_get_structure(caps, 0);
+	type = gst_structure_get_name(st);
+	if (g_str_has_prefix(type, "video/x-raw")) {
+		gst_structure_get_int(st, "width", &tc->width);
+		gst_structure_get_int(st, "height", &tc->height);
+		sink_pad = gst_element_get_static_pad(tc->v_queue, "sink");
+		enc = tc->venc;
+	} else if (g_str_has_prefix(type, "audio/x-raw")) {
+		sink_pad = gst_element_get_static_pad(tc->a_queue, "sink");
+		enc = tc->aenc;
+	} else {
+		g_print("Not transcoding a stream of type '%s'.\n", type);
+		goto exit_10;
+	}
+	if (gst_pad_is_linked(sink_pad)) {
+		g_print("Already transcoding a '%s' stream.\n", type);
+		goto exit_10;
+	}
+	if (GST_PAD_LINK_FAILED(gst_pad_link(pad, sink_pad)) ||
+			gst_element_link(enc, tc->mux) != TRUE)
+		g_printerr("Cannot link the '%s' stream.\n", type);
+
+exit_10:
+	if (sink_pad)
+		gst_object_unref(sink_pad);
+	gst_caps_unref(caps);
+}
+
+/*
+ * filesrc ! decodebin, then video: queue ! videoconvert ! videoscale !
+ * capsfilter ! x264enc and audio: queue ! audioconvert ! audioresample !
+ * opusenc, each linked into mpegtsmux ! appsink once decodebin has
+ * such a stream. The appsink syncs to the clock, so it is paced like
+ * a live source.
+ */
+static int transcode_build(struct transcode *tc, const char *fname)
+{
+	tc->pipeline = gst_pipeline_new("transcode");
+	tc->source = gst_element_factory_make("filesrc", "source");
+	tc->decoder = gst_element_factory_make("decodebin", "decoder");
+	tc->v_queue = gst_element_factory_make("queue", "v_queue");
+	tc->v_convert = gst_element_factory_make("videoconvert", "v_convert");
+	tc->scale = gst_element_factory_make("videoscale", "scale");
+	tc->capsf = gst_element_factory_make("capsfilter", "capsf");
+	tc->venc = gst_element_factory_make("x264enc", "venc");
+	tc->a_queue = gst_element_factory_make("queue", "a_queue");
+	tc->a_convert = gst_element_factory_make("audioconvert", "a_convert");
+	tc->resample = gst_element_factory_make("audioresample", "resample");
+	tc->aenc = gst_element_factory_make("opusenc", "aenc");
+	tc->mux = gst_element_factory_make("mpegtsmux", "mux");
+	tc->appsink = gst_element_factory_make("appsink", "appsink");
+	if (!tc->pipeline || !tc->source || !tc->decoder || !tc->v_queue ||
+			!tc->v_convert || !tc->scale || !tc->capsf ||
+			!tc->venc || !tc->a_queue || !tc->a_convert ||
+			!tc->resample || !tc->aenc || !tc->mux ||
+			!tc->appsink) {
+		g_printerr("Not all elements could be created, transcoding " \
+				"needs x264enc, opusenc and mpegtsmux.\n");
+		return -1;
+	}
+	gst_bin_add_many(GST_BIN(tc->pipeline), tc->source, tc->decoder,
+			tc->v_queue, tc->v_convert, tc->scale, tc->capsf,
+			tc->venc, tc->a_queue, tc->a_convert, tc->resample,
+			tc->aenc, tc->mux, tc->appsink, NULL);
+	if (gst_element_link(tc->source, tc->decoder) != TRUE ||
+			gst_element_link_many(tc->v_queue, tc->v_convert,
+				tc->scale, tc->capsf, tc->venc,
+				NULL) != TRUE ||
+			gst_element_link_many(tc->a_queue, tc->a_convert,
+				tc->resample, tc->aenc, NULL) != TRUE ||
+			gst_element_link(tc->mux, tc->appsink) != TRUE) {
+		g_printerr("Elements could not be linked.\n");
+		return -1;
+	}
+	g_object_set(tc->source, "location", fname, NULL);
+	/* tune=zerolatency, speed-preset=ultrafast, a key frame every 2 s */
+	g_object_set(tc->venc, "tune", 4, "speed-preset", 1,
+			"bitrate", tc->kbps, "key-int-max", 60, NULL);
+	g_object_set(tc->appsink, "sync", TRUE, "max-buffers", 64,
+			"drop", FALSE, NULL);
+	g_signal_connect(tc->decoder, "pad-added",
+			G_CALLBACK(transcode_pad_added), tc);
+	return 0;
+}
+
+static void transcode_scale(struct transcode *tc, int level)
+{
+	GstCaps *caps;
+
+	caps = gst_caps_new_simple("video/x-raw",
+			"width", G_TYPE_INT, (tc->width >> level) & ~1,
+			"height", G_TYPE_INT, (tc->height >> level) & ~1,
+			NULL);
+	g_object_set(tc->capsf, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	tc->level = level;
+	tc->hold = TRANSCODE_HOLD;
+	printf("Picture now %dx%d\n", (tc->width >> level) & ~1,
+			(tc->height >> level) & ~1);
+}
+
+/* once per TCPTUNE_PERIOD: follow the link with bitrate and size */
+static void transcode_adapt(struct transcode *tc)
+{
+	struct timespec now;
+	long us;
+	int unsent, level;
+	unsigned int kbps, cap;
+
+	stats_now(&now);
+	us = elapsed_us(&tc->last, &now);
+	if (us < TCPTUNE_PERIOD * 1000)
+		return;
+	if (ioctl(tc->sock, SIOCOUTQNSD, &unsent) == -1)
+		unsent = 0;
+	kbps = tc->kbps;
+	if ((unsent > tc->last_unsent &&
+				(unsigned long)unsent > tc->tt->lowat) ||
+			tc->blocked_us * 2 > us) {
+		kbps = kbps * 3 / 4;
+		cap = tc->tt->rate * 8 / 1000 * 9 / 10;
+		if (cap && cap < kbps)
+			kbps = cap;
+		tc->clean = 0;
+	} else if (++tc->clean >= TRANSCODE_PROBE) {
+		kbps += tc->max_kbps / 16;
+		tc->clean = 0;
+	}
+	if (kbps < tc->max_kbps / TRANSCODE_RANGE)
+		kbps = tc->max_kbps / TRANSCODE_RANGE;
+	if (kbps > tc->max_kbps)
+		kbps = tc->max_kbps;
+	if (kbps != tc->kbps) {
+		tc->kbps = kbps;
+		g_object_set(tc->venc, "bitrate", kbps, NULL);
+		printf("Video bitrate now %u kbit/s\n", kbps);
+	}
+
+	level = kbps <= tc->max_kbps / 4 ? 2 : kbps <= tc->max_kbps / 2;
+	if (tc->hold > 0)
+		tc->hold--;
+	else if (level != tc->level && tc->width > 0)
+		transcode_scale(tc, level);
+
+	tc->last_unsent = unsent;
+	tc->blocked_us = 0;
+	tc->last = now;
+}
+
+/*
+ * Asleep on the bus and the exit event. On exit or a pipeline error it
+ * takes the pipeline down, which returns the pull blocked in
+ * xmit_transcoded() empty handed.
+ */
+static void * transcode_watch(void *dat)
+{
+	struct transcode *tc = (struct transcode *)dat;
+	struct pollfd pfd[2];
+	GPollFD busfd;
+	GstMessage *msg;
+	GError *err;
+	gchar *debug_info;
+	int sysret;
+
+	gst_bus_get_pollfd(tc->bus, &busfd);
+	pfd[0].fd = busfd.fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = tc->stopfd;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		sysret = netev_poll(pfd, 2, -1);
+		if (sysret == -1 && errno == EINTR)
+			continue;
+		if (sysret == -1) {
+			fprintf(stderr, "poll bus failed: %s\n",
+					strerror(errno));
+			tc->err = 1;
+			break;
+		} else if (sysret == 0 || pfd[1].revents)
+			break;
+		/* all of them, the fd stays readable while any is queued */
+		while ((msg = gst_bus_pop(tc->bus)) != NULL) {
+			if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+				gst_message_parse_error(msg, &err,
+						&debug_info);
+				g_printerr("Error received from element " \
+						"%s: %s\n",
+						GST_OBJECT_NAME(msg->src),
+						err->message);
+				g_clear_error(&err);
+				g_free(debug_info);
+				tc->err = 1;
+			}
+			gst_message_unref(msg);
+		}
+		if (tc->err)
+			break;
+	}
+	gst_element_set_state(tc->pipeline, GST_STATE_NULL);
+	return NULL;
+}
+
+static int transcode_send(struct transcode *tc, const char *buf, size_t len,
+		unsigned long *numpkts)
+{
+	ssize_t sysret;
+	struct timespec t0, t1;
+
+	while (len > 0 && *tc->g_exit == 0) {
+		stats_now(&t0);
+		sysret = send(tc->sock, buf, len, 0);
+		stats_add(&tc->st->calls, 1);
+		if (sysret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "send failed at offset %lu: %s\n",
+					*numpkts, strerror(errno));
+			return -1;
+		}
+		stats_now(&t1);
+		tc->blocked_us += elapsed_us(&t0, &t1);
+		stats_lat(tc->st, &t0);
+		stats_add(&tc->st->bytes, sysret);
+		tcptune_sample(tc->tt);
+		buf += sysret;
+		len -= sysret;
+		*numpkts += sysret;
+	}
+	return 0;
+}
+
+int xmit_transcoded(int sock, const char *fname, unsigned int kbps,
+		struct tcptune *tt, struct stats *st, volatile int *g_exit,
+		unsigned long *numpkts)
+{
+	struct transcode tc;
+	GstSample *sample;
+	GstBuffer *buf;
+	GstMapInfo map;
+	pthread_t thid;
+	int retv = 0;
+
+	gst_init(NULL, NULL);
+	memset(&tc, 0, sizeof(tc));
+	tc.stopfd = -1;
+	tc.max_kbps = tc.kbps = kbps;
+	tc.sock = sock;
+	tc.tt = tt;
+	tc.st = st;
+	tc.g_exit = g_exit;
+	if (transcode_build(&tc, fname) == -1) {
+		retv = -1;
+		goto exit_10;
+	}
+	if (gst_element_set_state(tc.pipeline, GST_STATE_PLAYING) ==
+			GST_STATE_CHANGE_FAILURE) {
+		g_printerr("Unable to start transcoding %s.\n", fname);
+		retv = -1;
+		goto exit_10;
+	}
+	tc.stopfd = netev_new();
+	if (tc.stopfd == -1) {
+		retv = -1;
+		goto exit_20;
+	}
+	tc.bus = gst_element_get_bus(tc.pipeline);
+	if (pthread_create(&thid, NULL, transcode_watch, &tc)) {
+		fprintf(stderr, "Cannot create bus thread: %s\n",
+				strerror(errno));
+		retv = -1;
+		goto exit_20;
+	}
+	stats_now(&tc.last);
+	while (*g_exit == 0) {
+		/* NULL at the end, or once transcode_watch() stopped it all */
+		sample = gst_app_sink_pull_sample(GST_APP_SINK(tc.appsink));
+		if (sample == NULL) {
+			if (tc.err)
+				retv = -1;
+			break;
+		}
+		buf = gst_sample_get_buffer(sample);
+		gst_buffer_map(buf, &map, GST_MAP_READ);
+		retv = transcode_send(&tc, (const char *)map.data, map.size,
+				numpkts);
+		gst_buffer_unmap(buf, &map);
+		gst_sample_unref(sample);
+		if (retv == -1)
+			break;
+		transcode_adapt(&tc);
+	}
+	netev_post(tc.stopfd);
+	pthread_join(thid, NULL);
+
+exit_20:
+	gst_element_set_state(tc.pipeline, GST_STATE_NULL);
+	if (tc.bus)
+		gst_object_unref(tc.bus);
+	if (tc.stopfd != -1)
+		close(tc.stopfd);
+exit_10:
+	if (tc.pipeline)
+		gst_object_unref(tc.pipeline);
+	return retv;
+}
+#endif
@@ -0,0 +1,26 @@
+#ifndef TRANSCODE_DSCAO__
+#define TRANSCODE_DSCAO__
+#include "stats.h"
+#include "tcptune.h"
+
+#define TRANSCODE_RANGE	16	/* bitrate goes down to max / this */
+#define TRANSCODE_PROBE	10	/* clear periods before stepping up */
+#define TRANSCODE_HOLD	10	/* periods between picture size changes */
+
+/*
+ * netplay -T kbps: instead of the file's bytes send a live re-encoding,
+ * paced at playback speed: H.264 video of at most kbps kbit/s and Opus
+ * audio in MPEG-TS, which any netdisp decodes as is. Every
+ * TCPTUNE_PERIOD the video bitrate follows the link: unsent bytes in
+ * the socket (SIOCOUTQNSD) growing past the TCP_NOTSENT_LOWAT, or
+ * send() blocking half the period, cut it to 3/4 and to 90% of the
+ * TCP_INFO delivery rate; TRANSCODE_PROBE quiet periods in a row raise
+ * it by max / 16. Under max / 2 the picture is scaled to half size,
+ * under max / 4 to a quarter. Needs GStreamer at build time, HAVE_GST.
+ */
+int transcode_supported(void);
+int xmit_transcoded(int sock, const char *fname, unsigned int kbps,
+		struct tcptune *tt, struct stats *st, volatile int *g_exit,
+		unsigned long *numpkts);
+
+#endif  /* TRANSCODE_DSCAO__ */